@@ -0,0 +1,174 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) [2017] [Marco Russi]
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+
+
+
+
+
+/* ------------ Inclusions ---------------- */
+
+#include <string.h>
+#include <openthread/link.h>
+#include <openthread/platform/alarm.h>
+#include "channel_scan.h"
+
+
+
+
+/* ---------------- local constants -----------------  */
+
+/* mask of the scanned channels */
+#define CHANNEL_SCAN_MASK					(((1UL << CHANNEL_SCAN_CHANNELS_NUM) - 1) << CHANNEL_SCAN_FIRST)
+
+
+
+
+/* ---------------- local functions prototypes ----------------  */
+
+static void channel_scan_network_handler	(otActiveScanResult *, void *);
+static void channel_scan_energy_handler		(otEnergyScanResult *, void *);
+static void channel_scan_end					(channel_scan_t *);
+
+
+
+
+/* ------------------- local functions implementation ------------------ */
+
+/* Active scan result: a beacon of a network with the PAN ID gives its channel */
+static void channel_scan_network_handler(otActiveScanResult * p_result, void * p_context)
+{
+	channel_scan_t * p_scan = p_context;
+
+	if (p_result != NULL)
+	{
+		if ((p_result->mPanId == p_scan->pan_id) && (false == p_scan->network_found))
+		{
+			p_scan->network_found = true;
+			p_scan->channel = p_result->mChannel;
+		}
+		return;
+	}
+
+	/* end of the active scan */
+	if (true == p_scan->network_found)
+	{
+		channel_scan_end(p_scan);
+	}
+	else
+	{
+		p_scan->state = CHANNEL_SCAN_ENERGY;
+		if (otLinkEnergyScan(p_scan->p_instance,
+									CHANNEL_SCAN_MASK,
+									CHANNEL_SCAN_DURATION,
+									channel_scan_energy_handler,
+									p_scan) != OT_ERROR_NONE)
+		{
+			channel_scan_end(p_scan);
+		}
+	}
+}
+
+
+/* Energy scan result: one call for each channel, then a last one with no result */
+static void channel_scan_energy_handler(otEnergyScanResult * p_result, void * p_context)
+{
+	channel_scan_t * p_scan = p_context;
+	uint8_t          i;
+
+	if (p_result != NULL)
+	{
+		if ((p_result->mChannel >= CHANNEL_SCAN_FIRST) && (p_result->mChannel <= CHANNEL_SCAN_LAST))
+		{
+			p_scan->max_rssi[p_result->mChannel - CHANNEL_SCAN_FIRST] = p_result->mMaxRssi;
+		}
+		return;
+	}
+
+	/* quietest channel */
+	for (i = 0; i < CHANNEL_SCAN_CHANNELS_NUM; i++)
+	{
+		if (p_scan->max_rssi[i] < p_scan->max_rssi[p_scan->channel - CHANNEL_SCAN_FIRST])
+		{
+			p_scan->channel = CHANNEL_SCAN_FIRST + i;
+		}
+	}
+
+	/* changing channel is only worth a clear gain */
+	if (p_scan->max_rssi[p_scan->default_channel - CHANNEL_SCAN_FIRST] <=
+		 (p_scan->max_rssi[p_scan->channel - CHANNEL_SCAN_FIRST] + CHANNEL_SCAN_MARGIN))
+	{
+		p_scan->channel = p_scan->default_channel;
+	}
+
+	channel_scan_end(p_scan);
+}
+
+
+/* Function to end the scan with the chosen channel */
+static void channel_scan_end(channel_scan_t * p_scan)
+{
+	p_scan->state = CHANNEL_SCAN_DONE;
+	p_scan->duration = otPlatAlarmGetNow() - p_scan->start;
+	p_scan->done(p_scan);
+}
+
+
+
+
+/* ------------------- exported functions implementation ------------------ */
+
+/* Start the channel selection. The Thread interface must be up and Thread not
+   started yet: the done callback sets the channel and starts Thread. */
+otError channel_scan_start(channel_scan_t     * p_scan,
+									otInstance         * p_instance,
+									uint16_t             pan_id,
+									uint8_t              default_channel,
+									channel_scan_done_t  done)
+{
+	otError error;
+
+	memset(p_scan, 0, sizeof(channel_scan_t));
+	memset(p_scan->max_rssi, CHANNEL_SCAN_RSSI_NONE, sizeof(p_scan->max_rssi));
+	p_scan->p_instance = p_instance;
+	p_scan->pan_id = pan_id;
+	p_scan->default_channel = default_channel;
+	p_scan->channel = default_channel;
+	p_scan->done = done;
+	p_scan->start = otPlatAlarmGetNow();
+	p_scan->state = CHANNEL_SCAN_NETWORK;
+
+	/* 0: default scan time of each channel */
+	error = otLinkActiveScan(p_instance, CHANNEL_SCAN_MASK, 0, channel_scan_network_handler, p_scan);
+	if (error != OT_ERROR_NONE)
+	{
+		p_scan->state = CHANNEL_SCAN_IDLE;
+	}
+
+	return error;
+}
+
+
+
+
+/* End of file */
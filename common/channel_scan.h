@@ -0,0 +1,115 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) [2017] [Marco Russi]
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+
+
+
+
+
+#ifndef CHANNEL_SCAN_H
+#define CHANNEL_SCAN_H
+
+
+
+
+/* ------------ Inclusions ---------------- */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <openthread/types.h>
+
+
+
+
+/* ---------------- exported constants -----------------  */
+
+/* 802.15.4 channels of the 2.4 GHz band */
+#define CHANNEL_SCAN_FIRST					11
+#define CHANNEL_SCAN_LAST					26
+#define CHANNEL_SCAN_CHANNELS_NUM			(CHANNEL_SCAN_LAST - CHANNEL_SCAN_FIRST + 1)
+
+/* energy scan time of each channel in ms: long enough to catch the Wi-Fi bursts */
+#ifndef CHANNEL_SCAN_DURATION
+#define CHANNEL_SCAN_DURATION				200
+#endif
+
+/* energy in dB by which the default channel may exceed the quietest one and still be kept */
+#ifndef CHANNEL_SCAN_MARGIN
+#define CHANNEL_SCAN_MARGIN				3
+#endif
+
+/* max energy of a channel not scanned */
+#define CHANNEL_SCAN_RSSI_NONE				127
+
+
+
+
+/* ---------------- exported typedefs -----------------  */
+
+/* scan steps */
+typedef enum
+{
+	CHANNEL_SCAN_IDLE = 0,			/**< Not started. */
+	CHANNEL_SCAN_NETWORK,			/**< Active scan for a network with the PAN ID. */
+	CHANNEL_SCAN_ENERGY,				/**< Energy scan of the channels. */
+	CHANNEL_SCAN_DONE					/**< Channel chosen. */
+} channel_scan_state_t;
+
+struct channel_scan;
+
+/* called once the channel is chosen */
+typedef void (*channel_scan_done_t)(struct channel_scan *);
+
+/* Channel selection at network formation. A network with the PAN ID heard on
+   any channel is joined on its channel; otherwise the channel with the lowest
+   max energy is picked, the default one while it is within CHANNEL_SCAN_MARGIN. */
+typedef struct channel_scan
+{
+	otInstance         * p_instance;                              	/**< OpenThread instance. */
+	channel_scan_state_t state;                                   	/**< Scan step. */
+	uint16_t             pan_id;                                  	/**< PAN ID of the network. */
+	uint8_t              default_channel;                         	/**< Channel kept when it is not busier than the others. */
+	uint8_t              channel;                                 	/**< Channel chosen. */
+	bool                 network_found;                           	/**< A network with the PAN ID was heard on the channel. */
+	int8_t               max_rssi[CHANNEL_SCAN_CHANNELS_NUM];     	/**< Max energy of each channel in dBm. */
+	uint32_t             start;                                   	/**< Start time in ms. */
+	uint32_t             duration;                                	/**< Scan time in ms. */
+	channel_scan_done_t  done;                                    	/**< Called when the channel is chosen. */
+} channel_scan_t;
+
+
+
+
+/* ---------------- exported functions -----------------  */
+
+extern otError channel_scan_start			(channel_scan_t *, otInstance *, uint16_t, uint8_t, channel_scan_done_t);
+
+
+
+
+#endif
+
+
+
+
+/* End of file */
@@ -0,0 +1,102 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) [2017] [Marco Russi]
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+
+
+
+
+
+/* ------------ Inclusions ---------------- */
+
+#include <string.h>
+#include "nrf.h"
+#include "event_queue.h"
+
+
+
+
+/* ------------------- exported functions implementation ------------------ */
+
+/* Init an empty queue */
+void event_queue_init(event_queue_t * p_queue)
+{
+	memset(p_queue, 0, sizeof(event_queue_t));
+}
+
+
+/* Post an event. To be called by the producer only, usually an interrupt
+   handler. Returns false and counts the event as lost if the queue is full. */
+bool event_queue_post(event_queue_t * p_queue, uint8_t type, uint8_t param, uint16_t value)
+{
+	uint32_t head = p_queue->head;
+	event_t * p_event;
+
+	if ((head - p_queue->tail) >= EVENT_QUEUE_SIZE)
+	{
+		p_queue->overflows++;
+		return false;
+	}
+
+	p_event = &p_queue->events[head % EVENT_QUEUE_SIZE];
+	p_event->type = type;
+	p_event->param = param;
+	p_event->value = value;
+
+	/* the event must be in memory before the consumer can see it */
+	__DMB();
+	p_queue->head = head + 1;
+
+	return true;
+}
+
+
+/* Get the oldest event. To be called by the consumer only, the main loop.
+   Returns false if the queue is empty. */
+bool event_queue_get(event_queue_t * p_queue, event_t * p_event)
+{
+	uint32_t tail = p_queue->tail;
+	uint32_t waiting = p_queue->head - tail;
+
+	if (0 == waiting)
+	{
+		return false;
+	}
+
+	if (waiting > p_queue->high_water)
+	{
+		p_queue->high_water = waiting;
+	}
+
+	/* the event must be read before the producer can overwrite it */
+	__DMB();
+	*p_event = p_queue->events[tail % EVENT_QUEUE_SIZE];
+	__DMB();
+	p_queue->tail = tail + 1;
+
+	return true;
+}
+
+
+
+
+/* End of file */
@@ -0,0 +1,91 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) [2017] [Marco Russi]
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+
+
+
+
+
+#ifndef EVENT_QUEUE_H
+#define EVENT_QUEUE_H
+
+
+
+
+/* ------------ Inclusions ---------------- */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+
+
+/* ---------------- exported constants -----------------  */
+
+/* events held by a queue, power of two */
+#define EVENT_QUEUE_SIZE					32
+
+
+
+
+/* ---------------- exported typedefs -----------------  */
+
+/* event posted by an interrupt handler */
+typedef struct
+{
+	uint8_t              type;                                      	/**< Event type, defined by the application. */
+	uint8_t              param;                                     	/**< Event parameter. */
+	uint16_t             value;                                     	/**< Event value. */
+} event_t;
+
+/* Lock-free single producer, single consumer event queue. The producer is one
+   interrupt priority level, the consumer is the main loop: each side writes
+   only its own index, so no interrupt masking is needed on either side.
+   Indexes are free-running. */
+typedef struct
+{
+	event_t              events[EVENT_QUEUE_SIZE];                  	/**< Events. */
+	volatile uint32_t    head;                                      	/**< Next event to post, written by the producer. */
+	volatile uint32_t    tail;                                      	/**< Next event to get, written by the consumer. */
+	volatile uint32_t    overflows;                                 	/**< Events lost on a full queue, written by the producer. */
+	uint32_t             high_water;                                	/**< Max events waiting, written by the consumer. */
+} event_queue_t;
+
+
+
+
+/* ---------------- exported functions -----------------  */
+
+extern void event_queue_init				(event_queue_t *);
+extern bool event_queue_post				(event_queue_t *, uint8_t, uint8_t, uint16_t);
+extern bool event_queue_get				(event_queue_t *, event_t *);
+
+
+
+
+#endif
+
+
+
+
+/* End of file */
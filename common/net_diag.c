@@ -0,0 +1,247 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) [2017] [Marco Russi]
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+
+
+
+
+
+/* ------------ Inclusions ---------------- */
+
+#include <string.h>
+#include <openthread/link.h>
+#include <openthread/message.h>
+#include <openthread/thread.h>
+#include <openthread/platform/alarm.h>
+#include "net_diag.h"
+
+
+
+
+/* ---------------- local constants -----------------  */
+
+/* query of a delta snapshot request */
+#define NET_DIAG_QUERY_DELTA					"delta"
+
+
+
+
+/* ---------------- local functions prototypes ----------------  */
+
+static uint8_t	net_diag_counters_read			(net_diag_t *, uint32_t *);
+static uint8_t *	net_diag_put16					(uint8_t *, uint16_t);
+static uint8_t *	net_diag_put32					(uint8_t *, uint32_t);
+
+
+
+
+/* ------------------- local functions implementation ------------------ */
+
+/* Read the MAC then the application counters. Returns the number of counters. */
+static uint8_t net_diag_counters_read(net_diag_t * p_diag, uint32_t * p_counters)
+{
+	const otMacCounters * p_mac = otLinkGetCounters(p_diag->p_instance);
+	uint8_t               i;
+
+	p_counters[NET_DIAG_TX_TOTAL]                = p_mac->mTxTotal;
+	p_counters[NET_DIAG_TX_UNICAST]              = p_mac->mTxUnicast;
+	p_counters[NET_DIAG_TX_BROADCAST]            = p_mac->mTxBroadcast;
+	p_counters[NET_DIAG_TX_ACK_REQUESTED]        = p_mac->mTxAckRequested;
+	p_counters[NET_DIAG_TX_ACKED]                = p_mac->mTxAcked;
+	p_counters[NET_DIAG_TX_RETRY]                = p_mac->mTxRetry;
+	p_counters[NET_DIAG_TX_ERR_CCA]              = p_mac->mTxErrCca;
+	p_counters[NET_DIAG_RX_TOTAL]                = p_mac->mRxTotal;
+	p_counters[NET_DIAG_RX_UNICAST]              = p_mac->mRxUnicast;
+	p_counters[NET_DIAG_RX_BROADCAST]            = p_mac->mRxBroadcast;
+	p_counters[NET_DIAG_RX_DUPLICATED]           = p_mac->mRxDuplicated;
+	p_counters[NET_DIAG_RX_ERR_NO_FRAME]         = p_mac->mRxErrNoFrame;
+	p_counters[NET_DIAG_RX_ERR_UNKNOWN_NEIGHBOR] = p_mac->mRxErrUnknownNeighbor;
+	p_counters[NET_DIAG_RX_ERR_SEC]              = p_mac->mRxErrSec;
+	p_counters[NET_DIAG_RX_ERR_FCS]              = p_mac->mRxErrFcs;
+	p_counters[NET_DIAG_RX_ERR_OTHER]            = p_mac->mRxErrOther;
+
+	for (i = 0; i < p_diag->app_counters_num; i++)
+	{
+		p_counters[NET_DIAG_MAC_COUNTERS_NUM + i] = *p_diag->pp_app_counters[i];
+	}
+
+	return NET_DIAG_MAC_COUNTERS_NUM + p_diag->app_counters_num;
+}
+
+
+/* Little endian writes */
+static uint8_t * net_diag_put16(uint8_t * p_buffer, uint16_t value)
+{
+	p_buffer[0] = (uint8_t)value;
+	p_buffer[1] = (uint8_t)(value >> 8);
+
+	return p_buffer + 2;
+}
+
+
+static uint8_t * net_diag_put32(uint8_t * p_buffer, uint32_t value)
+{
+	p_buffer = net_diag_put16(p_buffer, (uint16_t)value);
+
+	return net_diag_put16(p_buffer, (uint16_t)(value >> 16));
+}
+
+
+
+
+/* ------------------- exported functions implementation ------------------ */
+
+/* Bind the diagnostics to the stack and to the application counters, then reset them */
+void net_diag_init(net_diag_t               * p_diag,
+                   otInstance               * p_instance,
+                   const uint32_t * const   * pp_app_counters,
+                   uint8_t                    app_counters_num)
+{
+	p_diag->p_instance       = p_instance;
+	p_diag->pp_app_counters  = pp_app_counters;
+	p_diag->app_counters_num = (app_counters_num < NET_DIAG_APP_COUNTERS_MAX) ? app_counters_num : NET_DIAG_APP_COUNTERS_MAX;
+
+	net_diag_reset(p_diag);
+}
+
+
+/* Start both baselines from the current counters. The counters themselves are
+   left alone: the stack has no reset of its MAC counters. */
+void net_diag_reset(net_diag_t * p_diag)
+{
+	uint8_t count = net_diag_counters_read(p_diag, p_diag->reset_base);
+
+	memcpy(p_diag->delta_base, p_diag->reset_base, count * sizeof(uint32_t));
+	p_diag->reset_time = otPlatAlarmGetNow();
+	p_diag->delta_time = p_diag->reset_time;
+}
+
+
+/* Mode asked by a diagnostics request: a "delta" query asks for the changes */
+net_diag_mode_t net_diag_request_mode(otCoapHeader * p_header)
+{
+	const otCoapOption * p_option;
+
+	for (p_option = otCoapHeaderGetFirstOption(p_header); p_option != NULL; p_option = otCoapHeaderGetNextOption(p_header))
+	{
+		if ((p_option->mNumber == OT_COAP_OPTION_URI_QUERY) &&
+			(p_option->mLength == strlen(NET_DIAG_QUERY_DELTA)) &&
+			(0 == memcmp(p_option->mValue, NET_DIAG_QUERY_DELTA, p_option->mLength)))
+		{
+			return NET_DIAG_SINCE_DELTA;
+		}
+	}
+
+	return NET_DIAG_SINCE_RESET;
+}
+
+
+/* Write a snapshot, little endian:
+     version, mode, interval in ms (4), MAC counters num, application counters num,
+     the counters (4 each), free and total message buffers (2 each),
+     role, parent rloc16 (2), link quality in, link quality out, average RSSI,
+     neighbours num, then for each neighbour rloc16 (2), link quality in,
+     average RSSI, last RSSI.
+   A delta snapshot moves the delta baseline. Returns the length, 0 if the buffer is too small. */
+uint16_t net_diag_snapshot(net_diag_t * p_diag, net_diag_mode_t mode, uint8_t * p_buffer, uint16_t size)
+{
+	uint32_t               counters[NET_DIAG_MAC_COUNTERS_NUM + NET_DIAG_APP_COUNTERS_MAX];
+	uint32_t             * p_base = (mode == NET_DIAG_SINCE_DELTA) ? p_diag->delta_base : p_diag->reset_base;
+	uint32_t               now = otPlatAlarmGetNow();
+	uint8_t              * p_write = p_buffer;
+	uint8_t              * p_neighbors_num;
+	uint8_t                count;
+	uint8_t                i;
+	otBufferInfo           buffers;
+	otRouterInfo           parent;
+	otNeighborInfo         neighbor;
+	otNeighborInfoIterator iterator = OT_NEIGHBOR_INFO_ITERATOR_INIT;
+	int8_t                 rssi = 0;
+	otDeviceRole           role = otThreadGetDeviceRole(p_diag->p_instance);
+
+	if (size < NET_DIAG_SNAPSHOT_MAX)
+	{
+		return 0;
+	}
+
+	count = net_diag_counters_read(p_diag, counters);
+
+	*p_write++ = NET_DIAG_VERSION;
+	*p_write++ = (uint8_t)mode;
+	p_write    = net_diag_put32(p_write, now - ((mode == NET_DIAG_SINCE_DELTA) ? p_diag->delta_time : p_diag->reset_time));
+	*p_write++ = NET_DIAG_MAC_COUNTERS_NUM;
+	*p_write++ = p_diag->app_counters_num;
+
+	/* unsigned differences stay right across a counter wrap */
+	for (i = 0; i < count; i++)
+	{
+		p_write = net_diag_put32(p_write, counters[i] - p_base[i]);
+	}
+
+	if (mode == NET_DIAG_SINCE_DELTA)
+	{
+		memcpy(p_diag->delta_base, counters, count * sizeof(uint32_t));
+		p_diag->delta_time = now;
+	}
+
+	otMessageGetBufferInfo(p_diag->p_instance, &buffers);
+	p_write = net_diag_put16(p_write, buffers.mFreeBuffers);
+	p_write = net_diag_put16(p_write, buffers.mTotalBuffers);
+
+	*p_write++ = (uint8_t)role;
+	if ((role == OT_DEVICE_ROLE_CHILD) &&
+		(otThreadGetParentInfo(p_diag->p_instance, &parent) == OT_ERROR_NONE))
+	{
+		(void)otThreadGetParentAverageRssi(p_diag->p_instance, &rssi);
+		p_write    = net_diag_put16(p_write, parent.mRloc16);
+		*p_write++ = parent.mLinkQualityIn;
+		*p_write++ = parent.mLinkQualityOut;
+		*p_write++ = (uint8_t)rssi;
+	}
+	else
+	{
+		p_write    = net_diag_put16(p_write, NET_DIAG_RLOC16_NONE);
+		*p_write++ = 0;
+		*p_write++ = 0;
+		*p_write++ = 0;
+	}
+
+	p_neighbors_num  = p_write++;
+	*p_neighbors_num = 0;
+	while ((*p_neighbors_num < NET_DIAG_NEIGHBORS_MAX) &&
+		   (otThreadGetNextNeighborInfo(p_diag->p_instance, &iterator, &neighbor) == OT_ERROR_NONE))
+	{
+		p_write    = net_diag_put16(p_write, neighbor.mRloc16);
+		*p_write++ = neighbor.mLinkQualityIn;
+		*p_write++ = (uint8_t)neighbor.mAverageRssi;
+		*p_write++ = (uint8_t)neighbor.mLastRssi;
+		(*p_neighbors_num)++;
+	}
+
+	return (uint16_t)(p_write - p_buffer);
+}
+
+
+
+
+/* End of file */
@@ -0,0 +1,133 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) [2017] [Marco Russi]
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+
+
+
+
+
+#ifndef NET_DIAG_H
+#define NET_DIAG_H
+
+
+
+
+/* ------------ Inclusions ---------------- */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <openthread/types.h>
+#include <openthread/coap.h>
+
+
+
+
+/* ---------------- exported constants -----------------  */
+
+/* format of the snapshot payload, bumped when the layout changes */
+#define NET_DIAG_VERSION						1
+
+/* max application counters in a snapshot */
+#ifndef NET_DIAG_APP_COUNTERS_MAX
+#define NET_DIAG_APP_COUNTERS_MAX			16
+#endif
+
+/* max neighbours listed in a snapshot */
+#ifndef NET_DIAG_NEIGHBORS_MAX
+#define NET_DIAG_NEIGHBORS_MAX				6
+#endif
+
+/* rloc16 of a missing parent */
+#define NET_DIAG_RLOC16_NONE					0xFFFE
+
+/* Max length of a snapshot: header, counters, buffers, parent and neighbours */
+#define NET_DIAG_SNAPSHOT_MAX				(8 + ((NET_DIAG_MAC_COUNTERS_NUM + NET_DIAG_APP_COUNTERS_MAX) * 4) + \
+													 4 + 1 + 5 + 1 + (NET_DIAG_NEIGHBORS_MAX * 5))
+
+
+
+
+/* ---------------- exported typedefs -----------------  */
+
+/* MAC counters of a snapshot, in payload order */
+typedef enum
+{
+	NET_DIAG_TX_TOTAL = 0,				/**< Frames sent. */
+	NET_DIAG_TX_UNICAST,					/**< Unicast frames sent. */
+	NET_DIAG_TX_BROADCAST,				/**< Broadcast frames sent. */
+	NET_DIAG_TX_ACK_REQUESTED,			/**< Frames sent with an ack request. */
+	NET_DIAG_TX_ACKED,					/**< Frames sent and acked. */
+	NET_DIAG_TX_RETRY,					/**< MAC retransmissions. */
+	NET_DIAG_TX_ERR_CCA,					/**< Frames not sent, channel busy. */
+	NET_DIAG_RX_TOTAL,					/**< Frames received. */
+	NET_DIAG_RX_UNICAST,					/**< Unicast frames received. */
+	NET_DIAG_RX_BROADCAST,				/**< Broadcast frames received. */
+	NET_DIAG_RX_DUPLICATED,				/**< Duplicated frames received. */
+	NET_DIAG_RX_ERR_NO_FRAME,			/**< Frames dropped for lack of message buffers. */
+	NET_DIAG_RX_ERR_UNKNOWN_NEIGHBOR,	/**< Frames dropped from an unknown neighbour. */
+	NET_DIAG_RX_ERR_SEC,					/**< Frames dropped by the security checks. */
+	NET_DIAG_RX_ERR_FCS,					/**< Frames dropped with a bad FCS. */
+	NET_DIAG_RX_ERR_OTHER,				/**< Frames dropped for other reasons. */
+	NET_DIAG_MAC_COUNTERS_NUM
+} net_diag_counter_t;
+
+/* values of the snapshot counters */
+typedef enum
+{
+	NET_DIAG_SINCE_RESET = 0,			/**< Counts since the last reset. */
+	NET_DIAG_SINCE_DELTA					/**< Counts since the previous delta snapshot. */
+} net_diag_mode_t;
+
+/* Network diagnostics: the MAC counters of the stack and the counters of the
+   application, read against two baselines so that a scraper gets either the
+   totals since the last reset or the changes since its previous read. */
+typedef struct
+{
+	otInstance         * p_instance;                              	/**< OpenThread instance. */
+	const uint32_t * const * pp_app_counters;                     	/**< Application counters, in payload order. */
+	uint8_t              app_counters_num;                        	/**< Number of application counters. */
+	uint32_t             reset_time;                              	/**< Time of the last reset in ms. */
+	uint32_t             delta_time;                              	/**< Time of the previous delta snapshot in ms. */
+	uint32_t             reset_base[NET_DIAG_MAC_COUNTERS_NUM + NET_DIAG_APP_COUNTERS_MAX];	/**< Counters at the last reset. */
+	uint32_t             delta_base[NET_DIAG_MAC_COUNTERS_NUM + NET_DIAG_APP_COUNTERS_MAX];	/**< Counters at the previous delta snapshot. */
+} net_diag_t;
+
+
+
+
+/* ---------------- exported functions -----------------  */
+
+extern void 			net_diag_init					(net_diag_t *, otInstance *, const uint32_t * const *, uint8_t);
+extern void 			net_diag_reset					(net_diag_t *);
+extern net_diag_mode_t net_diag_request_mode		(otCoapHeader *);
+extern uint16_t 		net_diag_snapshot				(net_diag_t *, net_diag_mode_t, uint8_t *, uint16_t);
+
+
+
+
+#endif
+
+
+
+
+/* End of file */
@@ -0,0 +1,138 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) [2017] [Marco Russi]
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+
+
+
+
+
+/* ------------ Inclusions ---------------- */
+
+#include <stdio.h>
+#include <string.h>
+#include "perf.h"
+
+#if PERF_ENABLED
+
+
+
+
+/* ------------------- exported functions implementation ------------------ */
+
+/* Start the cycle counter of the target, nothing to do on a host */
+void perf_init(void)
+{
+#ifdef PERF_CYCLES
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+}
+
+
+/* Add a measure to a counter: a few instructions, no division */
+void perf_record(perf_counter_t * p_counter, uint32_t time)
+{
+	uint8_t bucket = (uint8_t)(31 - __builtin_clz(time | 1));
+
+	p_counter->count++;
+	p_counter->total += time;
+	if (time < p_counter->min)
+	{
+		p_counter->min = time;
+	}
+	if (time > p_counter->max)
+	{
+		p_counter->max = time;
+	}
+	p_counter->buckets[(bucket < PERF_BUCKETS_NUM) ? bucket : (PERF_BUCKETS_NUM - 1)]++;
+}
+
+
+/* Clear a counter, keeping its name */
+void perf_reset(perf_counter_t * p_counter)
+{
+	const char * p_name = p_counter->p_name;
+
+	memset(p_counter, 0, sizeof(perf_counter_t));
+	p_counter->p_name = p_name;
+	p_counter->min = UINT32_MAX;
+}
+
+
+/* Write a text report of counters, one line each:
+   <name> n <count> min <min> max <max> mean <mean> <unit> h <bucket>:<count>,...
+   where only the non-empty buckets are listed. Returns the length written,
+   the lines that do not fit are left out. */
+uint16_t perf_report(perf_counter_t * const * p_counters, uint8_t counters_num, char * p_buffer, uint16_t size)
+{
+	uint16_t length = 0;
+	uint16_t line;
+	int      written;
+	uint8_t  i;
+	uint8_t  j;
+
+	for (i = 0; i < counters_num; i++)
+	{
+		line = length;
+		written = snprintf(&p_buffer[line], size - line, "%s n %lu min %lu max %lu mean %lu " PERF_UNIT " h",
+								 p_counters[i]->p_name,
+								 (unsigned long)p_counters[i]->count,
+								 (unsigned long)((p_counters[i]->count > 0) ? p_counters[i]->min : 0),
+								 (unsigned long)p_counters[i]->max,
+								 (unsigned long)((p_counters[i]->count > 0) ? (p_counters[i]->total / p_counters[i]->count) : 0));
+
+		for (j = 0; (j < PERF_BUCKETS_NUM) && (written > 0) && ((line + written) < size); j++)
+		{
+			if (p_counters[i]->buckets[j] > 0)
+			{
+				line += written;
+				written = snprintf(&p_buffer[line], size - line, " %d:%lu", j, (unsigned long)p_counters[i]->buckets[j]);
+			}
+		}
+
+		if ((written < 0) || ((line + written + 1) >= size))
+		{
+			/* no room for the whole line */
+			p_buffer[length] = '\0';
+			break;
+		}
+
+		line += written;
+		p_buffer[line++] = '\n';
+		p_buffer[line] = '\0';
+		length = line;
+	}
+
+	return length;
+}
+
+
+
+
+#endif
+
+
+
+
+/* End of file */
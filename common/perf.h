@@ -0,0 +1,143 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) [2017] [Marco Russi]
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+
+
+
+
+
+#ifndef PERF_H
+#define PERF_H
+
+
+
+
+/* ------------ Inclusions ---------------- */
+
+#include <stdbool.h>
+#include <stdint.h>
+#if defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__)
+#include "sdk_config.h"
+#endif
+
+
+
+
+/* ---------------- exported constants -----------------  */
+
+/* Execution time counters of the hot paths (PERF_ENABLED in sdk_config.h or make
+   PERF=1). When disabled the macros below expand to nothing: no code, no data. */
+#ifndef PERF_ENABLED
+#define PERF_ENABLED							0
+#endif
+
+/* Cortex-M3/M4 targets count CPU cycles with the DWT, hosts count ns of the monotonic clock */
+#if defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__)
+#define PERF_CYCLES							1
+#define PERF_UNIT								"cycles"
+#else
+#define PERF_UNIT								"ns"
+#endif
+
+/* log2 buckets of a histogram: bucket i counts the times in [2^i, 2^(i+1)),
+   the last one the longer times too */
+#define PERF_BUCKETS_NUM						24
+
+
+
+
+/* ---------------- exported typedefs -----------------  */
+
+/* execution times of a code path */
+typedef struct
+{
+	const char         * p_name;                          	/**< Name in the reports. */
+	uint32_t             count;                           	/**< Runs. */
+	uint32_t             min;                             	/**< Shortest time, UINT32_MAX before the first run. */
+	uint32_t             max;                             	/**< Longest time. */
+	uint64_t             total;                           	/**< Sum of the times, for the mean. */
+	uint32_t             buckets[PERF_BUCKETS_NUM];       	/**< Log2 histogram of the times. */
+} perf_counter_t;
+
+
+
+
+/* ---------------- exported macros -----------------  */
+
+#if PERF_ENABLED
+
+#ifdef PERF_CYCLES
+#include "nrf.h"
+
+/* Current time in CPU cycles */
+static inline uint32_t perf_now(void)
+{
+	return DWT->CYCCNT;
+}
+#else
+#include <time.h>
+
+/* Current time in ns, wrapping every 4.3 s: only differences are used */
+static inline uint32_t perf_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint32_t)(((uint64_t)now.tv_sec * 1000000000ULL) + now.tv_nsec);
+}
+#endif
+
+/* define a counter, start a measure in a local variable, add it to a counter */
+#define PERF_COUNTER_DEF(_name, _label)		static perf_counter_t _name = { .p_name = _label, .min = UINT32_MAX }
+#define PERF_START(_start)						uint32_t _start = perf_now()
+#define PERF_STOP(_counter, _start)			perf_record(&(_counter), perf_now() - (_start))
+
+#else
+
+#define PERF_COUNTER_DEF(_name, _label)
+#define PERF_START(_start)
+#define PERF_STOP(_counter, _start)
+
+#endif
+
+
+
+
+/* ---------------- exported functions -----------------  */
+
+#if PERF_ENABLED
+extern void 	perf_init								(void);
+extern void 	perf_record								(perf_counter_t *, uint32_t);
+extern void 	perf_reset								(perf_counter_t *);
+extern uint16_t perf_report							(perf_counter_t * const *, uint8_t, char *, uint16_t);
+#endif
+
+
+
+
+#endif
+
+
+
+
+/* End of file */
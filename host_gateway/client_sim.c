@@ -0,0 +1,451 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) [2017] [Marco Russi]
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+
+
+
+
+/* Simulated light client: a pty that speaks the UART channel protocol of the
+   client with the same command parsers, a request queue served at the radio
+   rate, simulated round trip times, credit reports and flow control. */
+
+
+
+
+/* ------------ Inclusions ---------------- */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "protocol.h"
+#include "perf.h"
+
+
+
+
+/* ---------------- local constants -----------------  */
+
+/* receive chunk, as the UARTE chunks of the client */
+#define SIM_CHUNK_SIZE						64
+
+/* max acks waiting for their round trip time */
+#define SIM_ACKS_MAX						8192
+
+/* max length of the request queue */
+#define SIM_QUEUE_MAX						1024
+
+/* lateness in us after which the sender starts again from now: the poll time-out
+   has a 1 ms granularity, the requests due within it go out together */
+#define SIM_SEND_SLACK						2000
+
+/* credit change that is reported, and max time in us between two reports */
+#define SIM_CREDIT_HYSTERESIS				4
+#define SIM_CREDIT_INTERVAL				1000000
+
+
+
+
+/* ---------------- local typedefs -----------------  */
+
+/* request waiting in the queue or for its ack */
+typedef struct
+{
+	uint16_t             id;                             	/**< Request id. */
+	bool                 unicast;                        	/**< Request is acknowledged. */
+	uint64_t             due;                            	/**< Time of the ack in us. */
+} sim_request_t;
+
+/* simulator settings and state */
+typedef struct
+{
+	protocol_mode_t      mode;                           	/**< Channel format. */
+	uint32_t             capacity;                       	/**< Requests sent per second. */
+	uint32_t             rtt;                            	/**< Round trip time in us. */
+	uint32_t             jitter;                         	/**< Max added round trip time in us. */
+	uint32_t             loss;                           	/**< Unicast time-outs per thousand. */
+	uint16_t             queue_size;                     	/**< Request queue length. */
+	int                  fd;                             	/**< pty master. */
+	cmd_parser_t         parser;                         	/**< JSON parser. */
+	cmd_frame_t          frame;                          	/**< Binary frames decoder. */
+	sim_request_t        queue[SIM_QUEUE_MAX];           	/**< Requests waiting to be sent, oldest first. */
+	uint16_t             queue_head;                     	/**< First request of the queue. */
+	uint16_t             queue_count;                    	/**< Queued requests. */
+	sim_request_t        acks[SIM_ACKS_MAX];             	/**< Requests waiting for the ack. */
+	uint16_t             acks_count;                     	/**< Requests waiting for the ack. */
+	uint64_t             next_send;                      	/**< Time of the next send in us. */
+	uint16_t             credit;                         	/**< Last credit reported. */
+	uint32_t             events_lost;                    	/**< Events the host did not read in time. */
+	uint64_t             credit_time;                    	/**< Time of the last credit report. */
+	uint64_t             commands;                       	/**< Commands received. */
+} sim_t;
+
+
+
+
+/* ---------------- local variables -----------------  */
+
+/* simulator */
+static sim_t m_sim;
+
+/* termination request */
+static volatile sig_atomic_t m_stop = 0;
+
+/* execution times of the command path: parse, handler and queueing of a chunk */
+PERF_COUNTER_DEF(m_perf_chunk, "chunk");
+
+
+
+
+/* ------------------- local functions implementation ------------------ */
+
+/* Monotonic time in us */
+static uint64_t sim_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000ULL) + (ts.tv_nsec / 1000);
+}
+
+
+/* Send an event to the host */
+static void sim_event_send(uint16_t id, protocol_event_t event, int result, uint32_t value)
+{
+	uint8_t buffer[PROTOCOL_MESSAGE_MAX];
+	size_t  length = protocol_event_encode(m_sim.mode, id, event, result, value, buffer);
+
+	/* events are lost when the host does not read them, as the client does */
+	if (write(m_sim.fd, buffer, length) < 0)
+	{
+		m_sim.events_lost++;
+	}
+}
+
+
+/* Credit of the host: room in the request queue above the reserve of a chunk */
+static uint16_t sim_credit(void)
+{
+	uint16_t reserve = m_sim.queue_size / 8;
+	uint16_t free_entries = m_sim.queue_size - m_sim.queue_count;
+
+	return (free_entries > reserve) ? (free_entries - reserve) : 0;
+}
+
+
+/* Report the credit when it changes or periodically */
+static void sim_credit_update(uint64_t now)
+{
+	uint16_t credit = sim_credit();
+	uint16_t change = (credit > m_sim.credit) ? (credit - m_sim.credit) : (m_sim.credit - credit);
+
+	if ((change >= SIM_CREDIT_HYSTERESIS) ||
+		 ((credit != m_sim.credit) && ((0 == credit) || (0 == m_sim.credit))) ||
+		 ((now - m_sim.credit_time) >= SIM_CREDIT_INTERVAL))
+	{
+		m_sim.credit = credit;
+		m_sim.credit_time = now;
+		sim_event_send(PROTOCOL_ID_NONE, PROTOCOL_EVENT_CREDIT, m_sim.acks_count, credit);
+	}
+}
+
+
+/* Command handler of the parsers */
+static void sim_command_handler(const cmd_t * p_cmd, void * p_context)
+{
+	sim_request_t * p_request;
+	uint16_t        id;
+
+	(void)p_context;
+
+	if (NULL == p_cmd)
+	{
+		sim_event_send(PROTOCOL_ID_NONE, PROTOCOL_EVENT_DISCARDED, PROTOCOL_RESULT_PARSE, 0);
+		return;
+	}
+
+	m_sim.commands++;
+	id = (p_cmd->fields & CMD_FIELD_ID) ? p_cmd->request_id : PROTOCOL_ID_NONE;
+	if (id != PROTOCOL_ID_NONE)
+	{
+		sim_event_send(id, PROTOCOL_EVENT_PARSED, PROTOCOL_RESULT_NONE, 0);
+	}
+
+	if (m_sim.queue_count >= m_sim.queue_size)
+	{
+		if (id != PROTOCOL_ID_NONE)
+		{
+			sim_event_send(id, PROTOCOL_EVENT_DROPPED, PROTOCOL_RESULT_NO_BUFS, 0);
+		}
+		return;
+	}
+
+	p_request = &m_sim.queue[(m_sim.queue_head + m_sim.queue_count) % SIM_QUEUE_MAX];
+	p_request->id = id;
+	p_request->unicast = (0 != (p_cmd->fields & (CMD_FIELD_TARGET | CMD_FIELD_ADDRESS)));
+	m_sim.queue_count++;
+}
+
+
+/* Send the queued requests at the radio rate and the acks that are due */
+static void sim_process(uint64_t now)
+{
+	sim_request_t * p_request;
+	uint16_t        i;
+	bool            lost;
+
+	while ((m_sim.queue_count > 0) && (now >= m_sim.next_send) && (m_sim.acks_count < SIM_ACKS_MAX))
+	{
+		p_request = &m_sim.queue[m_sim.queue_head];
+		m_sim.queue_head = (m_sim.queue_head + 1) % SIM_QUEUE_MAX;
+		m_sim.queue_count--;
+
+		/* a late sender does not catch up with a burst */
+		m_sim.next_send = ((now - m_sim.next_send) > SIM_SEND_SLACK) ? now : m_sim.next_send;
+		m_sim.next_send += 1000000 / m_sim.capacity;
+
+		if (p_request->id != PROTOCOL_ID_NONE)
+		{
+			sim_event_send(p_request->id, PROTOCOL_EVENT_SENT, PROTOCOL_RESULT_NONE, 0);
+		}
+		if ((true == p_request->unicast) && (p_request->id != PROTOCOL_ID_NONE))
+		{
+			m_sim.acks[m_sim.acks_count] = *p_request;
+			m_sim.acks[m_sim.acks_count].due = now + m_sim.rtt + ((m_sim.jitter > 0) ? (uint32_t)rand() % m_sim.jitter : 0);
+			m_sim.acks_count++;
+		}
+	}
+
+	i = 0;
+	while (i < m_sim.acks_count)
+	{
+		if (now >= m_sim.acks[i].due)
+		{
+			lost = ((uint32_t)rand() % 1000) < m_sim.loss;
+			sim_event_send(m_sim.acks[i].id,
+								PROTOCOL_EVENT_ACK,
+								lost ? PROTOCOL_RESULT_TIMEOUT : PROTOCOL_RESULT_NONE,
+								(uint32_t)((now - m_sim.acks[i].due + m_sim.rtt) / 1000));
+			m_sim.acks[i] = m_sim.acks[--m_sim.acks_count];
+		}
+		else
+		{
+			i++;
+		}
+	}
+
+	sim_credit_update(now);
+}
+
+
+/* Time in ms to the next due action, for the poll time-out */
+static int sim_timeout(uint64_t now)
+{
+	uint64_t next = now + 100000;
+	uint16_t i;
+
+	if ((m_sim.queue_count > 0) && (m_sim.next_send < next))
+	{
+		next = m_sim.next_send;
+	}
+	for (i = 0; i < m_sim.acks_count; i++)
+	{
+		if (m_sim.acks[i].due < next)
+		{
+			next = m_sim.acks[i].due;
+		}
+	}
+
+	return (next > now) ? (int)((next - now + 999) / 1000) : 0;
+}
+
+
+/* Stop on signals */
+static void sim_signal_handler(int signal_number)
+{
+	(void)signal_number;
+
+	m_stop = 1;
+}
+
+
+/* Print the usage */
+static void sim_usage(const char * p_name)
+{
+	fprintf(stderr,
+			  "usage: %s [-m json|binary] [-c requests/s] [-q queue] [-r rtt ms] [-j jitter ms] [-x loss per mille] [-l link]\n"
+			  "Opens a pty and prints its path, or links it to the given path.\n",
+			  p_name);
+}
+
+
+int main(int argc, char * argv[])
+{
+	uint8_t        chunk[SIM_CHUNK_SIZE];
+	struct termios tio;
+	struct pollfd  pfd;
+	const char   * p_link = NULL;
+	const char   * p_slave;
+	uint64_t       now;
+	ssize_t        length;
+	int            slave_fd;
+	int            option;
+
+	m_sim.mode = PROTOCOL_MODE_JSON;
+	m_sim.capacity = 1000;
+	m_sim.queue_size = 128;
+	m_sim.rtt = 20000;
+	m_sim.jitter = 10000;
+
+	while ((option = getopt(argc, argv, "m:c:q:r:j:x:l:h")) != -1)
+	{
+		switch (option)
+		{
+			case 'm': m_sim.mode = (0 == strcmp(optarg, "binary")) ? PROTOCOL_MODE_BINARY : PROTOCOL_MODE_JSON;	break;
+			case 'c': m_sim.capacity = strtoul(optarg, NULL, 0);		break;
+			case 'q': m_sim.queue_size = strtoul(optarg, NULL, 0);	break;
+			case 'r': m_sim.rtt = strtoul(optarg, NULL, 0) * 1000;	break;
+			case 'j': m_sim.jitter = strtoul(optarg, NULL, 0) * 1000;	break;
+			case 'x': m_sim.loss = strtoul(optarg, NULL, 0);			break;
+			case 'l': p_link = optarg;										break;
+			default:
+				sim_usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if ((0 == m_sim.capacity) || (0 == m_sim.queue_size) || (m_sim.queue_size > SIM_QUEUE_MAX))
+	{
+		sim_usage(argv[0]);
+		return 1;
+	}
+
+	/* non blocking master: events the host does not read are lost, as on the client */
+	m_sim.fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if ((m_sim.fd < 0) || (grantpt(m_sim.fd) != 0) || (unlockpt(m_sim.fd) != 0) || ((p_slave = ptsname(m_sim.fd)) == NULL))
+	{
+		perror("pty");
+		return 1;
+	}
+
+	/* keep the slave open, so the master does not fail while the host reconnects */
+	slave_fd = open(p_slave, O_RDWR | O_NOCTTY);
+	if ((slave_fd < 0) || (tcgetattr(slave_fd, &tio) != 0))
+	{
+		perror(p_slave);
+		return 1;
+	}
+	cfmakeraw(&tio);
+	tcsetattr(slave_fd, TCSANOW, &tio);
+
+	if (p_link != NULL)
+	{
+		unlink(p_link);
+		if (symlink(p_slave, p_link) != 0)
+		{
+			perror(p_link);
+			return 1;
+		}
+	}
+	printf("%s\n", (p_link != NULL) ? p_link : p_slave);
+	fflush(stdout);
+
+	cmd_parser_init(&m_sim.parser, sim_command_handler, NULL);
+	cmd_frame_init(&m_sim.frame, sim_command_handler, NULL);
+	signal(SIGINT, sim_signal_handler);
+	signal(SIGTERM, sim_signal_handler);
+
+	now = sim_now();
+	m_sim.next_send = now;
+	m_sim.credit = sim_credit();
+	m_sim.credit_time = now;
+
+	while (0 == m_stop)
+	{
+		now = sim_now();
+
+		/* as the client, leave the bytes unread while the queue is short of room:
+		   the pty buffer fills up and the host writes block, as with RTS */
+		pfd.fd = m_sim.fd;
+		pfd.events = (sim_credit() > 0) ? POLLIN : 0;
+		pfd.revents = 0;
+
+		if ((poll(&pfd, 1, sim_timeout(now)) < 0) && (errno != EINTR))
+		{
+			perror("poll");
+			break;
+		}
+
+		if (pfd.revents & POLLIN)
+		{
+			length = read(m_sim.fd, chunk, sizeof(chunk));
+			if (length > 0)
+			{
+				PERF_START(start);
+				if (PROTOCOL_MODE_BINARY == m_sim.mode)
+				{
+					cmd_frame_feed(&m_sim.frame, chunk, (size_t)length);
+				}
+				else
+				{
+					cmd_parser_feed(&m_sim.parser, chunk, (size_t)length);
+				}
+				PERF_STOP(m_perf_chunk, start);
+			}
+		}
+
+		sim_process(sim_now());
+	}
+
+	if (p_link != NULL)
+	{
+		unlink(p_link);
+	}
+	fprintf(stderr, "commands %llu, parse errors %u, events lost %u\n",
+			  (unsigned long long)m_sim.commands, m_sim.parser.errors + m_sim.frame.errors, m_sim.events_lost);
+#if PERF_ENABLED
+	{
+		perf_counter_t * const counters[] = { &m_perf_chunk };
+		char                   report[256];
+
+		(void)perf_report(counters, 1, report, sizeof(report));
+		fprintf(stderr, "%s", report);
+	}
+#endif
+	close(slave_fd);
+	close(m_sim.fd);
+
+	return 0;
+}
+
+
+
+
+/* End of file */
@@ -0,0 +1,967 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) [2017] [Marco Russi]
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+
+
+
+
+/* Host gateway of the light client: speaks the UART channel protocol of the
+   client over a serial device or pty, paces the commands on the credit of the
+   client, offers a local socket API and has a built-in load generator that
+   measures the commands per second and the latency up to the final outcome. */
+
+
+
+
+/* ------------ Inclusions ---------------- */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "protocol.h"
+
+
+
+
+/* ---------------- local constants -----------------  */
+
+/* default local socket path */
+#define GATEWAY_SOCKET_PATH				"/tmp/light_gateway.sock"
+
+/* max socket clients */
+#define GATEWAY_CLIENTS_MAX				16
+
+/* max length of a socket request line */
+#define GATEWAY_LINE_MAX					256
+
+/* commands waiting for credit */
+#define GATEWAY_PENDING_MAX				4096
+
+/* request ids: 0xFFFF is used by the client for events without id */
+#define GATEWAY_IDS_NUM					PROTOCOL_ID_NONE
+
+/* credit used until the client reports one */
+#define GATEWAY_CREDIT_DEFAULT			8
+
+/* time in us after which a request without outcome is counted as lost */
+#define GATEWAY_REQUEST_TIMEOUT			10000000
+
+/* latency samples kept for the percentiles */
+#define GATEWAY_SAMPLES_MAX				65536
+
+/* owner of the requests of the load generator */
+#define GATEWAY_OWNER_LOAD					(-1)
+
+/* owner of the requests of a gone socket client */
+#define GATEWAY_OWNER_NONE					(-2)
+
+
+
+
+/* ---------------- local typedefs -----------------  */
+
+/* load generator commands */
+typedef enum
+{
+	LOAD_ALL,					/**< Levels to all the lights. */
+	LOAD_GROUP,					/**< Levels to group 0. */
+	LOAD_UNICAST,				/**< Levels to one light, acknowledged. */
+	LOAD_BATCH					/**< Batches of 8 levels to all the lights. */
+} load_kind_t;
+
+/* command waiting for credit */
+typedef struct
+{
+	cmd_t                cmd;                            	/**< Command, without its id. */
+	int                  owner;                          	/**< Socket of the requester, GATEWAY_OWNER_LOAD for the load. */
+} pending_t;
+
+/* request sent to the client */
+typedef struct
+{
+	bool                 active;                         	/**< Waiting for its outcome. */
+	bool                 unicast;                        	/**< Outcome is the ack. */
+	bool                 parsed;                         	/**< Taken by the client. */
+	int                  owner;                          	/**< Socket of the requester, GATEWAY_OWNER_LOAD for the load. */
+	uint64_t             start;                          	/**< Time the command was written in us. */
+} request_t;
+
+/* socket client */
+typedef struct
+{
+	int                  fd;                             	/**< Socket, -1 if not used. */
+	char                 line[GATEWAY_LINE_MAX];         	/**< Line being received. */
+	size_t               length;                         	/**< Length of the line. */
+} client_t;
+
+/* gateway settings and state */
+typedef struct
+{
+	protocol_mode_t      mode;                           	/**< Channel format. */
+	int                  serial_fd;                      	/**< Serial device or pty. */
+	int                  listen_fd;                      	/**< Local socket. */
+	const char         * p_socket_path;                  	/**< Local socket path. */
+	client_t             clients[GATEWAY_CLIENTS_MAX];   	/**< Socket clients. */
+	protocol_decoder_t   decoder;                        	/**< Events decoder. */
+	pending_t            pending[GATEWAY_PENDING_MAX];   	/**< Commands waiting for credit, oldest first. */
+	uint16_t             pending_head;                   	/**< First pending command. */
+	uint16_t             pending_count;                  	/**< Pending commands. */
+	request_t            requests[GATEWAY_IDS_NUM];      	/**< Requests by id. */
+	uint16_t             next_id;                        	/**< Id of the next request. */
+	uint32_t             inflight;                       	/**< Requests waiting for their outcome. */
+	uint16_t             credit;                         	/**< Last credit of the client. */
+	uint16_t             unparsed;                       	/**< Commands sent and not yet taken by the client. */
+	uint64_t             sent;                           	/**< Commands sent. */
+	uint64_t             completed;                      	/**< Requests with a successful outcome. */
+	uint64_t             failed;                         	/**< Requests with a failed outcome. */
+	uint64_t             lost;                           	/**< Requests without outcome. */
+	uint64_t             discarded;                      	/**< Commands discarded by the client. */
+	uint32_t           * p_samples;                      	/**< Latency samples in us. */
+	uint64_t             samples_count;                  	/**< Samples taken. */
+	load_kind_t          load_kind;                      	/**< Load generator commands. */
+	uint32_t             load_rate;                      	/**< Load commands per second, 0 for as fast as the credit allows. */
+	uint64_t             load_count;                     	/**< Load commands to generate. */
+	uint64_t             load_generated;                 	/**< Load commands generated. */
+	uint64_t             load_done;                      	/**< Load commands with an outcome. */
+	uint64_t             load_next;                      	/**< Time of the next load command in us. */
+	uint64_t             load_start;                     	/**< Start time of the load in us. */
+	uint8_t              load_address[16];               	/**< Light of the unicast load. */
+	char                 load_target[CMD_ADDRESS_MAX_LENGTH + 1];	/**< Light of the unicast load, as a string. */
+} gateway_t;
+
+
+
+
+/* ---------------- local variables -----------------  */
+
+/* gateway */
+static gateway_t m_gateway;
+
+/* termination request */
+static volatile sig_atomic_t m_stop = 0;
+
+
+
+
+/* ------------------- local functions implementation ------------------ */
+
+/* Monotonic time in us */
+static uint64_t gateway_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000ULL) + (ts.tv_nsec / 1000);
+}
+
+
+/* Write all the bytes, waiting for the flow control of the client */
+static bool gateway_write(int fd, const void * p_data, size_t length)
+{
+	const uint8_t * p_bytes = p_data;
+	ssize_t         written;
+
+	while (length > 0)
+	{
+		written = write(fd, p_bytes, length);
+		if (written < 0)
+		{
+			if (EINTR == errno)
+			{
+				continue;
+			}
+			return false;
+		}
+		p_bytes += written;
+		length -= (size_t)written;
+	}
+
+	return true;
+}
+
+
+/* Send a line to a socket client, if still connected */
+static void gateway_reply(int owner, const char * p_format, ...) __attribute__((format(printf, 2, 3)));
+static void gateway_reply(int owner, const char * p_format, ...)
+{
+	char    line[GATEWAY_LINE_MAX];
+	va_list args;
+	int     length;
+
+	if (owner < 0)
+	{
+		return;
+	}
+
+	va_start(args, p_format);
+	length = vsnprintf(line, sizeof(line), p_format, args);
+	va_end(args);
+
+	if ((length > 0) && (length < (int)sizeof(line)))
+	{
+		(void)send(owner, line, (size_t)length, MSG_NOSIGNAL | MSG_DONTWAIT);
+	}
+}
+
+
+/* Record a latency sample */
+static void gateway_sample(uint32_t latency)
+{
+	m_gateway.p_samples[m_gateway.samples_count % GATEWAY_SAMPLES_MAX] = latency;
+	m_gateway.samples_count++;
+}
+
+
+/* Compare two samples for the sort */
+static int gateway_sample_compare(const void * p_a, const void * p_b)
+{
+	uint32_t a = *(const uint32_t *)p_a;
+	uint32_t b = *(const uint32_t *)p_b;
+
+	return (a > b) - (a < b);
+}
+
+
+/* Print the counters and the latency percentiles of the last samples */
+static void gateway_stats_print(FILE * p_file, double seconds)
+{
+	static uint32_t sorted[GATEWAY_SAMPLES_MAX];
+	size_t count = (m_gateway.samples_count < GATEWAY_SAMPLES_MAX) ? m_gateway.samples_count : GATEWAY_SAMPLES_MAX;
+
+	fprintf(p_file, "sent %llu completed %llu failed %llu lost %llu discarded %llu in flight %u credit %u\n",
+			  (unsigned long long)m_gateway.sent, (unsigned long long)m_gateway.completed,
+			  (unsigned long long)m_gateway.failed, (unsigned long long)m_gateway.lost,
+			  (unsigned long long)m_gateway.discarded, m_gateway.inflight, m_gateway.credit);
+
+	if (seconds > 0)
+	{
+		fprintf(p_file, "throughput %.1f commands/s over %.2f s\n",
+				  (double)(m_gateway.completed + m_gateway.failed) / seconds, seconds);
+	}
+
+	if (count > 0)
+	{
+		memcpy(sorted, m_gateway.p_samples, count * sizeof(uint32_t));
+		qsort(sorted, count, sizeof(uint32_t), gateway_sample_compare);
+		fprintf(p_file, "latency us: p50 %u p90 %u p99 %u p99.9 %u max %u (%zu samples)\n",
+				  sorted[count / 2], sorted[(count * 90) / 100], sorted[(count * 99) / 100],
+				  sorted[(count * 999) / 1000], sorted[count - 1], count);
+	}
+}
+
+
+/* Close a request with its outcome */
+static void gateway_request_close(uint16_t id, bool success, int result)
+{
+	request_t * p_request = &m_gateway.requests[id];
+	uint32_t    latency = (uint32_t)(gateway_now() - p_request->start);
+
+	p_request->active = false;
+	m_gateway.inflight--;
+
+	if (true == success)
+	{
+		m_gateway.completed++;
+		gateway_sample(latency);
+	}
+	else
+	{
+		m_gateway.failed++;
+	}
+
+	if (GATEWAY_OWNER_LOAD == p_request->owner)
+	{
+		m_gateway.load_done++;
+	}
+	gateway_reply(p_request->owner, "done %u %d %u\n", id, result, latency);
+}
+
+
+/* Event handler of the decoder */
+static void gateway_event_handler(uint16_t id, protocol_event_t event, int result, uint32_t value, void * p_context)
+{
+	request_t * p_request;
+	bool        final;
+
+	(void)p_context;
+
+	if (PROTOCOL_EVENT_CREDIT == event)
+	{
+		m_gateway.credit = (uint16_t)value;
+		return;
+	}
+
+	if (PROTOCOL_EVENT_DISCARDED == event)
+	{
+		m_gateway.discarded++;
+		return;
+	}
+
+	if ((id >= GATEWAY_IDS_NUM) || (false == m_gateway.requests[id].active))
+	{
+		return;
+	}
+	p_request = &m_gateway.requests[id];
+
+	/* any event tells that the client took the command */
+	if (false == p_request->parsed)
+	{
+		p_request->parsed = true;
+		m_gateway.unparsed--;
+	}
+
+	gateway_reply(p_request->owner, "event %u %s %d %u\n", id, protocol_event_names[event], result, value);
+
+	/* the outcome of a multicast is its send, the one of a unicast is its ack. A
+	   command the client sends as several unicasts reports only its combined ack. */
+	switch (event)
+	{
+		case PROTOCOL_EVENT_SENT:
+			final = (false == p_request->unicast) || (result != PROTOCOL_RESULT_NONE);
+			break;
+		case PROTOCOL_EVENT_ACK:
+		case PROTOCOL_EVENT_SUPERSEDED:
+		case PROTOCOL_EVENT_DROPPED:
+			final = true;
+			break;
+		default:
+			final = false;
+			break;
+	}
+
+	if (true == final)
+	{
+		gateway_request_close(id, (PROTOCOL_RESULT_NONE == result) && (event != PROTOCOL_EVENT_DROPPED), result);
+	}
+}
+
+
+/* Queue a command until the client has credit for it */
+static bool gateway_submit(const cmd_t * p_cmd, int owner)
+{
+	pending_t * p_pending;
+
+	if (m_gateway.pending_count >= GATEWAY_PENDING_MAX)
+	{
+		return false;
+	}
+
+	p_pending = &m_gateway.pending[(m_gateway.pending_head + m_gateway.pending_count) % GATEWAY_PENDING_MAX];
+	p_pending->cmd = *p_cmd;
+	p_pending->owner = owner;
+	m_gateway.pending_count++;
+
+	return true;
+}
+
+
+/* Send the pending commands the credit allows: the credit counts the room in
+   the queue of the client, so the commands still on the line are taken off */
+static void gateway_send(void)
+{
+	uint8_t     buffer[PROTOCOL_MESSAGE_MAX];
+	pending_t * p_pending;
+	request_t * p_request;
+	size_t      length;
+
+	while ((m_gateway.pending_count > 0) && (m_gateway.unparsed < m_gateway.credit))
+	{
+		/* ids still waiting for an outcome are not reused */
+		if (true == m_gateway.requests[m_gateway.next_id].active)
+		{
+			break;
+		}
+
+		p_pending = &m_gateway.pending[m_gateway.pending_head];
+		p_pending->cmd.request_id = m_gateway.next_id;
+		p_pending->cmd.fields |= CMD_FIELD_ID;
+
+		length = protocol_command_encode(m_gateway.mode, &p_pending->cmd, buffer);
+
+		m_gateway.pending_head = (m_gateway.pending_head + 1) % GATEWAY_PENDING_MAX;
+		m_gateway.pending_count--;
+
+		if (0 == length)
+		{
+			gateway_reply(p_pending->owner, "error command not valid\n");
+			continue;
+		}
+
+		p_request = &m_gateway.requests[m_gateway.next_id];
+		p_request->active = true;
+		p_request->unicast = (0 != (p_pending->cmd.fields & (CMD_FIELD_TARGET | CMD_FIELD_ADDRESS)));
+		p_request->parsed = false;
+		p_request->owner = p_pending->owner;
+		p_request->start = gateway_now();
+		m_gateway.inflight++;
+		m_gateway.unparsed++;
+		m_gateway.sent++;
+		gateway_reply(p_pending->owner, "queued %u\n", m_gateway.next_id);
+
+		m_gateway.next_id = (m_gateway.next_id + 1) % GATEWAY_IDS_NUM;
+
+		if (false == gateway_write(m_gateway.serial_fd, buffer, length))
+		{
+			perror("serial");
+			m_stop = 1;
+			return;
+		}
+	}
+}
+
+
+/* Count as lost the requests without outcome for too long */
+static void gateway_timeouts(uint64_t now)
+{
+	uint32_t id;
+
+	for (id = 0; id < GATEWAY_IDS_NUM; id++)
+	{
+		if ((true == m_gateway.requests[id].active) && ((now - m_gateway.requests[id].start) > GATEWAY_REQUEST_TIMEOUT))
+		{
+			m_gateway.requests[id].active = false;
+			m_gateway.inflight--;
+			m_gateway.lost++;
+			if (false == m_gateway.requests[id].parsed)
+			{
+				m_gateway.unparsed--;
+			}
+			if (GATEWAY_OWNER_LOAD == m_gateway.requests[id].owner)
+			{
+				m_gateway.load_done++;
+			}
+			gateway_reply(m_gateway.requests[id].owner, "lost %u\n", id);
+		}
+	}
+}
+
+
+/* Fill the destination of a command: "group <n>" or "target <address>" */
+static bool gateway_destination_parse(cmd_t * p_cmd, char * p_kind, char * p_value)
+{
+	if (NULL == p_kind)
+	{
+		return true;
+	}
+	if (NULL == p_value)
+	{
+		return false;
+	}
+
+	if (0 == strcmp(p_kind, "group"))
+	{
+		p_cmd->group = (uint8_t)strtoul(p_value, NULL, 0);
+		p_cmd->fields |= CMD_FIELD_GROUP;
+		return true;
+	}
+
+	if ((0 == strcmp(p_kind, "target")) && (strlen(p_value) <= CMD_ADDRESS_MAX_LENGTH) &&
+		 (1 == inet_pton(AF_INET6, p_value, p_cmd->address)))
+	{
+		strcpy(p_cmd->target, p_value);
+		p_cmd->fields |= (PROTOCOL_MODE_BINARY == m_gateway.mode) ? CMD_FIELD_ADDRESS : CMD_FIELD_TARGET;
+		return true;
+	}
+
+	return false;
+}
+
+
+/* Run a socket request line:
+   light <on|off|toggle> [group <n> | target <address>]
+   level <0-100> [group <n> | target <address>]
+   batch <id>:<level>[,<id>:<level>...] [group <n>]
+   stats */
+static void gateway_line_run(int owner, char * p_line)
+{
+	char  * p_save = NULL;
+	char  * p_word = strtok_r(p_line, " \t\r\n", &p_save);
+	char  * p_arg = strtok_r(NULL, " \t\r\n", &p_save);
+	char  * p_kind = strtok_r(NULL, " \t\r\n", &p_save);
+	char  * p_value = strtok_r(NULL, " \t\r\n", &p_save);
+	char  * p_pair;
+	char  * p_pair_save = NULL;
+	cmd_t   cmd;
+	FILE  * p_file;
+	char    stats[GATEWAY_LINE_MAX * 2];
+
+	memset(&cmd, 0, sizeof(cmd));
+
+	if (NULL == p_word)
+	{
+		return;
+	}
+
+	if (0 == strcmp(p_word, "stats"))
+	{
+		p_file = fmemopen(stats, sizeof(stats), "w");
+		if (p_file != NULL)
+		{
+			gateway_stats_print(p_file, 0);
+			fclose(p_file);
+			gateway_reply(owner, "%s", stats);
+		}
+		return;
+	}
+
+	if ((0 == strcmp(p_word, "light")) && (p_arg != NULL))
+	{
+		cmd.fields = CMD_FIELD_LIGHT;
+		if (0 == strcmp(p_arg, "on"))
+		{
+			cmd.light = CMD_LIGHT_ON;
+		}
+		else if (0 == strcmp(p_arg, "off"))
+		{
+			cmd.light = CMD_LIGHT_OFF;
+		}
+		else if (0 == strcmp(p_arg, "toggle"))
+		{
+			cmd.light = CMD_LIGHT_TOGGLE;
+		}
+		else
+		{
+			cmd.fields = 0;
+		}
+	}
+	else if ((0 == strcmp(p_word, "level")) && (p_arg != NULL))
+	{
+		cmd.fields = CMD_FIELD_LEVEL;
+		cmd.level = (uint8_t)strtoul(p_arg, NULL, 0);
+	}
+	else if ((0 == strcmp(p_word, "batch")) && (p_arg != NULL))
+	{
+		cmd.fields = CMD_FIELD_BATCH;
+		for (p_pair = strtok_r(p_arg, ",", &p_pair_save);
+			  (p_pair != NULL) && (cmd.batch_count < CMD_BATCH_MAX);
+			  p_pair = strtok_r(NULL, ",", &p_pair_save))
+		{
+			cmd.batch[cmd.batch_count][0] = (uint8_t)strtoul(p_pair, &p_pair, 0);
+			cmd.batch[cmd.batch_count][1] = (uint8_t)strtoul((':' == *p_pair) ? (p_pair + 1) : p_pair, NULL, 0);
+			cmd.batch_count++;
+		}
+	}
+
+	if ((0 == cmd.fields) || (false == gateway_destination_parse(&cmd, p_kind, p_value)))
+	{
+		gateway_reply(owner, "error usage: light <on|off|toggle> | level <n> | batch <id>:<level>,... [group <n> | target <address>] | stats\n");
+		return;
+	}
+
+	if (false == gateway_submit(&cmd, owner))
+	{
+		gateway_reply(owner, "error busy\n");
+	}
+}
+
+
+/* Generate the load commands that are due */
+static void gateway_load(uint64_t now)
+{
+	cmd_t   cmd;
+	uint8_t i;
+
+	while ((m_gateway.load_generated < m_gateway.load_count) &&
+			 ((0 == m_gateway.load_rate) ? (m_gateway.pending_count < m_gateway.credit) : (now >= m_gateway.load_next)))
+	{
+		memset(&cmd, 0, sizeof(cmd));
+
+		switch (m_gateway.load_kind)
+		{
+			case LOAD_BATCH:
+				cmd.fields = CMD_FIELD_BATCH;
+				for (i = 0; i < 8; i++)
+				{
+					cmd.batch[i][0] = i;
+					cmd.batch[i][1] = (uint8_t)((m_gateway.load_generated + i) % 101);
+				}
+				cmd.batch_count = 8;
+				break;
+
+			case LOAD_UNICAST:
+				cmd.fields = CMD_FIELD_LEVEL | ((PROTOCOL_MODE_BINARY == m_gateway.mode) ? CMD_FIELD_ADDRESS : CMD_FIELD_TARGET);
+				memcpy(cmd.address, m_gateway.load_address, sizeof(cmd.address));
+				strcpy(cmd.target, m_gateway.load_target);
+				cmd.level = (uint8_t)(m_gateway.load_generated % 101);
+				break;
+
+			case LOAD_GROUP:
+				cmd.fields = CMD_FIELD_LEVEL | CMD_FIELD_GROUP;
+				cmd.level = (uint8_t)(m_gateway.load_generated % 101);
+				break;
+
+			default:
+				cmd.fields = CMD_FIELD_LEVEL;
+				cmd.level = (uint8_t)(m_gateway.load_generated % 101);
+				break;
+		}
+
+		if (false == gateway_submit(&cmd, GATEWAY_OWNER_LOAD))
+		{
+			break;
+		}
+
+		m_gateway.load_generated++;
+		if (m_gateway.load_rate > 0)
+		{
+			m_gateway.load_next += 1000000 / m_gateway.load_rate;
+		}
+	}
+}
+
+
+/* Open the serial device in raw mode */
+static int gateway_serial_open(const char * p_device, speed_t speed, bool flow_control)
+{
+	struct termios tio;
+	int            fd = open(p_device, O_RDWR | O_NOCTTY);
+
+	if (fd < 0)
+	{
+		return -1;
+	}
+
+	if (0 == tcgetattr(fd, &tio))
+	{
+		cfmakeraw(&tio);
+		cfsetspeed(&tio, speed);
+		if (true == flow_control)
+		{
+			tio.c_cflag |= CRTSCTS;
+		}
+		tio.c_cflag |= CLOCAL | CREAD;
+		tcsetattr(fd, TCSANOW, &tio);
+	}
+
+	return fd;
+}
+
+
+/* Open the local socket */
+static int gateway_socket_open(const char * p_path)
+{
+	struct sockaddr_un address;
+	int                fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (fd < 0)
+	{
+		return -1;
+	}
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, p_path, sizeof(address.sun_path) - 1);
+	unlink(p_path);
+
+	if ((bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0) || (listen(fd, GATEWAY_CLIENTS_MAX) != 0))
+	{
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+/* Accept a socket client */
+static void gateway_client_accept(void)
+{
+	int    fd = accept(m_gateway.listen_fd, NULL, NULL);
+	size_t i;
+
+	if (fd < 0)
+	{
+		return;
+	}
+
+	for (i = 0; i < GATEWAY_CLIENTS_MAX; i++)
+	{
+		if (m_gateway.clients[i].fd < 0)
+		{
+			m_gateway.clients[i].fd = fd;
+			m_gateway.clients[i].length = 0;
+			return;
+		}
+	}
+
+	close(fd);
+}
+
+
+/* Read the request lines of a socket client */
+static void gateway_client_read(client_t * p_client)
+{
+	char     data[GATEWAY_LINE_MAX];
+	ssize_t  length = recv(p_client->fd, data, sizeof(data), 0);
+	ssize_t  i;
+	uint32_t id;
+
+	if (length <= 0)
+	{
+		/* the outcomes of the requests of a gone client are not reported */
+		for (id = 0; id < GATEWAY_IDS_NUM; id++)
+		{
+			if (m_gateway.requests[id].owner == p_client->fd)
+			{
+				m_gateway.requests[id].owner = GATEWAY_OWNER_NONE;
+			}
+		}
+		close(p_client->fd);
+		p_client->fd = -1;
+		return;
+	}
+
+	for (i = 0; i < length; i++)
+	{
+		if ('\n' == data[i])
+		{
+			p_client->line[p_client->length] = '\0';
+			gateway_line_run(p_client->fd, p_client->line);
+			p_client->length = 0;
+		}
+		else if (p_client->length < (sizeof(p_client->line) - 1))
+		{
+			p_client->line[p_client->length++] = data[i];
+		}
+	}
+}
+
+
+/* Stop on signals */
+static void gateway_signal_handler(int signal_number)
+{
+	(void)signal_number;
+
+	m_stop = 1;
+}
+
+
+/* Print the usage */
+static void gateway_usage(const char * p_name)
+{
+	fprintf(stderr,
+			  "usage: %s -d device [-m json|binary] [-b baud] [-n] [-s socket]\n"
+			  "          [-L rate] [-N count] [-K all|group|unicast|batch] [-t address]\n"
+			  "  -d  serial device of the client, or the pty of the simulated client\n"
+			  "  -m  UART channel format set on the client (uart json|binary CLI command)\n"
+			  "  -n  no RTS/CTS flow control\n"
+			  "  -s  local socket path, default " GATEWAY_SOCKET_PATH "\n"
+			  "  -N  run the load generator for count commands, then print the report and exit\n"
+			  "  -L  load commands per second, 0 (default) for as fast as the credit allows\n",
+			  p_name);
+}
+
+
+int main(int argc, char * argv[])
+{
+	struct pollfd pfds[2 + GATEWAY_CLIENTS_MAX];
+	uint8_t       data[256];
+	const char  * p_device = NULL;
+	speed_t       speed = B1000000;
+	bool          flow_control = true;
+	uint64_t      now;
+	uint64_t      last_timeouts = 0;
+	ssize_t       length;
+	nfds_t        count;
+	int           option;
+	size_t        i;
+
+	m_gateway.mode = PROTOCOL_MODE_JSON;
+	m_gateway.p_socket_path = GATEWAY_SOCKET_PATH;
+	m_gateway.credit = GATEWAY_CREDIT_DEFAULT;
+
+	while ((option = getopt(argc, argv, "d:m:b:ns:L:N:K:t:h")) != -1)
+	{
+		switch (option)
+		{
+			case 'd': p_device = optarg;											break;
+			case 'm': m_gateway.mode = (0 == strcmp(optarg, "binary")) ? PROTOCOL_MODE_BINARY : PROTOCOL_MODE_JSON;	break;
+			case 'b': speed = (0 == strcmp(optarg, "115200")) ? B115200 : B1000000;	break;
+			case 'n': flow_control = false;										break;
+			case 's': m_gateway.p_socket_path = optarg;							break;
+			case 'L': m_gateway.load_rate = strtoul(optarg, NULL, 0);			break;
+			case 'N': m_gateway.load_count = strtoull(optarg, NULL, 0);		break;
+			case 'K':
+				m_gateway.load_kind = (0 == strcmp(optarg, "group")) ? LOAD_GROUP :
+											 (0 == strcmp(optarg, "unicast")) ? LOAD_UNICAST :
+											 (0 == strcmp(optarg, "batch")) ? LOAD_BATCH : LOAD_ALL;
+				break;
+			case 't':
+				if ((strlen(optarg) > CMD_ADDRESS_MAX_LENGTH) || (inet_pton(AF_INET6, optarg, m_gateway.load_address) != 1))
+				{
+					gateway_usage(argv[0]);
+					return 1;
+				}
+				strcpy(m_gateway.load_target, optarg);
+				break;
+			default:
+				gateway_usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if ((NULL == p_device) || ((LOAD_UNICAST == m_gateway.load_kind) && ('\0' == m_gateway.load_target[0])))
+	{
+		gateway_usage(argv[0]);
+		return 1;
+	}
+
+	m_gateway.p_samples = calloc(GATEWAY_SAMPLES_MAX, sizeof(uint32_t));
+	m_gateway.serial_fd = gateway_serial_open(p_device, speed, flow_control);
+	if ((NULL == m_gateway.p_samples) || (m_gateway.serial_fd < 0))
+	{
+		perror(p_device);
+		return 1;
+	}
+
+	/* the load generator runs alone */
+	m_gateway.listen_fd = -1;
+	if (0 == m_gateway.load_count)
+	{
+		m_gateway.listen_fd = gateway_socket_open(m_gateway.p_socket_path);
+		if (m_gateway.listen_fd < 0)
+		{
+			perror(m_gateway.p_socket_path);
+			return 1;
+		}
+	}
+	for (i = 0; i < GATEWAY_CLIENTS_MAX; i++)
+	{
+		m_gateway.clients[i].fd = -1;
+	}
+
+	protocol_decoder_init(&m_gateway.decoder, m_gateway.mode, gateway_event_handler, NULL);
+	signal(SIGINT, gateway_signal_handler);
+	signal(SIGTERM, gateway_signal_handler);
+	signal(SIGPIPE, SIG_IGN);
+
+	m_gateway.load_start = gateway_now();
+	m_gateway.load_next = m_gateway.load_start;
+
+	while (0 == m_stop)
+	{
+		now = gateway_now();
+
+		gateway_load(now);
+		gateway_send();
+
+		if ((m_gateway.load_count > 0) && (m_gateway.load_done >= m_gateway.load_count))
+		{
+			break;
+		}
+
+		count = 0;
+		pfds[count].fd = m_gateway.serial_fd;
+		pfds[count++].events = POLLIN;
+		if (m_gateway.listen_fd >= 0)
+		{
+			pfds[count].fd = m_gateway.listen_fd;
+			pfds[count++].events = POLLIN;
+		}
+		for (i = 0; i < GATEWAY_CLIENTS_MAX; i++)
+		{
+			if (m_gateway.clients[i].fd >= 0)
+			{
+				pfds[count].fd = m_gateway.clients[i].fd;
+				pfds[count++].events = POLLIN;
+			}
+		}
+
+		if ((poll(pfds, count, ((m_gateway.load_rate > 0) && (m_gateway.load_generated < m_gateway.load_count)) ? 1 : 100) < 0) &&
+			 (errno != EINTR))
+		{
+			perror("poll");
+			break;
+		}
+
+		if (pfds[0].revents & POLLIN)
+		{
+			length = read(m_gateway.serial_fd, data, sizeof(data));
+			if (length > 0)
+			{
+				protocol_decoder_feed(&m_gateway.decoder, data, (size_t)length);
+			}
+		}
+		for (i = 1; i < count; i++)
+		{
+			if (0 == (pfds[i].revents & (POLLIN | POLLHUP)))
+			{
+				continue;
+			}
+			if (pfds[i].fd == m_gateway.listen_fd)
+			{
+				gateway_client_accept();
+				continue;
+			}
+			for (size_t client = 0; client < GATEWAY_CLIENTS_MAX; client++)
+			{
+				if (m_gateway.clients[client].fd == pfds[i].fd)
+				{
+					gateway_client_read(&m_gateway.clients[client]);
+					break;
+				}
+			}
+		}
+
+		now = gateway_now();
+		if ((now - last_timeouts) > 500000)
+		{
+			last_timeouts = now;
+			gateway_timeouts(now);
+		}
+	}
+
+	if (m_gateway.load_count > 0)
+	{
+		gateway_stats_print(stdout, (double)(gateway_now() - m_gateway.load_start) / 1000000.0);
+	}
+	if (m_gateway.listen_fd >= 0)
+	{
+		close(m_gateway.listen_fd);
+		unlink(m_gateway.p_socket_path);
+	}
+	if (m_gateway.decoder.errors > 0)
+	{
+		fprintf(stderr, "events not valid: %u\n", m_gateway.decoder.errors);
+	}
+	close(m_gateway.serial_fd);
+
+	return 0;
+}
+
+
+
+
+/* End of file */
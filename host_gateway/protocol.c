@@ -0,0 +1,374 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) [2017] [Marco Russi]
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+
+
+
+
+/* ------------ Inclusions ---------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "protocol.h"
+
+
+
+
+/* ---------------- exported variables -----------------  */
+
+/* event names, as in the JSON format of the client */
+const char * const protocol_event_names[PROTOCOL_EVENTS_NUM] =
+{
+	[PROTOCOL_EVENT_PARSED]     = "parsed",
+	[PROTOCOL_EVENT_SENT]       = "sent",
+	[PROTOCOL_EVENT_ACK]        = "ack",
+	[PROTOCOL_EVENT_SUPERSEDED] = "superseded",
+	[PROTOCOL_EVENT_DROPPED]    = "dropped",
+	[PROTOCOL_EVENT_DISCARDED]  = "discarded",
+	[PROTOCOL_EVENT_CREDIT]     = "credit"
+};
+
+
+
+
+/* ----------------------- local functions prototypes --------------------- */
+
+static const char * json_find			(const char *, const char *);
+static void json_event_parse			(protocol_decoder_t *);
+static void binary_event_parse		(protocol_decoder_t *);
+
+
+
+
+/* ------------------- exported functions implementation ------------------ */
+
+/* Encode a command: one operation (light, level or batch) to all the lights, to a
+   group or to a light. Returns the encoded length, 0 if the command is not valid. */
+size_t protocol_command_encode(protocol_mode_t mode, const cmd_t * p_cmd, uint8_t * p_out)
+{
+	static const char * const light_values[] = { "off", "on", "toggle" };
+	uint8_t frame[CMD_FRAME_MAX_LENGTH];
+	size_t  length = 0;
+	int     written;
+	uint8_t i;
+
+	if (PROTOCOL_MODE_BINARY == mode)
+	{
+		frame[length++] = (uint8_t)p_cmd->request_id;
+		frame[length++] = (uint8_t)(p_cmd->request_id >> 8);
+
+		if (p_cmd->fields & CMD_FIELD_LIGHT)
+		{
+			frame[length++] = CMD_FRAME_OP_LIGHT;
+		}
+		else if (p_cmd->fields & CMD_FIELD_LEVEL)
+		{
+			frame[length++] = CMD_FRAME_OP_LEVEL;
+		}
+		else if (p_cmd->fields & CMD_FIELD_BATCH)
+		{
+			frame[length++] = CMD_FRAME_OP_BATCH;
+		}
+		else
+		{
+			return 0;
+		}
+
+		if (p_cmd->fields & CMD_FIELD_ADDRESS)
+		{
+			frame[length++] = CMD_FRAME_DEST_ADDRESS;
+			memcpy(&frame[length], p_cmd->address, sizeof(p_cmd->address));
+			length += sizeof(p_cmd->address);
+		}
+		else if (p_cmd->fields & CMD_FIELD_GROUP)
+		{
+			frame[length++] = CMD_FRAME_DEST_GROUP;
+			frame[length++] = p_cmd->group;
+		}
+		else
+		{
+			frame[length++] = CMD_FRAME_DEST_ALL;
+		}
+
+		if (p_cmd->fields & CMD_FIELD_LIGHT)
+		{
+			frame[length++] = (uint8_t)p_cmd->light;
+		}
+		else if (p_cmd->fields & CMD_FIELD_LEVEL)
+		{
+			frame[length++] = p_cmd->level;
+		}
+		else
+		{
+			if ((length + (2 * p_cmd->batch_count) + 2) > sizeof(frame))
+			{
+				return 0;
+			}
+			memcpy(&frame[length], p_cmd->batch, 2 * p_cmd->batch_count);
+			length += 2 * p_cmd->batch_count;
+		}
+
+		return cmd_frame_encode(frame, length, p_out);
+	}
+
+	written = snprintf((char *)p_out, PROTOCOL_MESSAGE_MAX, "{\"command\":[{\"id\":%u", p_cmd->request_id);
+
+	if (p_cmd->fields & CMD_FIELD_LIGHT)
+	{
+		written += snprintf((char *)&p_out[written], PROTOCOL_MESSAGE_MAX - written,
+								  ",\"light\":\"%s\"", light_values[p_cmd->light]);
+	}
+	if (p_cmd->fields & CMD_FIELD_LEVEL)
+	{
+		written += snprintf((char *)&p_out[written], PROTOCOL_MESSAGE_MAX - written,
+								  ",\"level\":%u", p_cmd->level);
+	}
+	if (p_cmd->fields & CMD_FIELD_BATCH)
+	{
+		written += snprintf((char *)&p_out[written], PROTOCOL_MESSAGE_MAX - written, ",\"batch\":[");
+		for (i = 0; i < p_cmd->batch_count; i++)
+		{
+			written += snprintf((char *)&p_out[written], PROTOCOL_MESSAGE_MAX - written,
+									  "%s[%u,%u]", (i > 0) ? "," : "", p_cmd->batch[i][0], p_cmd->batch[i][1]);
+		}
+		written += snprintf((char *)&p_out[written], PROTOCOL_MESSAGE_MAX - written, "]");
+	}
+	if (p_cmd->fields & CMD_FIELD_TARGET)
+	{
+		written += snprintf((char *)&p_out[written], PROTOCOL_MESSAGE_MAX - written,
+								  ",\"target\":\"%s\"", p_cmd->target);
+	}
+	else if (p_cmd->fields & CMD_FIELD_GROUP)
+	{
+		written += snprintf((char *)&p_out[written], PROTOCOL_MESSAGE_MAX - written,
+								  ",\"group\":%u", p_cmd->group);
+	}
+	written += snprintf((char *)&p_out[written], PROTOCOL_MESSAGE_MAX - written, "}]}.\n");
+
+	return (written < PROTOCOL_MESSAGE_MAX) ? (size_t)written : 0;
+}
+
+
+/* Encode an event as the client does. Returns the encoded length. */
+size_t protocol_event_encode(protocol_mode_t mode, uint16_t id, protocol_event_t event, int result, uint32_t value, uint8_t * p_out)
+{
+	uint8_t frame[CMD_FRAME_EVENT_LENGTH];
+	int     written;
+
+	if (value > UINT16_MAX)
+	{
+		value = UINT16_MAX;
+	}
+
+	if (PROTOCOL_MODE_BINARY == mode)
+	{
+		frame[0] = (uint8_t)id;
+		frame[1] = (uint8_t)(id >> 8);
+		frame[2] = (uint8_t)event;
+		frame[3] = (uint8_t)result;
+		frame[4] = (uint8_t)value;
+		frame[5] = (uint8_t)(value >> 8);
+		return cmd_frame_encode(frame, sizeof(frame), p_out);
+	}
+
+	if (PROTOCOL_EVENT_CREDIT == event)
+	{
+		written = snprintf((char *)p_out, PROTOCOL_MESSAGE_MAX, "{\"event\":\"%s\",\"credit\":%u,\"outstanding\":%d}\r\n",
+								 protocol_event_names[event], value, result);
+	}
+	else if (PROTOCOL_ID_NONE == id)
+	{
+		written = snprintf((char *)p_out, PROTOCOL_MESSAGE_MAX, "{\"event\":\"%s\",\"result\":%d}\r\n",
+								 protocol_event_names[event], result);
+	}
+	else
+	{
+		written = snprintf((char *)p_out, PROTOCOL_MESSAGE_MAX, "{\"id\":%u,\"event\":\"%s\",\"result\":%d,\"rtt\":%u}\r\n",
+								 id, protocol_event_names[event], result, value);
+	}
+
+	return (size_t)written;
+}
+
+
+/* Init an event decoder */
+void protocol_decoder_init(protocol_decoder_t * p_decoder, protocol_mode_t mode, protocol_event_handler_t handler, void * p_context)
+{
+	memset(p_decoder, 0, sizeof(protocol_decoder_t));
+
+	p_decoder->mode = mode;
+	p_decoder->handler = handler;
+	p_decoder->p_context = p_context;
+}
+
+
+/* Decode the given bytes: events are lines in JSON format and frames delimited by 0x00 in binary format */
+void protocol_decoder_feed(protocol_decoder_t * p_decoder, const uint8_t * p_data, size_t length)
+{
+	uint8_t delimiter = (PROTOCOL_MODE_BINARY == p_decoder->mode) ? 0x00 : '\n';
+
+	while (length-- > 0)
+	{
+		if (*p_data == delimiter)
+		{
+			if (PROTOCOL_MODE_BINARY == p_decoder->mode)
+			{
+				binary_event_parse(p_decoder);
+			}
+			else
+			{
+				json_event_parse(p_decoder);
+			}
+			p_decoder->length = 0;
+		}
+		else if (p_decoder->length < (sizeof(p_decoder->data) - 1))
+		{
+			p_decoder->data[p_decoder->length++] = *p_data;
+		}
+		p_data++;
+	}
+}
+
+
+
+
+/* ------------------- local functions implementation ------------------ */
+
+/* Find the value of a key in a JSON line */
+static const char * json_find(const char * p_line, const char * p_key)
+{
+	const char * p_value = strstr(p_line, p_key);
+
+	return (p_value != NULL) ? (p_value + strlen(p_key)) : NULL;
+}
+
+
+/* Parse an event line: {"id":12,"event":"ack","result":0,"rtt":35} */
+static void json_event_parse(protocol_decoder_t * p_decoder)
+{
+	const char * p_line = (const char *)p_decoder->data;
+	const char * p_value;
+	uint16_t     id = PROTOCOL_ID_NONE;
+	int          result = 0;
+	uint32_t     value = 0;
+	uint8_t      event;
+
+	p_decoder->data[p_decoder->length] = '\0';
+
+	p_value = json_find(p_line, "\"event\":\"");
+	if (NULL == p_value)
+	{
+		p_decoder->errors++;
+		return;
+	}
+	for (event = 0; event < PROTOCOL_EVENTS_NUM; event++)
+	{
+		if ((0 == strncmp(p_value, protocol_event_names[event], strlen(protocol_event_names[event]))) &&
+			 ('"' == p_value[strlen(protocol_event_names[event])]))
+		{
+			break;
+		}
+	}
+	if (event == PROTOCOL_EVENTS_NUM)
+	{
+		p_decoder->errors++;
+		return;
+	}
+
+	if ((p_value = json_find(p_line, "\"id\":")) != NULL)
+	{
+		id = (uint16_t)strtoul(p_value, NULL, 10);
+	}
+	if ((p_value = json_find(p_line, "\"result\":")) != NULL)
+	{
+		result = (int)strtol(p_value, NULL, 10);
+	}
+	if ((p_value = json_find(p_line, "\"outstanding\":")) != NULL)
+	{
+		result = (int)strtol(p_value, NULL, 10);
+	}
+	if ((p_value = json_find(p_line, "\"rtt\":")) != NULL)
+	{
+		value = (uint32_t)strtoul(p_value, NULL, 10);
+	}
+	if ((p_value = json_find(p_line, "\"credit\":")) != NULL)
+	{
+		value = (uint32_t)strtoul(p_value, NULL, 10);
+	}
+
+	p_decoder->handler(id, (protocol_event_t)event, result, value, p_decoder->p_context);
+}
+
+
+/* COBS decode an event frame in place and check it */
+static void binary_event_parse(protocol_decoder_t * p_decoder)
+{
+	uint8_t * p_data = p_decoder->data;
+	size_t    in = 0;
+	size_t    out = 0;
+	uint8_t   code;
+	uint8_t   i;
+
+	if (0 == p_decoder->length)
+	{
+		return;
+	}
+
+	while (in < p_decoder->length)
+	{
+		code = p_data[in++];
+		if ((0 == code) || ((in + code - 1) > p_decoder->length))
+		{
+			p_decoder->errors++;
+			return;
+		}
+		for (i = 1; i < code; i++)
+		{
+			p_data[out++] = p_data[in++];
+		}
+		if ((code != 0xFF) && (in < p_decoder->length))
+		{
+			p_data[out++] = 0;
+		}
+	}
+
+	if ((out != (CMD_FRAME_EVENT_LENGTH + 2)) ||
+		 (cmd_frame_crc(p_data, CMD_FRAME_EVENT_LENGTH) != (uint16_t)(p_data[6] | (p_data[7] << 8))) ||
+		 (p_data[2] >= PROTOCOL_EVENTS_NUM))
+	{
+		p_decoder->errors++;
+		return;
+	}
+
+	p_decoder->handler((uint16_t)(p_data[0] | (p_data[1] << 8)),
+							 (protocol_event_t)p_data[2],
+							 (int)p_data[3],
+							 (uint32_t)(p_data[4] | (p_data[5] << 8)),
+							 p_decoder->p_context);
+}
+
+
+
+
+/* End of file */
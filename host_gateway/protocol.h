@@ -0,0 +1,124 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) [2017] [Marco Russi]
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+
+
+
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+
+
+
+/* ------------ Inclusions ---------------- */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "cmd_parser.h"
+#include "cmd_frame.h"
+
+
+
+
+/* ---------------- exported constants -----------------  */
+
+/* request id of the events that do not belong to a request */
+#define PROTOCOL_ID_NONE					0xFFFF
+
+/* max length of an encoded command or event */
+#define PROTOCOL_MESSAGE_MAX				512
+
+/* OpenThread error codes reported in the events */
+#define PROTOCOL_RESULT_NONE				0
+#define PROTOCOL_RESULT_NO_BUFS			3
+#define PROTOCOL_RESULT_PARSE				6
+#define PROTOCOL_RESULT_TIMEOUT			28
+
+
+
+
+/* ---------------- exported typedefs -----------------  */
+
+/* UART channel formats of the client */
+typedef enum
+{
+	PROTOCOL_MODE_JSON,
+	PROTOCOL_MODE_BINARY
+} protocol_mode_t;
+
+/* events sent by the client, in the order of its request_event_t */
+typedef enum
+{
+	PROTOCOL_EVENT_PARSED,
+	PROTOCOL_EVENT_SENT,
+	PROTOCOL_EVENT_ACK,
+	PROTOCOL_EVENT_SUPERSEDED,
+	PROTOCOL_EVENT_DROPPED,
+	PROTOCOL_EVENT_DISCARDED,
+	PROTOCOL_EVENT_CREDIT,
+	PROTOCOL_EVENTS_NUM
+} protocol_event_t;
+
+/* function called for each received event: the value is the RTT of an ack and the
+   credit of a credit event, whose result is the number of requests in flight */
+typedef void (*protocol_event_handler_t)(uint16_t id, protocol_event_t event, int result, uint32_t value, void * p_context);
+
+/* event decoder context */
+typedef struct
+{
+	protocol_mode_t            mode;                            	/**< Channel format. */
+	protocol_event_handler_t   handler;                         	/**< Event handler. */
+	void                     * p_context;                       	/**< Event handler context. */
+	uint8_t                    data[PROTOCOL_MESSAGE_MAX];      	/**< Bytes of the event being received. */
+	size_t                     length;                          	/**< Bytes received. */
+	uint32_t                   errors;                          	/**< Events not valid. */
+} protocol_decoder_t;
+
+
+
+
+/* ---------------- exported variables -----------------  */
+
+extern const char * const protocol_event_names[PROTOCOL_EVENTS_NUM];
+
+
+
+
+/* ---------------- exported functions -----------------  */
+
+extern size_t protocol_command_encode		(protocol_mode_t, const cmd_t *, uint8_t *);
+extern size_t protocol_event_encode			(protocol_mode_t, uint16_t, protocol_event_t, int, uint32_t, uint8_t *);
+extern void protocol_decoder_init			(protocol_decoder_t *, protocol_mode_t, protocol_event_handler_t, void *);
+extern void protocol_decoder_feed			(protocol_decoder_t *, const uint8_t *, size_t);
+
+
+
+
+#endif
+
+
+
+
+/* End of file */
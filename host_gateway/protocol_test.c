@@ -0,0 +1,184 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) [2017] [Marco Russi]
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+
+
+
+
+/* Host test of the client decoders: the largest commands encoded by the gateway
+   go through the frame decoder, broken JSON documents through the parser: make test */
+
+
+
+
+/* ------------ Inclusions ---------------- */
+
+#include <stdio.h>
+#include <string.h>
+#include "protocol.h"
+
+
+
+
+/* ---------------- local variables -----------------  */
+
+/* last decoded command */
+static cmd_t m_decoded;
+
+/* commands decoded */
+static unsigned m_decoded_count;
+
+/* documents discarded */
+static unsigned m_discarded_count;
+
+/* failed checks */
+static unsigned m_failures;
+
+
+
+
+/* ----------------------- local functions prototypes --------------------- */
+
+static void test_command_handler		(const cmd_t *, void *);
+static void test_batch_roundtrip		(const char *, uint8_t);
+static void test_parser_resync			(const char *, const char *);
+
+
+
+
+/* ------------------- local functions implementation --------------------- */
+
+/* Keep the decoded command */
+static void test_command_handler(const cmd_t * p_cmd, void * p_context)
+{
+	(void)p_context;
+
+	if (p_cmd != NULL)
+	{
+		m_decoded = *p_cmd;
+		m_decoded_count++;
+	}
+	else
+	{
+		m_discarded_count++;
+	}
+}
+
+
+/* Encode a full batch to a destination, decode it and compare */
+static void test_batch_roundtrip(const char * p_name, uint8_t fields)
+{
+	cmd_frame_t frame;
+	cmd_t       cmd;
+	uint8_t     encoded[PROTOCOL_MESSAGE_MAX];
+	size_t      length;
+	uint8_t     i;
+	bool        passed;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.fields      = CMD_FIELD_ID | CMD_FIELD_BATCH | fields;
+	cmd.request_id  = 0x1234;
+	cmd.group       = 7;
+	cmd.batch_count = CMD_BATCH_MAX;
+	for (i = 0; i < CMD_BATCH_MAX; i++)
+	{
+		cmd.batch[i][0] = i;
+		cmd.batch[i][1] = (uint8_t)(100 - i);
+	}
+
+	memset(&m_decoded, 0, sizeof(m_decoded));
+	m_decoded_count = 0;
+	cmd_frame_init(&frame, test_command_handler, NULL);
+
+	length = protocol_command_encode(PROTOCOL_MODE_BINARY, &cmd, encoded);
+	if (length > 0)
+	{
+		cmd_frame_feed(&frame, encoded, length);
+	}
+
+	passed = (length > 0) &&
+				(1 == m_decoded_count) &&
+				(0 == frame.errors) &&
+				(m_decoded.request_id == cmd.request_id) &&
+				((m_decoded.fields & (CMD_FIELD_GROUP | CMD_FIELD_BATCH)) == (cmd.fields & (CMD_FIELD_GROUP | CMD_FIELD_BATCH))) &&
+				(m_decoded.group == ((fields & CMD_FIELD_GROUP) ? cmd.group : 0)) &&
+				(m_decoded.batch_count == cmd.batch_count) &&
+				(0 == memcmp(m_decoded.batch, cmd.batch, sizeof(cmd.batch)));
+
+	printf("%-32s %s\n", p_name, passed ? "ok" : "FAIL");
+	if (false == passed)
+	{
+		m_failures++;
+	}
+}
+
+
+/* Feed a broken document followed by a valid one: the broken one is discarded
+   up to its terminator and the valid one is executed */
+static void test_parser_resync(const char * p_name, const char * p_broken)
+{
+	static const char valid[] = "{\"command\":[{\"light\":\"off\",\"id\":7}]}.";
+	cmd_parser_t parser;
+	bool         passed;
+
+	memset(&m_decoded, 0, sizeof(m_decoded));
+	m_decoded_count = 0;
+	m_discarded_count = 0;
+	cmd_parser_init(&parser, test_command_handler, NULL);
+
+	cmd_parser_feed(&parser, (const uint8_t *)p_broken, strlen(p_broken));
+	cmd_parser_feed(&parser, (const uint8_t *)valid, strlen(valid));
+
+	passed = (1 == m_discarded_count) &&
+				(1 == m_decoded_count) &&
+				(0 != (m_decoded.fields & CMD_FIELD_LIGHT)) &&
+				(CMD_LIGHT_OFF == m_decoded.light) &&
+				(7 == m_decoded.request_id);
+
+	printf("%-32s %s\n", p_name, passed ? "ok" : "FAIL");
+	if (false == passed)
+	{
+		m_failures++;
+	}
+}
+
+
+
+
+/* ------------------- exported functions implementation ------------------ */
+
+int main(void)
+{
+	test_batch_roundtrip("full batch to all lights", 0);
+	test_batch_roundtrip("full batch to a group", CMD_FIELD_GROUP);
+	test_parser_resync("resync after a broken value", "{\"command\":[{\"light\":on}]}.");
+	test_parser_resync("resync after an open string", "{\"command\":[{\"light\":\"on}]}.");
+	test_parser_resync("resync after a string error", "{\"command\":[{\"light\":\"o\tn\"}]}.");
+
+	return (0 == m_failures) ? 0 : 1;
+}
+
+
+
+
+/* End of file */
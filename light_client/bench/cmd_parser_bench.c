@@ -0,0 +1,213 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) [2017] [Marco Russi]
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+
+
+
+
+/* Host benchmark of the UART command parser: parse throughput over a mix of
+   command documents and worst-case cost of a single byte. */
+
+
+
+
+/* ------------ Inclusions ---------------- */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "cmd_parser.h"
+
+
+
+
+/* ---------------- local constants -----------------  */
+
+/* throughput run length */
+#define BENCH_THROUGHPUT_BYTES			(64UL * 1024 * 1024)
+
+/* passes of the per byte run */
+#define BENCH_BYTE_PASSES					2000
+
+
+
+
+/* ---------------- local variables -----------------  */
+
+/* command documents as sent by a host */
+static const char * const m_documents[] =
+{
+	"{\"command\":[{\"light\":\"on\"}]}.",
+	"{\"command\":[{\"light\":\"off\"}]}.",
+	"{\"command\":[{\"level\":75,\"group\":3}]}.",
+	"{\"command\":[{\"light\":\"toggle\",\"target\":\"fdde:ad00:beef:0:558:f56b:d688:799\"}]}.",
+	"{\"command\":[{\"batch\":[[0,10],[1,20],[2,30],[3,40],[4,50],[5,60],[6,70],[7,80]]}]}.",
+	"{ \"command\" : [ { \"light\" : \"on\" , \"group\" : 1 } , { \"level\" : 20 , \"group\" : 2 } ] }\r\n.",
+	/* broken documents are discarded up to the terminator */
+	"{\"command\":[{\"light\":\"dim\"}]}.",
+	"{\"command\":[{\"level\":300}]}."
+};
+
+/* commands handled, keeps the handler from being optimized out */
+static volatile uint32_t m_handled;
+
+
+
+
+/* ------------------- local functions implementation ------------------ */
+
+/* Command handler */
+static void bench_handler(const cmd_t * p_cmd, void * p_context)
+{
+	(void)p_context;
+
+	if (p_cmd != NULL)
+	{
+		m_handled += p_cmd->fields;
+	}
+}
+
+
+/* Monotonic time in ns */
+static uint64_t bench_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+
+/* Cycle counter, ns where no counter is available */
+static inline uint64_t bench_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return bench_ns();
+#endif
+}
+
+
+int main(void)
+{
+	static uint8_t corpus[4096];
+	cmd_parser_t parser;
+	size_t   corpus_length = 0;
+	size_t   length;
+	uint64_t fed = 0;
+	uint64_t start;
+	uint64_t elapsed;
+	uint64_t overhead = UINT64_MAX;
+	uint64_t worst = 0;
+	uint64_t cycles;
+	uint8_t  worst_byte = 0;
+	uint32_t pass;
+	size_t   i;
+
+	for (i = 0; i < sizeof(m_documents) / sizeof(m_documents[0]); i++)
+	{
+		length = strlen(m_documents[i]);
+		memcpy(&corpus[corpus_length], m_documents[i], length);
+		corpus_length += length;
+	}
+
+	cmd_parser_init(&parser, bench_handler, NULL);
+
+	/* throughput: the corpus as it comes out of the UART chunks */
+	start = bench_ns();
+	while (fed < BENCH_THROUGHPUT_BYTES)
+	{
+		for (i = 0; i < corpus_length; i += 64)
+		{
+			length = (corpus_length - i) < 64 ? (corpus_length - i) : 64;
+			cmd_parser_feed(&parser, &corpus[i], length);
+		}
+		fed += corpus_length;
+	}
+	elapsed = bench_ns() - start;
+
+	printf("throughput:  %.1f MB/s, %.2f M commands/s, %u errors per corpus\n",
+			 (double)fed * 1000.0 / elapsed,
+			 (double)parser.commands * 1000.0 / elapsed,
+			 (unsigned)(parser.errors / (fed / corpus_length)));
+
+	/* timer overhead, subtracted from each sample */
+	for (pass = 0; pass < 100000; pass++)
+	{
+		start = bench_cycles();
+		cycles = bench_cycles() - start;
+		if (cycles < overhead)
+		{
+			overhead = cycles;
+		}
+	}
+
+	/* worst case: the best of many passes for each byte, then the worst byte,
+	   so that interrupts and cache misses of the host do not count */
+	static uint64_t best[sizeof(corpus)];
+	memset(best, 0xFF, sizeof(best));
+	for (pass = 0; pass < BENCH_BYTE_PASSES; pass++)
+	{
+		cmd_parser_reset(&parser);
+		for (i = 0; i < corpus_length; i++)
+		{
+			start = bench_cycles();
+			cmd_parser_feed(&parser, &corpus[i], 1);
+			cycles = bench_cycles() - start;
+			if (cycles < best[i])
+			{
+				best[i] = cycles;
+			}
+		}
+	}
+	for (i = 0; i < corpus_length; i++)
+	{
+		if (best[i] > worst)
+		{
+			worst = best[i];
+			worst_byte = corpus[i];
+		}
+	}
+
+#if defined(__x86_64__) || defined(__i386__)
+	printf("worst byte:  %llu cycles ('%c'), timer overhead %llu cycles\n",
+#else
+	printf("worst byte:  %llu ns ('%c'), timer overhead %llu ns\n",
+#endif
+			 (unsigned long long)(worst > overhead ? worst - overhead : 0),
+			 worst_byte,
+			 (unsigned long long)overhead);
+
+	return 0;
+}
+
+
+
+
+/* End of file */
@@ -0,0 +1,329 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) [2017] [Marco Russi]
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+
+
+
+
+/* ------------ Inclusions ---------------- */
+
+#include <string.h>
+#include "cmd_frame.h"
+
+
+
+
+/* ---------------- local constants -----------------  */
+
+/* frame delimiter */
+#define CMD_FRAME_DELIMITER				0x00
+
+/* COBS code of a block not followed by a zero */
+#define CMD_FRAME_COBS_FULL_BLOCK		0xFF
+
+/* header length: request id, operation and destination */
+#define CMD_FRAME_HEADER_LENGTH			4
+
+/* CRC length */
+#define CMD_FRAME_CRC_LENGTH				2
+
+
+
+
+/* ----------------------- local functions prototypes --------------------- */
+
+static bool frame_parse					(cmd_frame_t *);
+static void frame_end					(cmd_frame_t *);
+
+
+
+
+/* ------------------- exported functions implementation ------------------ */
+
+/* Init a frame decoder with the handler of the valid commands */
+void cmd_frame_init(cmd_frame_t * p_frame, cmd_handler_t handler, void * p_context)
+{
+	memset(p_frame, 0, sizeof(cmd_frame_t));
+
+	p_frame->handler = handler;
+	p_frame->p_context = p_context;
+
+	cmd_frame_reset(p_frame);
+}
+
+
+/* Discard the frame being decoded, counters are kept */
+void cmd_frame_reset(cmd_frame_t * p_frame)
+{
+	p_frame->code = CMD_FRAME_COBS_FULL_BLOCK;
+	p_frame->remaining = 0;
+	p_frame->length = 0;
+	p_frame->overflow = false;
+}
+
+
+/* Decode the given bytes. Each valid frame is handed to the handler at its delimiter. */
+void cmd_frame_feed(cmd_frame_t * p_frame, const uint8_t * p_data, size_t length)
+{
+	uint8_t byte;
+
+	while (length-- > 0)
+	{
+		byte = *p_data++;
+
+		if (CMD_FRAME_DELIMITER == byte)
+		{
+			frame_end(p_frame);
+			continue;
+		}
+
+		if (0 == p_frame->remaining)
+		{
+			/* a block shorter than the max one stands for a zero, unless it is the last one */
+			if ((p_frame->code != CMD_FRAME_COBS_FULL_BLOCK) && (p_frame->length < CMD_FRAME_MAX_LENGTH))
+			{
+				p_frame->frame[p_frame->length++] = 0;
+			}
+			else if (p_frame->code != CMD_FRAME_COBS_FULL_BLOCK)
+			{
+				p_frame->overflow = true;
+			}
+
+			p_frame->code = byte;
+			p_frame->remaining = byte - 1;
+		}
+		else
+		{
+			if (p_frame->length < CMD_FRAME_MAX_LENGTH)
+			{
+				p_frame->frame[p_frame->length++] = byte;
+			}
+			else
+			{
+				p_frame->overflow = true;
+			}
+			p_frame->remaining--;
+		}
+	}
+}
+
+
+/* Append the CRC to a frame and COBS encode it with its delimiter. The output
+   buffer must hold CMD_FRAME_ENCODED_LENGTH(length) bytes. Returns the encoded length. */
+size_t cmd_frame_encode(const uint8_t * p_data, size_t length, uint8_t * p_out)
+{
+	uint8_t  crc_bytes[CMD_FRAME_CRC_LENGTH];
+	uint16_t crc = cmd_frame_crc(p_data, length);
+	size_t   code_index = 0;
+	size_t   out = 1;
+	uint8_t  code = 1;
+	uint8_t  byte;
+	size_t   i;
+
+	crc_bytes[0] = (uint8_t)crc;
+	crc_bytes[1] = (uint8_t)(crc >> 8);
+
+	for (i = 0; i < (length + CMD_FRAME_CRC_LENGTH); i++)
+	{
+		byte = (i < length) ? p_data[i] : crc_bytes[i - length];
+
+		if (0 == byte)
+		{
+			p_out[code_index] = code;
+			code_index = out++;
+			code = 1;
+		}
+		else
+		{
+			p_out[out++] = byte;
+			code++;
+			if (CMD_FRAME_COBS_FULL_BLOCK == code)
+			{
+				p_out[code_index] = code;
+				code_index = out++;
+				code = 1;
+			}
+		}
+	}
+
+	p_out[code_index] = code;
+	p_out[out++] = CMD_FRAME_DELIMITER;
+
+	return out;
+}
+
+
+/* CRC-16/CCITT-FALSE */
+uint16_t cmd_frame_crc(const uint8_t * p_data, size_t length)
+{
+	uint16_t crc = 0xFFFF;
+	uint8_t  bit;
+
+	while (length-- > 0)
+	{
+		crc ^= (uint16_t)(*p_data++) << 8;
+		for (bit = 0; bit < 8; bit++)
+		{
+			crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+		}
+	}
+
+	return crc;
+}
+
+
+
+
+/* ------------------- local functions implementation ------------------ */
+
+/* Fill the command of a decoded frame, false if the frame is malformed */
+static bool frame_parse(cmd_frame_t * p_frame)
+{
+	const uint8_t * p_data = &p_frame->frame[CMD_FRAME_HEADER_LENGTH];
+	uint8_t         length = p_frame->length - CMD_FRAME_HEADER_LENGTH - CMD_FRAME_CRC_LENGTH;
+	cmd_t         * p_cmd = &p_frame->cmd;
+	uint8_t         i;
+
+	memset(p_cmd, 0, sizeof(cmd_t));
+	p_cmd->request_id = (uint16_t)(p_frame->frame[0] | (p_frame->frame[1] << 8));
+	p_cmd->fields = CMD_FIELD_ID;
+
+	switch (p_frame->frame[3])
+	{
+		case CMD_FRAME_DEST_ALL:
+			break;
+
+		case CMD_FRAME_DEST_GROUP:
+			if (length < 1)
+			{
+				return false;
+			}
+			p_cmd->group = *p_data++;
+			p_cmd->fields |= CMD_FIELD_GROUP;
+			length--;
+			break;
+
+		case CMD_FRAME_DEST_ADDRESS:
+			if (length < sizeof(p_cmd->address))
+			{
+				return false;
+			}
+			memcpy(p_cmd->address, p_data, sizeof(p_cmd->address));
+			p_cmd->fields |= CMD_FIELD_ADDRESS;
+			p_data += sizeof(p_cmd->address);
+			length -= sizeof(p_cmd->address);
+			break;
+
+		default:
+			return false;
+	}
+
+	switch (p_frame->frame[2])
+	{
+		case CMD_FRAME_OP_LIGHT:
+			if ((length != 1) || (p_data[0] > CMD_LIGHT_TOGGLE))
+			{
+				return false;
+			}
+			p_cmd->light = (cmd_light_t)p_data[0];
+			p_cmd->fields |= CMD_FIELD_LIGHT;
+			break;
+
+		case CMD_FRAME_OP_LEVEL:
+			if (length != 1)
+			{
+				return false;
+			}
+			p_cmd->level = p_data[0];
+			p_cmd->fields |= CMD_FIELD_LEVEL;
+			break;
+
+		case CMD_FRAME_OP_BATCH:
+			if ((length % 2) != 0)
+			{
+				return false;
+			}
+			for (i = 0; i < (length / 2); i++)
+			{
+				p_cmd->batch[i][0] = p_data[2 * i];
+				p_cmd->batch[i][1] = p_data[(2 * i) + 1];
+			}
+			p_cmd->batch_count = length / 2;
+			p_cmd->fields |= CMD_FIELD_BATCH;
+			break;
+
+		default:
+			return false;
+	}
+
+	return true;
+}
+
+
+/* Check and hand over the frame ended by a delimiter */
+static void frame_end(cmd_frame_t * p_frame)
+{
+	uint16_t crc;
+
+	/* back to back delimiters are allowed between frames */
+	if ((0 == p_frame->length) && (0 == p_frame->remaining) && (false == p_frame->overflow))
+	{
+		cmd_frame_reset(p_frame);
+		return;
+	}
+
+	if ((true == p_frame->overflow) ||
+		 (p_frame->remaining != 0) ||
+		 (p_frame->length < (CMD_FRAME_HEADER_LENGTH + CMD_FRAME_CRC_LENGTH)))
+	{
+		p_frame->errors++;
+		p_frame->handler(NULL, p_frame->p_context);
+		cmd_frame_reset(p_frame);
+		return;
+	}
+
+	crc = cmd_frame_crc(p_frame->frame, p_frame->length - CMD_FRAME_CRC_LENGTH);
+	if (crc != (uint16_t)(p_frame->frame[p_frame->length - 2] | (p_frame->frame[p_frame->length - 1] << 8)))
+	{
+		p_frame->crc_errors++;
+		p_frame->errors++;
+		p_frame->handler(NULL, p_frame->p_context);
+	}
+	else if (false == frame_parse(p_frame))
+	{
+		p_frame->errors++;
+		p_frame->handler(NULL, p_frame->p_context);
+	}
+	else
+	{
+		p_frame->commands++;
+		p_frame->handler(&p_frame->cmd, p_frame->p_context);
+	}
+
+	cmd_frame_reset(p_frame);
+}
+
+
+
+
+/* End of file */
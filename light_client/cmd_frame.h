@@ -0,0 +1,111 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) [2017] [Marco Russi]
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+
+
+
+
+#ifndef CMD_FRAME_H
+#define CMD_FRAME_H
+
+
+
+
+/* ------------ Inclusions ---------------- */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "cmd_parser.h"
+
+
+
+
+/* ---------------- exported constants -----------------  */
+
+/* Binary frames are COBS encoded and delimited by a 0x00 byte. A decoded frame is:
+   request id (2, LE) | operation (1) | destination (1) | destination data | operation data | CRC (2, LE)
+   where the CRC is CRC-16/CCITT-FALSE of all the previous bytes. */
+
+/* operations */
+#define CMD_FRAME_OP_LIGHT					0x01	/**< Data: light value, cmd_light_t. */
+#define CMD_FRAME_OP_LEVEL					0x02	/**< Data: dim level. */
+#define CMD_FRAME_OP_BATCH					0x03	/**< Data: [light index, level] pairs. */
+
+/* destinations */
+#define CMD_FRAME_DEST_ALL					0x00	/**< No data. */
+#define CMD_FRAME_DEST_GROUP				0x01	/**< Data: group. */
+#define CMD_FRAME_DEST_ADDRESS				0x02	/**< Data: IPv6 address. */
+
+/* max length of a decoded frame: a full batch to a group, with the group byte */
+#define CMD_FRAME_MAX_LENGTH				(4 + 1 + (2 * CMD_BATCH_MAX) + 2)
+
+/* Frames sent back to the host report the outcome of the requests:
+   request id (2, LE) | event (1) | result (1) | RTT in ms (2, LE) | CRC (2, LE)
+   where request id 0xFFFF is used for a discarded frame, whose id is not known. */
+#define CMD_FRAME_EVENT_LENGTH				6
+
+/* encoded length of a frame: CRC, COBS overhead and delimiter */
+#define CMD_FRAME_ENCODED_LENGTH(length)	((length) + 2 + (((length) + 2) / 254) + 2)
+
+
+
+
+/* ---------------- exported typedefs -----------------  */
+
+/* frame decoder context. It holds the whole state between calls, no heap is used. */
+typedef struct
+{
+	cmd_handler_t        handler;                                   	/**< Command handler. */
+	void               * p_context;                                 	/**< Command handler context. */
+	uint8_t              code;                                      	/**< COBS code of the current block. */
+	uint8_t              remaining;                                 	/**< Bytes left in the current block. */
+	uint8_t              length;                                    	/**< Decoded length. */
+	bool                 overflow;                                  	/**< Frame too long. */
+	uint8_t              frame[CMD_FRAME_MAX_LENGTH];               	/**< Decoded frame. */
+	cmd_t                cmd;                                       	/**< Command of the frame. */
+	uint32_t             commands;                                  	/**< Valid frames. */
+	uint32_t             errors;                                    	/**< Discarded frames, CRC errors included. */
+	uint32_t             crc_errors;                                	/**< Frames with a wrong CRC. */
+} cmd_frame_t;
+
+
+
+
+/* ---------------- exported functions -----------------  */
+
+extern void cmd_frame_init					(cmd_frame_t *, cmd_handler_t, void *);
+extern void cmd_frame_reset					(cmd_frame_t *);
+extern void cmd_frame_feed					(cmd_frame_t *, const uint8_t *, size_t);
+extern size_t cmd_frame_encode				(const uint8_t *, size_t, uint8_t *);
+extern uint16_t cmd_frame_crc				(const uint8_t *, size_t);
+
+
+
+
+#endif
+
+
+
+
+/* End of file */
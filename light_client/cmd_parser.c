@@ -0,0 +1,608 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) [2017] [Marco Russi]
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+
+
+
+
+/* ------------ Inclusions ---------------- */
+
+#include <string.h>
+#include "cmd_parser.h"
+
+
+
+
+/* ---------------- local constants -----------------  */
+
+/* document terminator: it also discards a broken document */
+#define CMD_TERMINATOR						'.'
+
+/* numbers are saturated to this value, any greater value is out of range */
+#define CMD_NUMBER_SATURATION				0x10000
+
+
+
+
+/* ---------------- local typedefs -----------------  */
+
+/* token states */
+typedef enum
+{
+	LEXER_IDLE,
+	LEXER_STRING,
+	LEXER_ESCAPE,
+	LEXER_NUMBER
+} lexer_state_t;
+
+/* tokens */
+typedef enum
+{
+	TOKEN_OBJECT_BEGIN,
+	TOKEN_OBJECT_END,
+	TOKEN_ARRAY_BEGIN,
+	TOKEN_ARRAY_END,
+	TOKEN_COLON,
+	TOKEN_COMMA,
+	TOKEN_STRING,
+	TOKEN_NUMBER
+} token_t;
+
+/* grammar states: {"command":[{key:value, ...}, ...]} */
+typedef enum
+{
+	STATE_DOCUMENT,			/* waiting for '{' */
+	STATE_ROOT_KEY,			/* waiting for "command" or '}' */
+	STATE_ROOT_COLON,
+	STATE_ROOT_VALUE,			/* waiting for '[' */
+	STATE_LIST_FIRST,			/* waiting for '{' or ']' */
+	STATE_LIST_ITEM,			/* waiting for '{' */
+	STATE_LIST_NEXT,			/* waiting for ',' or ']' */
+	STATE_ROOT_END,			/* waiting for '}' */
+	STATE_CMD_KEY_FIRST,		/* waiting for a key or '}' */
+	STATE_CMD_KEY,				/* waiting for a key */
+	STATE_CMD_COLON,
+	STATE_CMD_VALUE,
+	STATE_CMD_NEXT,			/* waiting for ',' or '}' */
+	STATE_BATCH_FIRST,		/* waiting for '[' or ']' */
+	STATE_BATCH_ITEM,			/* waiting for '[' */
+	STATE_BATCH_NEXT,			/* waiting for ',' or ']' */
+	STATE_PAIR_LIGHT,
+	STATE_PAIR_COMMA,
+	STATE_PAIR_LEVEL,
+	STATE_PAIR_END,			/* waiting for ']' */
+	STATE_ERROR				/* discarding up to the terminator */
+} parser_state_t;
+
+/* command keys */
+typedef enum
+{
+	KEY_LIGHT,
+	KEY_LEVEL,
+	KEY_TARGET,
+	KEY_GROUP,
+	KEY_BATCH,
+	KEY_ID,
+	KEYS_NUM
+} cmd_key_t;
+
+
+
+
+/* ---------------- local variables -----------------  */
+
+/* command keys strings */
+static const char * const m_keys[KEYS_NUM] =
+{
+	[KEY_LIGHT]  = "light",
+	[KEY_LEVEL]  = "level",
+	[KEY_TARGET] = "target",
+	[KEY_GROUP]  = "group",
+	[KEY_BATCH]  = "batch",
+	[KEY_ID]     = "id"
+};
+
+/* light values strings, in cmd_light_t order */
+static const char * const m_light_values[] =
+{
+	"off",
+	"on",
+	"toggle"
+};
+
+
+
+
+/* ----------------------- local functions prototypes --------------------- */
+
+static bool token_is					(const cmd_parser_t *, const char *);
+static bool cmd_value_parse			(cmd_parser_t *, token_t);
+static bool token_parse				(cmd_parser_t *, token_t);
+static void byte_parse					(cmd_parser_t *, uint8_t);
+static void document_discard			(cmd_parser_t *);
+
+
+
+
+/* ------------------- exported functions implementation ------------------ */
+
+/* Init a parser with the handler of the complete commands */
+void cmd_parser_init(cmd_parser_t * p_parser, cmd_handler_t handler, void * p_context)
+{
+	memset(p_parser, 0, sizeof(cmd_parser_t));
+
+	p_parser->handler = handler;
+	p_parser->p_context = p_context;
+
+	cmd_parser_reset(p_parser);
+}
+
+
+/* Discard the document being parsed, counters are kept */
+void cmd_parser_reset(cmd_parser_t * p_parser)
+{
+	p_parser->state = STATE_DOCUMENT;
+	p_parser->lexer = LEXER_IDLE;
+}
+
+
+/* Parse the given bytes. Each command object is handed to the handler as soon
+   as it is closed, so the commands of a document are executed while the rest
+   of the document is still being received. */
+void cmd_parser_feed(cmd_parser_t * p_parser, const uint8_t * p_data, size_t length)
+{
+	while (length-- > 0)
+	{
+		byte_parse(p_parser, *p_data++);
+	}
+}
+
+
+
+
+/* ------------------- local functions implementation ------------------ */
+
+/* Compare the string token */
+static bool token_is(const cmd_parser_t * p_parser, const char * p_string)
+{
+	return (false == p_parser->token_overflow) && (0 == strcmp(p_parser->token, p_string));
+}
+
+
+/* Parse the value of a command key */
+static bool cmd_value_parse(cmd_parser_t * p_parser, token_t token)
+{
+	cmd_t * p_cmd = &p_parser->cmd;
+	uint8_t i;
+
+	switch (p_parser->key)
+	{
+		case KEY_LIGHT:
+			if (TOKEN_STRING == token)
+			{
+				for (i = 0; i < sizeof(m_light_values) / sizeof(m_light_values[0]); i++)
+				{
+					if (token_is(p_parser, m_light_values[i]))
+					{
+						p_cmd->light = (cmd_light_t)i;
+						p_cmd->fields |= CMD_FIELD_LIGHT;
+						p_parser->state = STATE_CMD_NEXT;
+						return true;
+					}
+				}
+			}
+			break;
+
+		case KEY_LEVEL:
+		case KEY_GROUP:
+			if ((TOKEN_NUMBER == token) && (p_parser->number <= UINT8_MAX))
+			{
+				if (KEY_LEVEL == p_parser->key)
+				{
+					p_cmd->level = (uint8_t)p_parser->number;
+					p_cmd->fields |= CMD_FIELD_LEVEL;
+				}
+				else
+				{
+					p_cmd->group = (uint8_t)p_parser->number;
+					p_cmd->fields |= CMD_FIELD_GROUP;
+				}
+				p_parser->state = STATE_CMD_NEXT;
+				return true;
+			}
+			break;
+
+		case KEY_ID:
+			if ((TOKEN_NUMBER == token) && (p_parser->number <= UINT16_MAX))
+			{
+				p_cmd->request_id = (uint16_t)p_parser->number;
+				p_cmd->fields |= CMD_FIELD_ID;
+				p_parser->state = STATE_CMD_NEXT;
+				return true;
+			}
+			break;
+
+		case KEY_TARGET:
+			if ((TOKEN_STRING == token) && (false == p_parser->token_overflow))
+			{
+				memcpy(p_cmd->target, p_parser->token, p_parser->token_length + 1);
+				p_cmd->fields |= CMD_FIELD_TARGET;
+				p_parser->state = STATE_CMD_NEXT;
+				return true;
+			}
+			break;
+
+		case KEY_BATCH:
+			if (TOKEN_ARRAY_BEGIN == token)
+			{
+				p_cmd->batch_count = 0;
+				p_cmd->fields |= CMD_FIELD_BATCH;
+				p_parser->state = STATE_BATCH_FIRST;
+				return true;
+			}
+			break;
+
+		default:
+			break;
+	}
+
+	return false;
+}
+
+
+/* Run the grammar on a token, false if the token is not expected */
+static bool token_parse(cmd_parser_t * p_parser, token_t token)
+{
+	cmd_t * p_cmd = &p_parser->cmd;
+	uint8_t key;
+
+	switch (p_parser->state)
+	{
+		case STATE_DOCUMENT:
+			if (TOKEN_OBJECT_BEGIN == token)
+			{
+				p_parser->state = STATE_ROOT_KEY;
+				return true;
+			}
+			break;
+
+		case STATE_ROOT_KEY:
+			if ((TOKEN_STRING == token) && token_is(p_parser, "command"))
+			{
+				p_parser->state = STATE_ROOT_COLON;
+				return true;
+			}
+			else if (TOKEN_OBJECT_END == token)
+			{
+				p_parser->state = STATE_DOCUMENT;
+				return true;
+			}
+			break;
+
+		case STATE_ROOT_COLON:
+			if (TOKEN_COLON == token)
+			{
+				p_parser->state = STATE_ROOT_VALUE;
+				return true;
+			}
+			break;
+
+		case STATE_ROOT_VALUE:
+			if (TOKEN_ARRAY_BEGIN == token)
+			{
+				p_parser->state = STATE_LIST_FIRST;
+				return true;
+			}
+			break;
+
+		case STATE_LIST_FIRST:
+		case STATE_LIST_ITEM:
+			if (TOKEN_OBJECT_BEGIN == token)
+			{
+				memset(p_cmd, 0, sizeof(cmd_t));
+				p_parser->state = STATE_CMD_KEY_FIRST;
+				return true;
+			}
+			else if ((TOKEN_ARRAY_END == token) && (STATE_LIST_FIRST == p_parser->state))
+			{
+				p_parser->state = STATE_ROOT_END;
+				return true;
+			}
+			break;
+
+		case STATE_LIST_NEXT:
+			if (TOKEN_COMMA == token)
+			{
+				p_parser->state = STATE_LIST_ITEM;
+				return true;
+			}
+			else if (TOKEN_ARRAY_END == token)
+			{
+				p_parser->state = STATE_ROOT_END;
+				return true;
+			}
+			break;
+
+		case STATE_ROOT_END:
+			if (TOKEN_OBJECT_END == token)
+			{
+				p_parser->state = STATE_DOCUMENT;
+				return true;
+			}
+			break;
+
+		case STATE_CMD_KEY_FIRST:
+		case STATE_CMD_KEY:
+			if (TOKEN_STRING == token)
+			{
+				for (key = 0; key < KEYS_NUM; key++)
+				{
+					if (token_is(p_parser, m_keys[key]))
+					{
+						p_parser->key = key;
+						p_parser->state = STATE_CMD_COLON;
+						return true;
+					}
+				}
+			}
+			else if ((TOKEN_OBJECT_END == token) && (STATE_CMD_KEY_FIRST == p_parser->state))
+			{
+				p_parser->commands++;
+				p_parser->handler(p_cmd, p_parser->p_context);
+				p_parser->state = STATE_LIST_NEXT;
+				return true;
+			}
+			break;
+
+		case STATE_CMD_COLON:
+			if (TOKEN_COLON == token)
+			{
+				p_parser->state = STATE_CMD_VALUE;
+				return true;
+			}
+			break;
+
+		case STATE_CMD_VALUE:
+			return cmd_value_parse(p_parser, token);
+
+		case STATE_CMD_NEXT:
+			if (TOKEN_COMMA == token)
+			{
+				p_parser->state = STATE_CMD_KEY;
+				return true;
+			}
+			else if (TOKEN_OBJECT_END == token)
+			{
+				p_parser->commands++;
+				p_parser->handler(p_cmd, p_parser->p_context);
+				p_parser->state = STATE_LIST_NEXT;
+				return true;
+			}
+			break;
+
+		case STATE_BATCH_FIRST:
+		case STATE_BATCH_ITEM:
+			if ((TOKEN_ARRAY_BEGIN == token) && (p_cmd->batch_count < CMD_BATCH_MAX))
+			{
+				p_parser->state = STATE_PAIR_LIGHT;
+				return true;
+			}
+			else if ((TOKEN_ARRAY_END == token) && (STATE_BATCH_FIRST == p_parser->state))
+			{
+				p_parser->state = STATE_CMD_NEXT;
+				return true;
+			}
+			break;
+
+		case STATE_BATCH_NEXT:
+			if (TOKEN_COMMA == token)
+			{
+				p_parser->state = STATE_BATCH_ITEM;
+				return true;
+			}
+			else if (TOKEN_ARRAY_END == token)
+			{
+				p_parser->state = STATE_CMD_NEXT;
+				return true;
+			}
+			break;
+
+		case STATE_PAIR_LIGHT:
+		case STATE_PAIR_LEVEL:
+			if ((TOKEN_NUMBER == token) && (p_parser->number <= UINT8_MAX))
+			{
+				if (STATE_PAIR_LIGHT == p_parser->state)
+				{
+					p_cmd->batch[p_cmd->batch_count][0] = (uint8_t)p_parser->number;
+					p_parser->state = STATE_PAIR_COMMA;
+				}
+				else
+				{
+					p_cmd->batch[p_cmd->batch_count][1] = (uint8_t)p_parser->number;
+					p_parser->state = STATE_PAIR_END;
+				}
+				return true;
+			}
+			break;
+
+		case STATE_PAIR_COMMA:
+			if (TOKEN_COMMA == token)
+			{
+				p_parser->state = STATE_PAIR_LEVEL;
+				return true;
+			}
+			break;
+
+		case STATE_PAIR_END:
+			if (TOKEN_ARRAY_END == token)
+			{
+				p_cmd->batch_count++;
+				p_parser->state = STATE_BATCH_NEXT;
+				return true;
+			}
+			break;
+
+		default:
+			break;
+	}
+
+	return false;
+}
+
+
+/* Parse a byte: tokenize it and run the grammar on complete tokens */
+static void byte_parse(cmd_parser_t * p_parser, uint8_t byte)
+{
+	token_t token;
+
+	/* the terminator ends the discarding of a broken document; a document
+	   broken by the terminator itself is discarded too. No string of a command
+	   holds a '.', so it ends an unterminated string as well and the next
+	   document is not swallowed. */
+	if (CMD_TERMINATOR == byte)
+	{
+		if ((p_parser->state != STATE_DOCUMENT) && (p_parser->state != STATE_ERROR))
+		{
+			document_discard(p_parser);
+		}
+		cmd_parser_reset(p_parser);
+		return;
+	}
+
+	if (STATE_ERROR == p_parser->state)
+	{
+		return;
+	}
+
+	switch (p_parser->lexer)
+	{
+		case LEXER_STRING:
+			if ('"' == byte)
+			{
+				p_parser->lexer = LEXER_IDLE;
+				p_parser->token[p_parser->token_length] = '\0';
+				token = TOKEN_STRING;
+				break;
+			}
+			else if ('\\' == byte)
+			{
+				p_parser->lexer = LEXER_ESCAPE;
+				return;
+			}
+			else if (byte < 0x20)
+			{
+				/* control characters must be escaped */
+				document_discard(p_parser);
+				return;
+			}
+			/* fall through */
+
+		case LEXER_ESCAPE:
+			p_parser->lexer = LEXER_STRING;
+			if (p_parser->token_length < CMD_TOKEN_MAX_LENGTH)
+			{
+				p_parser->token[p_parser->token_length++] = (char)byte;
+			}
+			else
+			{
+				p_parser->token_overflow = true;
+			}
+			return;
+
+		case LEXER_NUMBER:
+			if ((byte >= '0') && (byte <= '9'))
+			{
+				p_parser->number = (p_parser->number * 10) + (byte - '0');
+				if (p_parser->number > CMD_NUMBER_SATURATION)
+				{
+					p_parser->number = CMD_NUMBER_SATURATION;
+				}
+				return;
+			}
+
+			/* the number ends here: parse it, then parse this byte as a new token */
+			p_parser->lexer = LEXER_IDLE;
+			if (false == token_parse(p_parser, TOKEN_NUMBER))
+			{
+				document_discard(p_parser);
+				return;
+			}
+			/* fall through */
+
+		default:
+			switch (byte)
+			{
+				case ' ':
+				case '\t':
+				case '\r':
+				case '\n':
+					return;
+
+				case '{':	token = TOKEN_OBJECT_BEGIN;	break;
+				case '}':	token = TOKEN_OBJECT_END;		break;
+				case '[':	token = TOKEN_ARRAY_BEGIN;		break;
+				case ']':	token = TOKEN_ARRAY_END;		break;
+				case ':':	token = TOKEN_COLON;				break;
+				case ',':	token = TOKEN_COMMA;				break;
+
+				case '"':
+					p_parser->lexer = LEXER_STRING;
+					p_parser->token_length = 0;
+					p_parser->token_overflow = false;
+					return;
+
+				default:
+					if ((byte >= '0') && (byte <= '9'))
+					{
+						p_parser->lexer = LEXER_NUMBER;
+						p_parser->number = byte - '0';
+						return;
+					}
+
+					/* anything else is not part of a command document */
+					document_discard(p_parser);
+					return;
+			}
+			break;
+	}
+
+	if (false == token_parse(p_parser, token))
+	{
+		document_discard(p_parser);
+	}
+}
+
+
+
+/* Discard the document being parsed up to the terminator and notify the handler */
+static void document_discard(cmd_parser_t * p_parser)
+{
+	p_parser->state = STATE_ERROR;
+	p_parser->errors++;
+	p_parser->handler(NULL, p_parser->p_context);
+}
+
+
+
+
+/* End of file */
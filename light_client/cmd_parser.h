@@ -0,0 +1,127 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) [2017] [Marco Russi]
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+
+
+
+
+#ifndef CMD_PARSER_H
+#define CMD_PARSER_H
+
+
+
+
+/* ------------ Inclusions ---------------- */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+
+
+/* ---------------- exported constants -----------------  */
+
+/* max length of a target address string, IPv6 text form */
+#define CMD_ADDRESS_MAX_LENGTH			39
+
+/* max pairs of a batch array */
+#define CMD_BATCH_MAX						48
+
+/* max length of a string token: the longest one is a target address */
+#define CMD_TOKEN_MAX_LENGTH				CMD_ADDRESS_MAX_LENGTH
+
+/* command fields flags */
+#define CMD_FIELD_LIGHT						0x01
+#define CMD_FIELD_LEVEL						0x02
+#define CMD_FIELD_TARGET					0x04
+#define CMD_FIELD_GROUP						0x08
+#define CMD_FIELD_BATCH						0x10
+#define CMD_FIELD_ADDRESS					0x20
+#define CMD_FIELD_ID							0x40
+
+
+
+
+/* ---------------- exported typedefs -----------------  */
+
+/* light values of a command */
+typedef enum
+{
+	CMD_LIGHT_OFF = 0,
+	CMD_LIGHT_ON,
+	CMD_LIGHT_TOGGLE
+} cmd_light_t;
+
+/* one command object of a command array */
+typedef struct
+{
+	uint8_t              fields;                                    	/**< Fields found, CMD_FIELD_ flags. */
+	uint16_t             request_id;                                	/**< "id": 0 - 65535, chosen by the host. */
+	cmd_light_t          light;                                     	/**< "light": "on" | "off" | "toggle". */
+	uint8_t              level;                                     	/**< "level": 0 - 255. */
+	uint8_t              group;                                     	/**< "group": 0 - 255. */
+	char                 target[CMD_ADDRESS_MAX_LENGTH + 1];        	/**< "target": address string. */
+	uint8_t              address[16];                               	/**< Target address of a binary frame. */
+	uint8_t              batch_count;                               	/**< Pairs of "batch". */
+	uint8_t              batch[CMD_BATCH_MAX][2];                   	/**< "batch": [[light, level], ...]. */
+} cmd_t;
+
+/* function called for each complete command object, with NULL for each discarded document */
+typedef void (*cmd_handler_t)(const cmd_t * p_cmd, void * p_context);
+
+/* parser context. It holds the whole state between calls, no heap is used. */
+typedef struct
+{
+	cmd_handler_t        handler;                                   	/**< Command handler. */
+	void               * p_context;                                 	/**< Command handler context. */
+	uint8_t              state;                                     	/**< Grammar state. */
+	uint8_t              lexer;                                     	/**< Token state. */
+	uint8_t              key;                                       	/**< Key of the value being parsed. */
+	uint8_t              token_length;                              	/**< Length of the string token. */
+	bool                 token_overflow;                            	/**< String token too long. */
+	uint32_t             number;                                    	/**< Number token. */
+	char                 token[CMD_TOKEN_MAX_LENGTH + 1];           	/**< String token. */
+	cmd_t                cmd;                                       	/**< Command being parsed. */
+	uint32_t             commands;                                  	/**< Complete commands. */
+	uint32_t             errors;                                    	/**< Discarded documents. */
+} cmd_parser_t;
+
+
+
+
+/* ---------------- exported functions -----------------  */
+
+extern void cmd_parser_init				(cmd_parser_t *, cmd_handler_t, void *);
+extern void cmd_parser_reset				(cmd_parser_t *);
+extern void cmd_parser_feed				(cmd_parser_t *, const uint8_t *, size_t);
+
+
+
+
+#endif
+
+
+
+
+/* End of file */
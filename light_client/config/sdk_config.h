@@ -114,7 +114,7 @@
 #if  GPIOTE_ENABLED
 // <o> GPIOTE_CONFIG_NUM_OF_LOW_POWER_EVENTS - Number of lower power input pins 
 #ifndef GPIOTE_CONFIG_NUM_OF_LOW_POWER_EVENTS
-#define GPIOTE_CONFIG_NUM_OF_LOW_POWER_EVENTS 4
+#define GPIOTE_CONFIG_NUM_OF_LOW_POWER_EVENTS 5
 #endif
 
 // <o> GPIOTE_CONFIG_IRQ_PRIORITY  - Interrupt priority
@@ -572,13 +572,13 @@
  
 
 #ifndef APP_FIFO_ENABLED
-#define APP_FIFO_ENABLED 1
+#define APP_FIFO_ENABLED 0
 #endif
 
 // <e> APP_UART_ENABLED - app_uart - UART driver
 //==========================================================
 #ifndef APP_UART_ENABLED
-#define APP_UART_ENABLED 1
+#define APP_UART_ENABLED 0
 #endif
 #if  APP_UART_ENABLED
 // <o> APP_UART_DRIVER_INSTANCE  - UART instance used
@@ -906,6 +906,26 @@
 #define THREAD_CHANNEL 11
 #endif
 
+// <q> THREAD_CHANNEL_SCAN  - Channel selection at network formation
+ 
+
+// <i> On the first start, join a network of the PAN ID heard on any channel,
+// <i> or form one on the quietest channel found by an energy scan.
+
+#ifndef THREAD_CHANNEL_SCAN
+#define THREAD_CHANNEL_SCAN 0
+#endif
+
+// <q> PERF_ENABLED  - Execution time counters of the hot paths
+ 
+
+// <i> Count the CPU cycles of the request handlers and send functions with the
+// <i> DWT cycle counter, reported by the stats resource and CLI command.
+
+#ifndef PERF_ENABLED
+#define PERF_ENABLED 0
+#endif
+
 // </h> 
 //==========================================================
 
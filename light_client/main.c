@@ -29,26 +29,77 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "bsp_thread.h"
 #include "app_timer.h"
-#include "app_uart.h"
+#include "nrf_drv_uart.h"
+#include "nrf_drv_gpiote.h"
 #include "nrf_log.h"
 #include "nrf_log_ctrl.h"
+#include "nrf_soc.h"
+#include "nrf_gpio.h"
+#include "cmd_parser.h"
+#include "cmd_frame.h"
+#include "event_queue.h"
+#include "channel_scan.h"
+#include "perf.h"
+#include "net_diag.h"
 
 #include <openthread/openthread.h>
 #include <openthread/diag.h>
 #include <openthread/coap.h>
 #include <openthread/cli.h>
+#ifndef LIGHT_CLIENT_SED
 #include <openthread/thread_ftd.h>
+#endif
+#include <openthread/link.h>
+#include <openthread/udp.h>
 #include <openthread/platform/platform.h>
 #include <openthread/platform/alarm.h>
+#include <openthread/platform/random.h>
+#include <openthread/platform/settings.h>
 
 
 
 
+/* Sleepy end device build (make SED=1): the remote is a child that keeps its
+   receiver off and polls its parent, so the UART channel is left out and the
+   CLI too, unless LIGHT_CLIENT_SED_CLI is defined */
+#ifndef LIGHT_CLIENT_SED
 /* Enable or disable UART channel */
 #define UART_CHANNEL_ENABLED
+#endif
+
+/* System OFF remote (make SED=1 SYSTEM_OFF=1): between presses the remote is
+   powered off, a button wakes it through a reset and OpenThread restores the
+   child from its settings */
+#if defined(LIGHT_CLIENT_SYSTEM_OFF) && !defined(LIGHT_CLIENT_SED)
+#error "LIGHT_CLIENT_SYSTEM_OFF needs LIGHT_CLIENT_SED"
+#endif
+
+/* Enable or disable the CLI */
+#if !defined(LIGHT_CLIENT_SED) || defined(LIGHT_CLIENT_SED_CLI)
+#define CLI_ENABLED
+#endif
+
+/* Prewarm the routes to the known lights after the attach: a System OFF
+   remote only wakes to send a press, so it is left out there */
+#ifndef LIGHT_CLIENT_SYSTEM_OFF
+#define PREWARM_ENABLED
+#endif
+
+/* Channel selection at network formation: a sleepy remote cannot form a network */
+#if THREAD_CHANNEL_SCAN && !defined(LIGHT_CLIENT_SED)
+#define CHANNEL_SCAN_ENABLED
+#endif
+
+/* Discover the lights and keep the cache of the known lights fresh: a sleepy
+   remote relies on its saved bindings */
+#ifndef LIGHT_CLIENT_SED
+#define DISCOVERY_ENABLED
+#endif
 
 
 
@@ -61,9 +112,180 @@
 #define DATA_UART_TX_PIN_NUM 				31
 #define DATA_UART_RTS_PIN_NUM 			28
 #define DATA_UART_CTS_PIN_NUM 			29
-/* UART buffers size */
-#define UART_TX_BUF_SIZE 					256	/**< UART TX buffer size. */
-#define UART_RX_BUF_SIZE 					256	/**< UART RX buffer size. */
+/* UART line settings: hardware flow control lets the receiver hold the host back */
+#define DATA_UART_BAUDRATE					NRF_UART_BAUDRATE_1000000
+#define DATA_UART_HWFC						NRF_UART_HWFC_ENABLED
+/* UART receive chunks: written by EasyDMA, power of 2 */
+#define UART_RX_CHUNK_SIZE					64
+#define UART_RX_CHUNKS_NUM					8
+/* chunks handed to the driver at the same time */
+#define UART_RX_ARMED_CHUNKS				2
+/* UART line idle time in ms after which a partial chunk is processed. The idle
+   check runs only from a start bit on the line until the line is idle again. */
+#define UART_RX_IDLE_INTERVAL				2
+/* UART channel format at start up */
+#define UART_MODE_DEFAULT					UART_MODE_JSON
+/* UART transmit buffer of the events, power of 2 */
+#define UART_TX_BUFFER_SIZE				512
+/* max length of an event */
+#define UART_EVENT_MAX_LENGTH				64
+/* free message buffers below which the received commands are left unparsed: the
+   requests of a whole chunk must fit above the scheduler reserve */
+#define UART_FLOW_MIN_FREE_BUFFERS		(REQUEST_MIN_FREE_BUFFERS + 8)
+/* free queue entries below which the received commands are left unparsed */
+#define UART_FLOW_MIN_FREE_REQUESTS		(REQUEST_QUEUE_SIZE / 8)
+/* credit change that is reported to the host */
+#define UART_CREDIT_HYSTERESIS			4
+/* max time in ms between two credit reports */
+#define UART_CREDIT_INTERVAL				1000
+#endif
+
+/* CoAP token length of confirmable requests */
+#define REQUEST_TOKEN_LENGTH				2
+
+/* max number of confirmable requests in flight at the same time */
+#define REQUEST_WINDOW_MAX					8
+
+/* default number of confirmable requests in flight at the same time */
+#define REQUEST_WINDOW_DEFAULT			4
+
+/* number of requests waiting to be sent */
+#define REQUEST_QUEUE_SIZE					128
+
+/* host commands sent as several unicast requests whose outcomes are combined at the same time */
+#define REQUEST_FANOUTS_MAX				8
+
+/* free message buffers left to the stack before sending a new request */
+#define REQUEST_MIN_FREE_BUFFERS			8
+
+/* request not coming from a host command with an id */
+#define REQUEST_ID_NONE						0xFFFFFFFF
+
+/* realm-local multicast address of all the lights */
+#define ALL_LIGHTS_MULTICAST_ADDRESS		"FF03::1"
+
+/* realm-local multicast address of the light groups: group id in the last byte */
+#define LIGHT_GROUP_MULTICAST_ADDRESS		"FF03::FC00:0"
+
+/* number of light groups */
+#define LIGHT_GROUPS_NUM					8
+
+/* join flag of a group request value, the group id is in the low bits */
+#define LIGHT_GROUP_JOIN_FLAG				0x80
+
+/* max number of lights known by the controller */
+#define LIGHTS_MAX							200
+
+/* queued requests above which the id requests of new lights wait, so a discovery
+   leaves room to the commands */
+#define LIGHT_ID_QUEUE_MAX					(REQUEST_QUEUE_SIZE / 2)
+
+/* invalid RLOC16 of a light whose locator is not known */
+#define LIGHT_RLOC16_INVALID				0xFFFE
+
+/* delivery success ratio of a light that always acknowledges */
+#define LIGHT_DELIVERY_MAX					255
+
+/* settings keys of the bindings and of the known lights, in the range left to the application */
+#define BINDINGS_SETTINGS_KEY				0x8001
+#define LIGHTS_SETTINGS_KEY					0x8002
+
+#ifdef DISCOVERY_ENABLED
+/* query of the discovery requests */
+#define DISCOVERY_QUERY						"rt=light.onoff"
+
+/* resource type looked for in the discovery responses */
+#define DISCOVERY_RESOURCE_TYPE			"rt=\"light.onoff\""
+
+/* duration of a multicast discovery in ms: the lights spread their answers over 3 s */
+#define DISCOVERY_ROUND_TIME				4000
+
+/* time in ms a light is kept after it was last heard */
+#define DISCOVERY_TTL						600000
+
+/* interval of the cache refresh in ms */
+#define DISCOVERY_TICK_INTERVAL			1000
+
+/* max number of refresh queries in flight */
+#define DISCOVERY_REFRESH_MAX				2
+
+/* max length of a discovery response payload */
+#define DISCOVERY_PAYLOAD_MAX				256
+
+/* local UDP port of the multicast discovery: its answers are read from a socket
+   of their own, as the CoAP layer closes a request on its first response */
+#define DISCOVERY_PORT						5690
+#endif
+
+/* bindings record layout version */
+#define BINDINGS_RECORD_VERSION			1
+
+/* time in ms the bindings must be stable before they are written to flash */
+#define BINDINGS_SAVE_DELAY				5000
+
+/* Batch request formats: (light id, level) pairs, or a level and a bitmask of the light ids */
+#define BATCH_FORMAT_LIST					0
+#define BATCH_FORMAT_MASK					1
+
+/* Max length of a counters response: stats report or diag snapshot */
+#define STATS_REPORT_MAX					512
+
+/* Max length of a batch request payload */
+#define BATCH_PAYLOAD_MAX					(1 + (2 * CMD_BATCH_MAX))
+
+/* fixed point unit of the dispatcher costs: one frame */
+#define DISPATCH_COST_UNIT					256
+
+/* route cost to a light of unknown location */
+#define DISPATCH_DEFAULT_HOPS				2
+
+/* routers assumed to flood a multicast when the router table is not known */
+#define DISPATCH_DEFAULT_ROUTERS			4
+
+/* MPL transmissions of a realm-local multicast by each router */
+#define DISPATCH_MPL_TRANSMISSIONS		2
+
+/* ramp time of the lights across the whole dimming range in ms */
+#define RAMP_FULL_SCALE_TIME				4000
+
+/* button events of the hold-to-dim ramps */
+#define BSP_EVENT_RAMP_DOWN					BSP_EVENT_KEY_4
+#define BSP_EVENT_RAMP_UP					BSP_EVENT_KEY_5
+
+/* FPSCR exception flags: a pending FPU interrupt would wake the CPU at once */
+#define FPU_EXCEPTION_MASK					0x0000009F
+
+#ifdef LIGHT_CLIENT_SED
+/* data poll period of the sleepy remote in ms */
+#ifndef SED_POLL_PERIOD
+#define SED_POLL_PERIOD						5000
+#endif
+
+/* data poll period after a button press in ms: responses reach the remote
+   within one period */
+#ifndef SED_FAST_POLL_PERIOD
+#define SED_FAST_POLL_PERIOD				40
+#endif
+
+/* fast poll time after the last press in ms, extended while requests are in flight */
+#define SED_FAST_POLL_TIME					1500
+#endif
+
+#ifdef LIGHT_CLIENT_SYSTEM_OFF
+/* child timeout asked to the parent in s: the child must still be known
+   after a long power off, so it is restored without a new attach */
+#define SYSTEM_OFF_CHILD_TIMEOUT			604800
+
+/* max time awake waiting for the attach in ms, then the remote powers off anyway */
+#define SYSTEM_OFF_ATTACH_TIMEOUT			15000
+
+/* max time awake after a power on waiting for the first attach in ms: a new
+   remote must have the time to join or be commissioned */
+#define SYSTEM_OFF_FIRST_ATTACH_TIMEOUT	300000
+#endif
+
+#if (REQUEST_WINDOW_DEFAULT > REQUEST_WINDOW_MAX)
+#error "REQUEST_WINDOW_DEFAULT must not exceed REQUEST_WINDOW_MAX"
 #endif
 
 
@@ -86,14 +308,314 @@ typedef enum
     LIGHT_TOGGLE
 } light_command_t;
 
+/* ramp commands */
+typedef enum
+{
+    RAMP_STOP = 0,
+    RAMP_UP,
+    RAMP_DOWN
+} ramp_command_t;
+
+/* events posted by the interrupt handlers to the main loop */
+typedef enum
+{
+	APP_EVENT_BUTTON = 0,			/**< Button event, param is the bsp_event_t. */
+	APP_EVENT_FAST_POLL_END,		/**< Fast poll time after a press ended. */
+	APP_EVENT_BINDINGS_SAVE,		/**< Bindings stable, to be saved. */
+	APP_EVENT_DISCOVERY_TICK		/**< Discovery cache refresh due. */
+} app_event_type_t;
+
+/* resources addressed by confirmable requests */
+typedef enum
+{
+	REQUEST_RESOURCE_LIGHT = 0,
+	REQUEST_RESOURCE_DIM,
+	REQUEST_RESOURCE_GROUP,
+	REQUEST_RESOURCE_RAMP,
+	REQUEST_RESOURCE_ID,
+	REQUEST_RESOURCES_NUM
+} request_resource_t;
+
+/* prebuilt request headers */
+typedef enum
+{
+	REQUEST_TEMPLATE_LIGHT = 0,
+	REQUEST_TEMPLATE_DIM,
+	REQUEST_TEMPLATE_LIGHT_MULTICAST,
+	REQUEST_TEMPLATE_DIM_MULTICAST,
+	REQUEST_TEMPLATE_GROUP,
+	REQUEST_TEMPLATE_RAMP,
+	REQUEST_TEMPLATE_RAMP_MULTICAST,
+	REQUEST_TEMPLATE_PROVISIONING,
+	REQUEST_TEMPLATE_ID,
+	REQUEST_TEMPLATE_BATCH_MULTICAST,
+	REQUEST_TEMPLATE_PING,
+	REQUEST_TEMPLATE_DISCOVERY,
+	REQUEST_TEMPLATE_DISCOVERY_MULTICAST,
+	REQUEST_TEMPLATE_TIME,
+	REQUEST_TEMPLATE_SCHEDULE,
+	REQUEST_TEMPLATES_NUM
+} request_template_id_t;
+
+/* parsed destination addresses */
+typedef enum
+{
+	REQUEST_DESTINATION_ALL_LIGHTS = 0,
+	REQUEST_DESTINATION_GROUP_0,
+	REQUEST_DESTINATIONS_NUM = REQUEST_DESTINATION_GROUP_0 + LIGHT_GROUPS_NUM
+} request_destination_id_t;
+
+/* outcome of a request reported to the host */
+typedef enum
+{
+	REQUEST_EVENT_PARSED,				/**< Command accepted. */
+	REQUEST_EVENT_SENT,					/**< Request handed to the stack, with its result. */
+	REQUEST_EVENT_ACK,					/**< Response received or time-out, with the RTT. */
+	REQUEST_EVENT_SUPERSEDED,			/**< Queued request replaced by a newer one. */
+	REQUEST_EVENT_DROPPED,				/**< Request dropped before being sent. */
+	REQUEST_EVENT_DISCARDED,			/**< Command not valid, its id is not known. */
+	REQUEST_EVENT_CREDIT,				/**< Not a request event: commands the host can send. */
+	REQUEST_EVENTS_NUM
+} request_event_t;
+
+/* request header template */
+typedef struct
+{
+	const char         * p_uri_path;                    	/**< URI path of the resource. */
+	otCoapType           type;                          	/**< CoAP message type. */
+	otCoapCode           code;                          	/**< CoAP method. */
+	uint8_t              token_length;                  	/**< Length of the token generated at each send. */
+	bool                 payload;                       	/**< Request carries a payload. */
+	const char         * p_uri_query;                   	/**< URI query, NULL if none. */
+	otCoapHeader         header;                        	/**< Header built once at init time. */
+} request_template_t;
+
+/* request to a peer resource */
+typedef struct
+{
+	request_resource_t   resource;                      	/**< Target resource. */
+	otIp6Address         peer_address;                  	/**< Target peer. */
+	uint8_t              value;                         	/**< Light command or dimming value. */
+	uint32_t             request_id;                    	/**< Id given by the host, REQUEST_ID_NONE if none. */
+} request_t;
+
+/* confirmable request in flight */
+typedef struct
+{
+	bool                 in_use;                        	/**< Slot is tracking an exchange waiting for its ACK. */
+	request_t            request;                       	/**< Request sent in the exchange. */
+	uint8_t              token[REQUEST_TOKEN_LENGTH];   	/**< Token of the in-flight request. */
+	uint32_t             sent_time;                     	/**< Send time in ms, for the RTT. */
+} request_slot_t;
+
+/* host command sent as several unicast requests: one outcome is reported when the last one ends */
+typedef struct
+{
+	uint32_t             request_id;                    	/**< Host id of the command. */
+	uint8_t              pending;                       	/**< Requests without outcome, 0 if the entry is free. */
+	request_event_t      event;                         	/**< Combined event: superseded, ack, or dropped if any was. */
+	otError              result;                        	/**< First failure, OT_ERROR_NONE if none. */
+	uint32_t             rtt;                           	/**< Longest RTT in ms. */
+} request_fanout_t;
+
+/* request scheduler */
+typedef struct
+{
+	request_slot_t       slots[REQUEST_WINDOW_MAX];     	/**< Requests in flight. */
+	request_t            queue[REQUEST_QUEUE_SIZE];     	/**< Requests waiting to be sent, oldest first. */
+	uint8_t              queue_count;                   	/**< Number of queued requests. */
+	uint8_t              window;                        	/**< Max number of requests in flight. */
+	uint8_t              outstanding;                   	/**< Number of requests in flight. */
+	uint32_t             superseded;                    	/**< Queued requests replaced by a newer one. */
+	uint32_t             dropped;                       	/**< Requests dropped (queue full or peer lost). */
+	uint32_t             deferred;                      	/**< Dispatches postponed for lack of message buffers. */
+	uint32_t             sent;                          	/**< Confirmable requests sent. */
+	uint32_t             acked;                         	/**< Confirmable requests acked by the peer. */
+	uint32_t             timeouts;                      	/**< Confirmable requests left unacked after all the retransmissions. */
+	uint32_t             refused;                       	/**< Confirmable requests answered with an error code (5.03 when over rate). */
+	uint32_t             request_id;                    	/**< Host id given to the requests being submitted. */
+	request_fanout_t     fanouts[REQUEST_FANOUTS_MAX];  	/**< Host commands sent as several unicast requests. */
+} request_scheduler_t;
+
+/* light known by the controller */
+typedef struct
+{
+	bool                 in_use;                        	/**< Entry is valid. */
+	otIp6Address         address;                       	/**< Mesh-local address of the light. */
+	uint16_t             rloc16;                        	/**< Last known locator, to look up the route cost. */
+	uint8_t              delivery;                      	/**< Recent delivery success ratio, 0-255. */
+	uint8_t              groups;                        	/**< Bitmask of the joined groups. */
+	bool                 id_pending;                    	/**< Id request not queued yet. */
+	bool                 id_assigned;                   	/**< Id acked by the light, the entry can be used in batch requests. */
+	bool                 refresh_pending;               	/**< Discovery refresh query in flight, the entry cannot be evicted. */
+	uint32_t             seen;                          	/**< Last time the light was heard in ms. */
+} light_t;
+
+/* single control binding and last level in the settings */
+typedef struct
+{
+	uint8_t              version;                       	/**< Record layout version. */
+	uint8_t              dim_value;                     	/**< Next dimming value of the buttons. */
+	otIp6Address         peer_address;                  	/**< Single control peer, unspecified if none. */
+} bindings_record_t;
+
+/* known light in the settings: the mesh-local prefix is the one of the network */
+typedef struct
+{
+	uint8_t              index;                         	/**< Table index, the light id in batch requests. */
+	uint8_t              groups;                        	/**< Bitmask of the joined groups. */
+	uint8_t              iid[8];                        	/**< Interface identifier of the mesh-local address. */
+} light_record_t;
+
+/* deferred writes of the bindings */
+typedef struct
+{
+	bindings_record_t    saved;                         	/**< Bindings record in flash. */
+	light_record_t       saved_lights[LIGHTS_MAX];      	/**< Known lights in flash. */
+	uint8_t              saved_lights_num;              	/**< Number of known lights in flash. */
+	bool                 pending;                       	/**< Changes not written yet. */
+	uint32_t             writes;                        	/**< Records written. */
+} bindings_store_t;
+
+#ifdef DISCOVERY_ENABLED
+/* lights discovery and cache refresh */
+typedef struct
+{
+	bool                 active;                        	/**< Multicast discovery running. */
+	otUdpSocket          socket;                        	/**< Socket of the multicast discovery and of its answers. */
+	uint8_t              token[REQUEST_TOKEN_LENGTH];   	/**< Token of the running multicast discovery. */
+	uint32_t             start;                         	/**< Start time of the multicast discovery in ms. */
+	uint8_t              next;                          	/**< Next light checked by the refresh. */
+	uint8_t              refreshing;                    	/**< Refresh queries in flight. */
+	uint16_t             found;                         	/**< New lights found by the last multicast discovery. */
+	uint32_t             refreshed;                     	/**< Refresh queries sent. */
+	uint32_t             evicted;                       	/**< Lights not heard for DISCOVERY_TTL, removed. */
+} discovery_t;
+#endif
+
+#ifdef PREWARM_ENABLED
+/* routes prewarm after the attach */
+typedef struct
+{
+	bool                 active;                        	/**< A ping is in flight. */
+	bool                 done;                          	/**< Prewarm run since the boot. */
+	uint8_t              next;                          	/**< Next light to ping. */
+	uint8_t              pings;                         	/**< Lights pinged. */
+	uint8_t              replies;                       	/**< Lights that answered. */
+} prewarm_t;
+#endif
+
+/* set of target lights */
+typedef struct
+{
+	bool                 all;                           	/**< All the lights, including the unknown ones. */
+	uint32_t             mask[(LIGHTS_MAX + 31) / 32];  	/**< Bitmask of the targeted known lights. */
+} light_set_t;
+
+/* dispatch modes */
+typedef enum
+{
+	DISPATCH_MULTICAST = 0,
+	DISPATCH_GROUP,
+	DISPATCH_UNICAST,
+	DISPATCH_MODES_NUM
+} dispatch_mode_t;
+
+/* dispatcher counters */
+typedef struct
+{
+	uint32_t             decisions[DISPATCH_MODES_NUM]; 	/**< Commands sent in each mode. */
+	uint32_t             unicasts;                      	/**< Unicast requests queued by the dispatcher. */
+} dispatcher_t;
+
+/* power counters */
+typedef struct
+{
+	uint32_t             start;                         	/**< Time the counters were reset in ms. */
+	uint32_t             sleep_time;                    	/**< Time spent sleeping in ms. */
+	uint32_t             sleeps;                        	/**< Sleeps, each one ended by an interrupt. */
+} power_stats_t;
+
+#ifdef LIGHT_CLIENT_SYSTEM_OFF
+/* wake from System OFF */
+typedef struct
+{
+	bool                 pending;                       	/**< Wake button press not sent yet. */
+	bool                 from_off;                      	/**< Reset by a wake from System OFF, not a power on. */
+	bool                 attached;                      	/**< Child role reached since the reset. */
+	bsp_event_t          event;                         	/**< Button event of the wake press. */
+	uint32_t             attach_time;                   	/**< Time from the reset to the child role in ms. */
+	uint32_t             send_time;                     	/**< Time from the reset to the send in ms. */
+} wake_t;
+#endif
+
+#ifdef UART_CHANNEL_ENABLED
+/* UART receive chunks. Chunks are used in circular order: the driver fills
+   them, the main loop consumes them. Counters are free-running. */
+typedef struct
+{
+	uint8_t              data[UART_RX_CHUNKS_NUM][UART_RX_CHUNK_SIZE];	/**< Chunks. */
+	uint8_t              length[UART_RX_CHUNKS_NUM];  	/**< Received bytes of each chunk. */
+	volatile uint8_t     next_arm;                      	/**< Next chunk to hand to the driver. */
+	volatile uint8_t     armed;                         	/**< Chunks owned by the driver. */
+	volatile uint8_t     filled;                        	/**< Chunks completed by the driver. */
+	volatile uint8_t     consumed;                      	/**< Chunks processed by the main loop. */
+	volatile bool        activity;                      	/**< Bytes received since the last idle check. */
+	volatile bool        flushing;                      	/**< Partial chunk flush in progress. */
+	uint32_t             errors;                        	/**< Line errors. */
+} uart_rx_t;
+
+/* UART channel formats */
+typedef enum
+{
+	UART_MODE_JSON,				/**< JSON documents ended by '.'. */
+	UART_MODE_BINARY				/**< COBS frames with CRC, see cmd_frame.h. */
+} uart_mode_t;
+
+/* UART transmit buffer. Counters are free-running. */
+typedef struct
+{
+	uint8_t              data[UART_TX_BUFFER_SIZE];    	/**< Bytes to send. */
+	volatile uint16_t    head;                          	/**< Next byte to write. */
+	volatile uint16_t    tail;                          	/**< Next byte to send. */
+	volatile uint16_t    sending;                       	/**< Bytes owned by the driver. */
+	uint32_t             dropped;                       	/**< Events dropped for lack of room. */
+} uart_tx_t;
+
+/* UART flow control towards the host */
+typedef struct
+{
+	bool                 throttled;                     	/**< Received commands are left unparsed. */
+	uint16_t             credit;                        	/**< Last credit reported. */
+	uint32_t             credit_time;                   	/**< Time of the last credit report in ms. */
+	uint32_t             pauses;                        	/**< Times the parsing has been paused. */
+} uart_flow_t;
+#endif
+
 /* application info */
 typedef struct
 {
 	otInstance   * p_ot_instance;       	/**< A pointer to the OpenThread instance. */
 	otIp6Address   peer_address;        	/**< An address of a related server node. */
 	uint8_t        multicast_dim_value;		/**< Information which multicast dimming value should be sent next. */
+	uint8_t        ramp_direction;			/**< Running ramp started by a long press. */
+	uint32_t       ramp_start;				/**< Ramp start time in ms. */
 } application_t;
 
+/* read of a counters resource into a payload, returns its length */
+typedef uint16_t (*counters_read_t)(otCoapHeader *, uint8_t *, uint16_t);
+
+/* reset of the counters of a counters resource */
+typedef void (*counters_reset_t)(void);
+
+
+
+
+/* ---------------- local macros -----------------  */
+
+/* light set membership test */
+#define LIGHT_SET_HAS(p_set, index)		(0 != ((p_set)->mask[(index) / 32] & (1UL << ((index) % 32))))
+
 
 
 
@@ -105,6 +627,8 @@ static application_t m_app =
 	.p_ot_instance      = NULL,
 	.peer_address       = { .mFields.m8 = { 0 } },
 	.multicast_dim_value	= 0,
+	.ramp_direction     = RAMP_STOP,
+	.ramp_start         = 0,
 };
 
 /* IPv6 address */
@@ -113,18 +637,166 @@ static const otIp6Address m_unspecified_ipv6 = { .mFields.m8 = { 0 } };
 /* Provisioning enable request flag */
 static bool provisioning_enable_req = false;
 
+/* events of the timer and GPIOTE interrupts (same priority, one producer) */
+static event_queue_t m_events;
+
+/* confirmable requests scheduler */
+static request_scheduler_t m_scheduler =
+{
+	.queue_count = 0,
+	.window      = REQUEST_WINDOW_DEFAULT,
+	.outstanding = 0,
+	.request_id  = REQUEST_ID_NONE,
+};
+
+/* request header templates */
+static request_template_t m_request_templates[REQUEST_TEMPLATES_NUM] =
+{
+	[REQUEST_TEMPLATE_LIGHT]           = { "light", OT_COAP_TYPE_CONFIRMABLE, OT_COAP_CODE_PUT, REQUEST_TOKEN_LENGTH, true },
+	[REQUEST_TEMPLATE_DIM]             = { "dim", OT_COAP_TYPE_CONFIRMABLE, OT_COAP_CODE_PUT, REQUEST_TOKEN_LENGTH, true },
+	[REQUEST_TEMPLATE_LIGHT_MULTICAST] = { "light", OT_COAP_TYPE_CONFIRMABLE, OT_COAP_CODE_PUT, 0, true },
+	[REQUEST_TEMPLATE_DIM_MULTICAST]   = { "dim", OT_COAP_TYPE_CONFIRMABLE, OT_COAP_CODE_PUT, 0, true },
+	[REQUEST_TEMPLATE_GROUP]           = { "group", OT_COAP_TYPE_CONFIRMABLE, OT_COAP_CODE_PUT, REQUEST_TOKEN_LENGTH, true },
+	[REQUEST_TEMPLATE_RAMP]            = { "ramp", OT_COAP_TYPE_CONFIRMABLE, OT_COAP_CODE_PUT, REQUEST_TOKEN_LENGTH, true },
+	[REQUEST_TEMPLATE_RAMP_MULTICAST]  = { "ramp", OT_COAP_TYPE_CONFIRMABLE, OT_COAP_CODE_PUT, 0, true },
+	[REQUEST_TEMPLATE_PROVISIONING]    = { "provisioning", OT_COAP_TYPE_NON_CONFIRMABLE, OT_COAP_CODE_GET, REQUEST_TOKEN_LENGTH, false },
+	[REQUEST_TEMPLATE_ID]              = { "id", OT_COAP_TYPE_CONFIRMABLE, OT_COAP_CODE_PUT, REQUEST_TOKEN_LENGTH, true },
+	[REQUEST_TEMPLATE_BATCH_MULTICAST] = { "batch", OT_COAP_TYPE_NON_CONFIRMABLE, OT_COAP_CODE_PUT, 0, true },
+	[REQUEST_TEMPLATE_PING]            = { NULL, OT_COAP_TYPE_CONFIRMABLE, OT_COAP_CODE_EMPTY, 0, false },
+#ifdef DISCOVERY_ENABLED
+	[REQUEST_TEMPLATE_DISCOVERY]       = { ".well-known/core", OT_COAP_TYPE_CONFIRMABLE, OT_COAP_CODE_GET, REQUEST_TOKEN_LENGTH, false, DISCOVERY_QUERY },
+	[REQUEST_TEMPLATE_DISCOVERY_MULTICAST] = { ".well-known/core", OT_COAP_TYPE_NON_CONFIRMABLE, OT_COAP_CODE_GET, REQUEST_TOKEN_LENGTH, false, DISCOVERY_QUERY },
+#endif
+	[REQUEST_TEMPLATE_TIME]            = { "time", OT_COAP_TYPE_NON_CONFIRMABLE, OT_COAP_CODE_PUT, 0, true },
+	[REQUEST_TEMPLATE_SCHEDULE]        = { "schedule", OT_COAP_TYPE_NON_CONFIRMABLE, OT_COAP_CODE_PUT, 0, true },
+};
+
+/* templates of the requests to a single peer and to all the lights */
+static const request_template_id_t m_unicast_templates[REQUEST_RESOURCES_NUM] =
+{
+	[REQUEST_RESOURCE_LIGHT] = REQUEST_TEMPLATE_LIGHT,
+	[REQUEST_RESOURCE_DIM]   = REQUEST_TEMPLATE_DIM,
+	[REQUEST_RESOURCE_GROUP] = REQUEST_TEMPLATE_GROUP,
+	[REQUEST_RESOURCE_RAMP]  = REQUEST_TEMPLATE_RAMP,
+	[REQUEST_RESOURCE_ID]    = REQUEST_TEMPLATE_ID,
+};
+static const request_template_id_t m_multicast_templates[REQUEST_RESOURCES_NUM] =
+{
+	[REQUEST_RESOURCE_LIGHT] = REQUEST_TEMPLATE_LIGHT_MULTICAST,
+	[REQUEST_RESOURCE_DIM]   = REQUEST_TEMPLATE_DIM_MULTICAST,
+	[REQUEST_RESOURCE_GROUP] = REQUEST_TEMPLATES_NUM,
+	[REQUEST_RESOURCE_RAMP]  = REQUEST_TEMPLATE_RAMP_MULTICAST,
+	[REQUEST_RESOURCE_ID]    = REQUEST_TEMPLATES_NUM,
+};
+
+/* destination addresses, parsed once at init time */
+static otIp6Address m_request_destinations[REQUEST_DESTINATIONS_NUM];
+
+/* execution times of the send functions */
+PERF_COUNTER_DEF(m_perf_request, "request");
+PERF_COUNTER_DEF(m_perf_multicast, "multicast");
+#ifdef UART_CHANNEL_ENABLED
+PERF_COUNTER_DEF(m_perf_batch, "batch");
+#endif
+#if PERF_ENABLED
+static perf_counter_t * const m_perf_counters[] =
+{
+	&m_perf_request,
+	&m_perf_multicast,
+#ifdef UART_CHANNEL_ENABLED
+	&m_perf_batch,
+#endif
+};
+#endif
+
+/* lights known by the controller */
+static light_t m_lights[LIGHTS_MAX];
+
+/* unicast/multicast dispatcher */
+static dispatcher_t m_dispatcher;
+
+/* power counters */
+static power_stats_t m_power;
+
+/* bindings store */
+static bindings_store_t m_bindings;
+
+/* bindings save timer */
+APP_TIMER_DEF(m_bindings_timer);
+
+#ifdef PREWARM_ENABLED
+/* routes prewarm */
+static prewarm_t m_prewarm;
+#endif
+
+#ifdef CHANNEL_SCAN_ENABLED
+/* channel selection at network formation */
+static channel_scan_t m_channel_scan;
+#endif
+
+#ifdef DISCOVERY_ENABLED
+/* lights discovery */
+static discovery_t m_discovery;
+
+/* discovery cache refresh timer */
+APP_TIMER_DEF(m_discovery_timer);
+#endif
+
+/* message info shared by all the requests */
+static otMessageInfo m_request_message_info;
+
+#ifdef LIGHT_CLIENT_SED
+/* end of the fast poll after a press */
+APP_TIMER_DEF(m_poll_timer);
+
+/* polling fast after a press */
+static bool m_fast_poll = false;
+#endif
+
+#ifdef LIGHT_CLIENT_SYSTEM_OFF
+/* wake press */
+static wake_t m_wake;
+
+/* button pins, wake sources in System OFF */
+static const uint8_t m_button_pins[BUTTONS_NUMBER] = BUTTONS_LIST;
+#endif
+
 #ifdef UART_CHANNEL_ENABLED
-/* flag to set data are received */
-static bool data_received = false;
+/* UART 1 driver instance */
+static const nrf_drv_uart_t m_uart = NRF_DRV_UART_INSTANCE(1);
+
+/* UART receive chunks */
+static uart_rx_t m_uart_rx;
+
+/* UART line idle check timer, running while bytes come in */
+APP_TIMER_DEF(m_uart_idle_timer);
 
-/* UART data buffer */
-static uint8_t data_buffer[100];
+/* UART channel format */
+static uart_mode_t m_uart_mode = UART_MODE_DEFAULT;
 
-/* UART buffer depth */
-static uint8_t buffer_depth;
+/* UART commands parser */
+static cmd_parser_t m_cmd_parser;
 
-/* UART buffer index */
-static uint8_t buf_idx = 0;
+/* UART commands frame decoder */
+static cmd_frame_t m_cmd_frame;
+
+/* UART events transmit buffer */
+static uart_tx_t m_uart_tx;
+
+/* UART flow control */
+static uart_flow_t m_uart_flow;
+
+/* event names of the JSON format */
+static const char * const m_request_event_names[REQUEST_EVENTS_NUM] =
+{
+	[REQUEST_EVENT_PARSED]     = "parsed",
+	[REQUEST_EVENT_SENT]       = "sent",
+	[REQUEST_EVENT_ACK]        = "ack",
+	[REQUEST_EVENT_SUPERSEDED] = "superseded",
+	[REQUEST_EVENT_DROPPED]    = "dropped",
+	[REQUEST_EVENT_DISCARDED]  = "discarded",
+	[REQUEST_EVENT_CREDIT]     = "credit"
+};
 #endif
 
 
@@ -132,188 +804,559 @@ static uint8_t buf_idx = 0;
 
 /* ----------------------- local functions prototypes --------------------- */
 
-static void light_response_handler			(void *, otCoapHeader *, otMessage *, const otMessageInfo *, otError);
-static void dim_response_handler				(void *, otCoapHeader *, otMessage *, const otMessageInfo *, otError);
-static void unicast_light_request_send		(otInstance *, uint8_t);
-static void unicast_dim_request_send		(otInstance *, uint8_t);
-static void multicast_light_request_send	(otInstance *, uint8_t);
-static void multicast_dim_request_send		(otInstance *, uint8_t);
+static bool request_target_busy				(const otIp6Address *);
+static void request_queue_remove				(uint8_t);
+static void request_queue_flush				(const otIp6Address *);
+static bool request_submit						(request_resource_t, const otIp6Address *, uint8_t, uint32_t);
+static void request_schedule					(void);
+static bool request_slot_complete			(request_slot_t *, const otCoapHeader *, otError);
+static void request_response_handler		(void *, otCoapHeader *, otMessage *, const otMessageInfo *, otError);
+static void request_templates_init			(void);
+static void request_report						(uint32_t, request_event_t, otError, uint32_t);
+#ifdef UART_CHANNEL_ENABLED
+static void request_fanout_start				(uint32_t, uint8_t);
+static bool request_fanout_fold				(uint32_t, request_event_t *, otError *, uint32_t *);
+#endif
+static otMessage * request_message_new		(otInstance *, request_template_id_t, const void *, uint16_t, uint8_t *);
+static otError request_send					(otInstance *, request_template_id_t, const otIp6Address *, const void *, uint16_t, otCoapResponseHandler, void *, uint8_t *);
+static void command_send						(request_resource_t, uint8_t);
+static void multicast_request_send			(request_resource_t, uint8_t, request_destination_id_t);
+#ifdef UART_CHANNEL_ENABLED
+static void batch_request_send				(const uint8_t (*)[2], uint8_t, request_destination_id_t);
+#endif
+static int16_t light_find						(const otIp6Address *);
+static int16_t light_add						(const otIp6Address *, uint16_t);
+static void light_delivery_update			(const otIp6Address *, bool);
+static void light_ids_assign					(void);
+static void light_id_result					(const request_t *, otError);
+static void light_group_result				(const request_t *, otError);
+#ifdef CLI_ENABLED
+static void light_group_set					(uint8_t, uint8_t, bool);
+static bool cli_time_parse						(const char *, uint32_t *);
+static void schedule_entry_send				(uint8_t, uint16_t, uint8_t, uint8_t);
+#endif
+static void bindings_record_get				(bindings_record_t *, light_record_t *, uint8_t *);
+static void bindings_changed					(void);
+static void bindings_save						(void);
+static void bindings_restore					(void);
+static void bindings_timer_handler			(void *);
+#ifdef DISCOVERY_ENABLED
+static void discovery_init						(void);
+static void discovery_start					(void);
+static void discovery_links_process			(otMessage *, uint16_t, const otIp6Address *);
+static void discovery_answer_receive			(void *, otMessage *, const otMessageInfo *);
+static void discovery_response_handler		(void *, otCoapHeader *, otMessage *, const otMessageInfo *, otError);
+static void discovery_tick						(void);
+static void discovery_timer_handler			(void *);
+#endif
+#ifdef PREWARM_ENABLED
+static void prewarm_next						(void);
+static void prewarm_response_handler		(void *, otCoapHeader *, otMessage *, const otMessageInfo *, otError);
+#endif
+static uint8_t dispatch_hops					(const light_t *);
+static uint32_t dispatch_multicast_cost		(void);
+static void dispatch_command					(request_resource_t, uint8_t, const light_set_t *);
+#ifdef CLI_ENABLED
+static void cli_light_command					(int, char **);
+#endif
 static void provisioning_response_handler	(void *, otCoapHeader *, otMessage *, const otMessageInfo *, otError);
 static void provisioning_request_send		(otInstance *);
 static void coap_default_handler				(void *, otCoapHeader *, otMessage *, const otMessageInfo *);
+static void counters_request_handle			(void *, otCoapHeader *, const otMessageInfo *, counters_read_t, counters_reset_t);
+static uint16_t diag_read						(otCoapHeader *, uint8_t *, uint16_t);
+static void diag_reset							(void);
+static void diag_request_handler				(void *, otCoapHeader *, otMessage *, const otMessageInfo *);
+#if PERF_ENABLED
+static uint16_t stats_read						(otCoapHeader *, uint8_t *, uint16_t);
+static void stats_reset							(void);
+static void stats_request_handler				(void *, otCoapHeader *, otMessage *, const otMessageInfo *);
+#endif
 static void role_change_handler				(void *, otDeviceRole);
 static void state_changed_callback			(uint32_t, void *);
+static void ramp_start							(uint8_t);
+static void ramp_stop							(void);
+static void button_event_process				(bsp_event_t);
 static void bsp_event_handler					(bsp_event_t);
+static void events_process						(void);
+static void idle_sleep							(void);
+#ifdef CLI_ENABLED
+static void cli_power_command					(int, char **);
+#if PERF_ENABLED
+static void cli_stats_command					(int, char **);
+#endif
+#endif
+#ifdef LIGHT_CLIENT_SED
+static void sed_fast_poll_start				(void);
+static void sed_poll_timer_handler			(void *);
+#endif
+#ifdef LIGHT_CLIENT_SYSTEM_OFF
+static void system_off_enter					(void);
+static void system_off_wake					(void);
+static void system_off_wake_send				(void);
+#endif
 static void thread_init							(void);
+#ifdef CHANNEL_SCAN_ENABLED
+static void channel_scan_done					(channel_scan_t *);
+#endif
 static void coap_init							(void);
 static void timer_init							(void);
 static void leds_init							(void);
 static void thread_bsp_init					(void);
 #ifdef UART_CHANNEL_ENABLED
+static void uart_rx_arm							(void);
+static uint16_t uart_flow_credit				(void);
+static void uart_flow_update					(void);
 static void manageUART							(void);
-static void uart_error_handle					(app_uart_evt_t *);
+static void uart_command_send					(const cmd_t *, request_resource_t, uint8_t);
+static void uart_command_handler				(const cmd_t *, void *);
+static void uart_event_handler				(nrf_drv_uart_event_t *, void *);
+static void uart_idle_timer_handler			(void *);
+static void uart_rx_line_handler				(nrf_drv_gpiote_pin_t, nrf_gpiote_polarity_t);
+static void uart_init							(void);
+static void uart_tx_start						(void);
+static void uart_tx_write						(const uint8_t *, uint16_t);
+static void uart_event_send					(uint32_t, request_event_t, otError, uint32_t);
+static void cli_uart_command					(int, char **);
 #endif
 
 
 
 
-/* ------------------- local functions implementation ------------------ */
-
-/* CoAP light response handler */
-static void light_response_handler(void                * p_context,
-                                   otCoapHeader        * p_header,
-                                   otMessage           * p_message,
-                                   const otMessageInfo * p_message_info,
-                                   otError               result)
-{
-    (void)p_context;
-    (void)p_header;
-    (void)p_message;
+/* ---------------- local variables part 2 -----------------  */
 
-    if (result == OT_ERROR_NONE)
-    {
-        NRF_LOG_INFO("Received light control response.\r\n");
-    }
-    else
-    {
-        NRF_LOG_INFO("Failed to receive response: %d\r\n", result);
-        m_app.peer_address = m_unspecified_ipv6;
-    }
-}
+/* network diagnostics resource */
+static otCoapResource m_diag_resource = {"diag", diag_request_handler, NULL, NULL};
 
+/* network diagnostics */
+static net_diag_t m_diag;
 
-/* Dimming response handler function */
-static void dim_response_handler(void                * p_context,
-                          			otCoapHeader        * p_header,
-                          			otMessage           * p_message,
-                          			const otMessageInfo * p_message_info,
-                          			otError           	 result)
+/* application counters of the diagnostics, in payload order */
+static const uint32_t * const m_diag_counters[] =
 {
-    (void)p_context;
-    (void)p_header;
-    (void)p_message;
-
-    if (result == OT_ERROR_NONE)
-    {
-        NRF_LOG_INFO("Received dimming control response.\r\n");
-    }
-    else
-    {
-        NRF_LOG_INFO("Failed to receive response: %d\r\n", result);
-        m_app.peer_address = m_unspecified_ipv6;
-    }
-}
+	&m_scheduler.sent,
+	&m_scheduler.acked,
+	&m_scheduler.timeouts,
+	&m_scheduler.refused,
+	&m_scheduler.superseded,
+	&m_scheduler.dropped,
+	&m_scheduler.deferred,
+	&m_dispatcher.decisions[DISPATCH_MULTICAST],
+	&m_dispatcher.decisions[DISPATCH_GROUP],
+	&m_dispatcher.decisions[DISPATCH_UNICAST],
+	&m_dispatcher.unicasts,
+#ifdef DISCOVERY_ENABLED
+	&m_discovery.refreshed,
+	&m_discovery.evicted,
+#endif
+};
 
+#if PERF_ENABLED
+/* execution time counters resource */
+static otCoapResource m_stats_resource = {"stats", stats_request_handler, NULL, NULL};
+#endif
 
-/* CoAP unicast light request */
-static void unicast_light_request_send(otInstance * p_instance, uint8_t command)
+#ifdef CLI_ENABLED
+/* CLI commands of the application */
+static const otCliCommand m_cli_commands[] =
 {
-    otError       error = OT_ERROR_NONE;
-    otMessage   * p_message;
-    otMessageInfo messageInfo;
-    otCoapHeader  header;
+	{ "light", cli_light_command },
+	{ "power", cli_power_command },
+#if PERF_ENABLED
+	{ "stats", cli_stats_command },
+#endif
+#ifdef UART_CHANNEL_ENABLED
+	{ "uart", cli_uart_command },
+#endif
+};
+#endif
 
-    do
-    {
-        otCoapHeaderInit(&header, OT_COAP_TYPE_CONFIRMABLE, OT_COAP_CODE_PUT);
-        otCoapHeaderGenerateToken(&header, 2);
-        otCoapHeaderAppendUriPathOptions(&header, "light");
-        otCoapHeaderSetPayloadMarker(&header);
 
-        p_message = otCoapNewMessage(p_instance, &header);
-        if (p_message == NULL)
-        {
-            NRF_LOG_INFO("Failed to allocate message for CoAP Request\r\n");
-            break;
-        }
 
-        error = otMessageAppend(p_message, &command, sizeof(command));
-        if (error != OT_ERROR_NONE)
-        {
-            break;
-        }
 
-        memset(&messageInfo, 0, sizeof(messageInfo));
-        messageInfo.mInterfaceId = OT_NETIF_INTERFACE_ID_THREAD;
-        messageInfo.mPeerPort = OT_DEFAULT_COAP_PORT;
-        memcpy(&messageInfo.mPeerAddr, &m_app.peer_address, sizeof(messageInfo.mPeerAddr));
+/* ------------------- local functions implementation ------------------ */
 
-        error = otCoapSendRequest(p_instance,
-                                  p_message,
-                                  &messageInfo,
-                                  &light_response_handler,
-                                  p_instance);
-    } while (false);
+/* Check if a peer has a request in flight */
+static bool request_target_busy(const otIp6Address * p_peer)
+{
+	uint8_t i;
 
-    if (error != OT_ERROR_NONE && p_message != NULL)
-    {
-        NRF_LOG_INFO("Failed to send CoAP Request: %d\r\n", error);
-        otMessageFree(p_message);
-    }
+	for (i = 0; i < REQUEST_WINDOW_MAX; i++)
+	{
+		if ((true == m_scheduler.slots[i].in_use) &&
+			otIp6IsAddressEqual(&m_scheduler.slots[i].request.peer_address, p_peer))
+		{
+			return true;
+		}
+	}
+
+	return false;
 }
 
 
-/* Function to send a dimming request to a peer device (unicast) */
-static void unicast_dim_request_send(otInstance * p_instance, uint8_t dim_value)
+/* Remove a request from the queue keeping the order of the others */
+static void request_queue_remove(uint8_t index)
 {
-    otError       error = OT_ERROR_NONE;
-    otMessage   * p_message;
-    otMessageInfo messageInfo;
-    otCoapHeader  header;
+	m_scheduler.queue_count--;
+	memmove(&m_scheduler.queue[index],
+			&m_scheduler.queue[index + 1],
+			(m_scheduler.queue_count - index) * sizeof(request_t));
+}
 
-    do
+
+/* Drop all the queued requests to a peer */
+static void request_queue_flush(const otIp6Address * p_peer)
+{
+	uint8_t i = 0;
+
+	while (i < m_scheduler.queue_count)
+	{
+		if (otIp6IsAddressEqual(&m_scheduler.queue[i].peer_address, p_peer))
+		{
+			request_report(m_scheduler.queue[i].request_id, REQUEST_EVENT_DROPPED, OT_ERROR_ABORT, 0);
+			request_queue_remove(i);
+			m_scheduler.dropped++;
+		}
+		else
+		{
+			i++;
+		}
+	}
+}
+
+
+/* Queue a request on behalf of a host request id (REQUEST_ID_NONE for the requests
+   of the client itself). A queued request to the same peer resource is superseded
+   by the new one, so only the latest intent reaches the radio. */
+static bool request_submit(request_resource_t resource, const otIp6Address * p_peer, uint8_t value, uint32_t request_id)
+{
+	request_t * p_queued;
+	uint8_t i;
+
+	for (i = 0; i < m_scheduler.queue_count; i++)
+	{
+		p_queued = &m_scheduler.queue[i];
+
+		if ((p_queued->resource == resource) &&
+			otIp6IsAddressEqual(&p_queued->peer_address, p_peer))
+		{
+			m_scheduler.superseded++;
+			if (p_queued->request_id != request_id)
+			{
+				request_report(p_queued->request_id, REQUEST_EVENT_SUPERSEDED, OT_ERROR_NONE, 0);
+				p_queued->request_id = request_id;
+			}
+
+			/* a light toggle merges with the queued command instead of replacing it */
+			if ((REQUEST_RESOURCE_LIGHT == resource) && (LIGHT_TOGGLE == value))
+			{
+				switch (p_queued->value)
+				{
+					case LIGHT_TOGGLE:
+						/* the two toggles cancel out */
+						request_report(p_queued->request_id, REQUEST_EVENT_SUPERSEDED, OT_ERROR_NONE, 0);
+						request_queue_remove(i);
+						break;
+					case LIGHT_ON:
+						p_queued->value = LIGHT_OFF;
+						break;
+					default:
+						p_queued->value = LIGHT_ON;
+						break;
+				}
+			}
+			else
+			{
+				p_queued->value = value;
+			}
+
+			return true;
+		}
+	}
+
+	if (m_scheduler.queue_count >= REQUEST_QUEUE_SIZE)
+	{
+		m_scheduler.dropped++;
+		request_report(request_id, REQUEST_EVENT_DROPPED, OT_ERROR_NO_BUFS, 0);
+		NRF_LOG_INFO("Request queue full\r\n");
+		return false;
+	}
+
+	p_queued = &m_scheduler.queue[m_scheduler.queue_count++];
+	p_queued->resource = resource;
+	p_queued->peer_address = *p_peer;
+	p_queued->value = value;
+	p_queued->request_id = request_id;
+
+	return true;
+}
+
+
+/* Send queued requests while the window is open. Requests are taken oldest
+   first, skipping peers that already have an exchange in flight, so one busy
+   light does not hold back the others. */
+static void request_schedule(void)
+{
+	otBufferInfo     buffer_info;
+	request_slot_t * p_slot;
+	otError          error;
+	uint8_t          i;
+	uint8_t          slot;
+
+	i = 0;
+	while ((m_scheduler.outstanding < m_scheduler.window) && (i < m_scheduler.queue_count))
+	{
+		if (request_target_busy(&m_scheduler.queue[i].peer_address))
+		{
+			i++;
+			continue;
+		}
+
+		/* leave room to the stack for retransmissions and ACKs */
+		otMessageGetBufferInfo(m_app.p_ot_instance, &buffer_info);
+		if (buffer_info.mFreeBuffers < REQUEST_MIN_FREE_BUFFERS)
+		{
+			m_scheduler.deferred++;
+			break;
+		}
+
+		for (slot = 0; slot < REQUEST_WINDOW_MAX; slot++)
+		{
+			if (false == m_scheduler.slots[slot].in_use)
+			{
+				break;
+			}
+		}
+		p_slot = &m_scheduler.slots[slot];
+		p_slot->request = m_scheduler.queue[i];
+
+		error = request_send(m_app.p_ot_instance,
+									m_unicast_templates[p_slot->request.resource],
+									&p_slot->request.peer_address,
+									&p_slot->request.value,
+									sizeof(p_slot->request.value),
+									request_response_handler,
+									p_slot,
+									p_slot->token);
+
+		if (error == OT_ERROR_NO_BUFS)
+		{
+			/* keep the request queued and retry later */
+			m_scheduler.deferred++;
+			break;
+		}
+
+		request_queue_remove(i);
+		request_report(p_slot->request.request_id, REQUEST_EVENT_SENT, error, 0);
+
+		if (error == OT_ERROR_NONE)
+		{
+			p_slot->in_use = true;
+			p_slot->sent_time = otPlatAlarmGetNow();
+			m_scheduler.outstanding++;
+			m_scheduler.sent++;
+		}
+		else
+		{
+			m_scheduler.dropped++;
+		}
+	}
+}
+
+
+/* Close the exchange tracked by a slot. Returns false if the response does not
+   belong to the tracked exchange. */
+static bool request_slot_complete(request_slot_t     * p_slot,
+                                  const otCoapHeader * p_header,
+                                  otError              result)
+{
+	if (false == p_slot->in_use)
+	{
+		return false;
+	}
+
+	/* on time-out there is no header to match */
+	if ((p_header != NULL) &&
+		((otCoapHeaderGetTokenLength(p_header) != REQUEST_TOKEN_LENGTH) ||
+		 (0 != memcmp(otCoapHeaderGetToken(p_header), p_slot->token, REQUEST_TOKEN_LENGTH))))
+	{
+		return false;
+	}
+
+	p_slot->in_use = false;
+	m_scheduler.outstanding--;
+
+	if (result == OT_ERROR_NONE)
+	{
+		m_scheduler.acked++;
+	}
+	else if (result == OT_ERROR_RESPONSE_TIMEOUT)
+	{
+		m_scheduler.timeouts++;
+	}
+	else if (p_header != NULL)
+	{
+		m_scheduler.refused++;
+	}
+
+	/* no response, the peer is not reachable: do not spend the window on it */
+	if ((result != OT_ERROR_NONE) && (p_header == NULL))
+	{
+		request_queue_flush(&p_slot->request.peer_address);
+	}
+
+	return true;
+}
+
+
+/* Request response handler of the confirmable requests in flight */
+static void request_response_handler(void                * p_context,
+                                     otCoapHeader        * p_header,
+                                     otMessage           * p_message,
+                                     const otMessageInfo * p_message_info,
+                                     otError               result)
+{
+    (void)p_message;
+    (void)p_message_info;
+    bool refused = false;
+
+    /* an error code means the light got the command but did not apply it,
+       5.03 when it is over its rate */
+    if ((result == OT_ERROR_NONE) && ((otCoapHeaderGetCode(p_header) >> 5) != 2))
     {
-        otCoapHeaderInit(&header, OT_COAP_TYPE_CONFIRMABLE, OT_COAP_CODE_PUT);
-        otCoapHeaderGenerateToken(&header, 2);
-        otCoapHeaderAppendUriPathOptions(&header, "dim");
-        otCoapHeaderSetPayloadMarker(&header);
+        result  = (otCoapHeaderGetCode(p_header) == OT_COAP_CODE_SERVICE_UNAVAILABLE) ? OT_ERROR_BUSY : OT_ERROR_FAILED;
+        refused = true;
+    }
 
-        p_message = otCoapNewMessage(p_instance, &header);
-        if (p_message == NULL)
-        {
-            NRF_LOG_INFO("Failed to allocate message for CoAP Request\r\n");
-            break;
-        }
+    if (false == request_slot_complete(p_context, p_header, result))
+    {
+        NRF_LOG_INFO("Dropped stale response.\r\n");
+        return;
+    }
 
-        error = otMessageAppend(p_message, &dim_value, sizeof(dim_value));
-        if (error != OT_ERROR_NONE)
-        {
-            break;
-        }
+    /* a refusal says nothing about the link */
+    if (false == refused)
+    {
+        light_delivery_update(&((request_slot_t *)p_context)->request.peer_address, (result == OT_ERROR_NONE));
+    }
 
-        memset(&messageInfo, 0, sizeof(messageInfo));
-        messageInfo.mInterfaceId = OT_NETIF_INTERFACE_ID_THREAD;
-        messageInfo.mPeerPort = OT_DEFAULT_COAP_PORT;
-        memcpy(&messageInfo.mPeerAddr, &m_app.peer_address, sizeof(messageInfo.mPeerAddr));
+    if (((request_slot_t *)p_context)->request.resource == REQUEST_RESOURCE_ID)
+    {
+        light_id_result(&((request_slot_t *)p_context)->request, result);
+    }
+    else if (((request_slot_t *)p_context)->request.resource == REQUEST_RESOURCE_GROUP)
+    {
+        light_group_result(&((request_slot_t *)p_context)->request, result);
+    }
 
-        error = otCoapSendRequest(p_instance,
-                                  p_message,
-                                  &messageInfo,
-                                  &dim_response_handler,
-                                  p_instance);
-    } while (false);
+    request_report(((request_slot_t *)p_context)->request.request_id,
+                   REQUEST_EVENT_ACK,
+                   result,
+                   otPlatAlarmGetNow() - ((request_slot_t *)p_context)->sent_time);
 
-    if (error != OT_ERROR_NONE && p_message != NULL)
+    if (result == OT_ERROR_NONE)
     {
-        NRF_LOG_INFO("Failed to send CoAP Request: %d\r\n", error);
-        otMessageFree(p_message);
+        NRF_LOG_INFO("Received %s response.\r\n",
+                     (uint32_t)m_request_templates[m_unicast_templates[((request_slot_t *)p_context)->request.resource]].p_uri_path);
+    }
+    else
+    {
+        NRF_LOG_INFO("Failed to receive response: %d\r\n", result);
+        if ((false == refused) &&
+            otIp6IsAddressEqual(&m_app.peer_address, &((request_slot_t *)p_context)->request.peer_address))
+        {
+            m_app.peer_address = m_unspecified_ipv6;
+            bindings_changed();
+        }
     }
+
+    request_schedule();
+}
+
+
+/* Build the request headers and parse the destination addresses once */
+static void request_templates_init(void)
+{
+	request_template_t * p_template;
+	otCoapOption         option;
+	uint8_t i;
+
+	for (i = 0; i < REQUEST_TEMPLATES_NUM; i++)
+	{
+		p_template = &m_request_templates[i];
+
+		otCoapHeaderInit(&p_template->header, p_template->type, p_template->code);
+		/* the token bytes are only a placeholder overwritten at each send */
+		if (p_template->token_length > 0)
+		{
+			otCoapHeaderGenerateToken(&p_template->header, p_template->token_length);
+		}
+		if (p_template->p_uri_path != NULL)
+		{
+			assert(otCoapHeaderAppendUriPathOptions(&p_template->header, p_template->p_uri_path) == OT_ERROR_NONE);
+		}
+		if (p_template->p_uri_query != NULL)
+		{
+			option.mNumber = OT_COAP_OPTION_URI_QUERY;
+			option.mLength = strlen(p_template->p_uri_query);
+			option.mValue = (const uint8_t *)p_template->p_uri_query;
+			assert(otCoapHeaderAppendOption(&p_template->header, &option) == OT_ERROR_NONE);
+		}
+		if (true == p_template->payload)
+		{
+			otCoapHeaderSetPayloadMarker(&p_template->header);
+		}
+	}
+
+	assert(otIp6AddressFromString(ALL_LIGHTS_MULTICAST_ADDRESS,
+											&m_request_destinations[REQUEST_DESTINATION_ALL_LIGHTS]) == OT_ERROR_NONE);
+	assert(otIp6AddressFromString(LIGHT_GROUP_MULTICAST_ADDRESS,
+											&m_request_destinations[REQUEST_DESTINATION_GROUP_0]) == OT_ERROR_NONE);
+	for (i = 1; i < LIGHT_GROUPS_NUM; i++)
+	{
+		m_request_destinations[REQUEST_DESTINATION_GROUP_0 + i] = m_request_destinations[REQUEST_DESTINATION_GROUP_0];
+		m_request_destinations[REQUEST_DESTINATION_GROUP_0 + i].mFields.m8[15] = i;
+	}
+
+	memset(&m_request_message_info, 0, sizeof(m_request_message_info));
+	m_request_message_info.mInterfaceId = OT_NETIF_INTERFACE_ID_THREAD;
+	m_request_message_info.mPeerPort = OT_DEFAULT_COAP_PORT;
 }
 
 
-/* CoAP multicast light request */
-static void multicast_light_request_send(otInstance * p_instance, uint8_t command)
+/* Build a request message from a prebuilt template. A fresh token is written in
+   the template copy and returned in p_token, if not NULL. */
+static otMessage * request_message_new(otInstance            * p_instance,
+                                       request_template_id_t   template_id,
+                                       const void            * p_payload,
+                                       uint16_t                length,
+                                       uint8_t               * p_token)
 {
-    otError       error = OT_ERROR_NONE;
+    const request_template_t * p_template = &m_request_templates[template_id];
+    otError       error = OT_ERROR_NO_BUFS;
     otMessage   * p_message;
-    otMessageInfo messageInfo;
     otCoapHeader  header;
+    uint32_t      random = 0;
+    uint8_t       i;
 
     do
     {
-        otCoapHeaderInit(&header, OT_COAP_TYPE_CONFIRMABLE, OT_COAP_CODE_PUT);
-        otCoapHeaderAppendUriPathOptions(&header, "light");
-        otCoapHeaderSetPayloadMarker(&header);
+        header = p_template->header;
+
+        /* the token follows the fixed part of the header: overwrite it in place */
+        for (i = 0; i < p_template->token_length; i++)
+        {
+            if ((i % sizeof(random)) == 0)
+            {
+                random = otPlatRandomGet();
+            }
+            ((uint8_t *)otCoapHeaderGetToken(&header))[i] = (uint8_t)random;
+            random >>= 8;
+        }
+
+        if (p_token != NULL)
+        {
+            memcpy(p_token, otCoapHeaderGetToken(&header), p_template->token_length);
+        }
 
         p_message = otCoapNewMessage(p_instance, &header);
         if (p_message == NULL)
@@ -322,75 +1365,1227 @@ static void multicast_light_request_send(otInstance * p_instance, uint8_t comman
             break;
         }
 
-        error = otMessageAppend(p_message, &command, sizeof(command));
-        if (error != OT_ERROR_NONE)
+        error = OT_ERROR_NONE;
+        if (length > 0)
         {
-            break;
+            error = otMessageAppend(p_message, p_payload, length);
         }
-
-        memset(&messageInfo, 0, sizeof(messageInfo));
-        messageInfo.mInterfaceId = OT_NETIF_INTERFACE_ID_THREAD;
-        messageInfo.mPeerPort = OT_DEFAULT_COAP_PORT;
-        otIp6AddressFromString("FF03::1", &messageInfo.mPeerAddr);
-
-        error = otCoapSendRequest(p_instance, p_message, &messageInfo, NULL, NULL);
     } while (false);
 
     if (error != OT_ERROR_NONE && p_message != NULL)
     {
-        NRF_LOG_INFO("Failed to send CoAP Request: %d\r\n", error);
+        NRF_LOG_INFO("Failed to build CoAP Request: %d\r\n", error);
         otMessageFree(p_message);
+        p_message = NULL;
     }
+
+    return p_message;
 }
 
 
-/* Function to send a dimming request to any device (multicast) */
-static void multicast_dim_request_send(otInstance * p_instance, uint8_t dim_value)
+/* Send a request built from a prebuilt template */
+static otError request_send(otInstance            * p_instance,
+                            request_template_id_t   template_id,
+                            const otIp6Address    * p_destination,
+                            const void            * p_payload,
+                            uint16_t                length,
+                            otCoapResponseHandler   handler,
+                            void                  * p_context,
+                            uint8_t               * p_token)
 {
-    otError       error = OT_ERROR_NONE;
+    otError       error = OT_ERROR_NO_BUFS;
     otMessage   * p_message;
     otMessageInfo messageInfo;
-    otCoapHeader  header;
+    PERF_START(start);
 
-    do
+    p_message = request_message_new(p_instance, template_id, p_payload, length, p_token);
+    if (p_message != NULL)
     {
-        otCoapHeaderInit(&header, OT_COAP_TYPE_CONFIRMABLE, OT_COAP_CODE_PUT);
-        otCoapHeaderAppendUriPathOptions(&header, "dim");
-        otCoapHeaderSetPayloadMarker(&header);
-
-        p_message = otCoapNewMessage(p_instance, &header);
-        if (p_message == NULL)
-        {
-            NRF_LOG_INFO("Failed to allocate message for CoAP Request\r\n");
-            break;
-        }
+        messageInfo = m_request_message_info;
+        messageInfo.mPeerAddr = *p_destination;
 
-        error = otMessageAppend(p_message, &dim_value, sizeof(dim_value));
+        error = otCoapSendRequest(p_instance, p_message, &messageInfo, handler, p_context);
         if (error != OT_ERROR_NONE)
         {
-            break;
+            NRF_LOG_INFO("Failed to send CoAP Request: %d\r\n", error);
+            otMessageFree(p_message);
         }
+    }
 
-        memset(&messageInfo, 0, sizeof(messageInfo));
-        messageInfo.mInterfaceId = OT_NETIF_INTERFACE_ID_THREAD;
-        messageInfo.mPeerPort = OT_DEFAULT_COAP_PORT;
-        otIp6AddressFromString("FF03::1", &messageInfo.mPeerAddr);
+    PERF_STOP(m_perf_request, start);
 
-        error = otCoapSendRequest(p_instance, 
-								  p_message, 
-								  &messageInfo, 
-								  NULL, 
-								  NULL);
-    } while (false);
+    return error;
+}
 
-    if (error != OT_ERROR_NONE && p_message != NULL)
-    {
-        NRF_LOG_INFO("Failed to send CoAP Request: %d\r\n", error);
-        otMessageFree(p_message);
-    }
 
-	NRF_LOG_INFO("Sent dim value: %d\r\n", dim_value);
+/* Report the outcome of a request given by the host */
+static void request_report(uint32_t request_id, request_event_t event, otError result, uint32_t rtt)
+{
+#ifdef UART_CHANNEL_ENABLED
+	if ((request_id != REQUEST_ID_NONE) &&
+		(true == request_fanout_fold(request_id, &event, &result, &rtt)))
+	{
+		uart_event_send(request_id, event, result, rtt);
+	}
+#else
+	(void)request_id;
+	(void)event;
+	(void)result;
+	(void)rtt;
+#endif
+}
+
+
+#ifdef UART_CHANNEL_ENABLED
+/* Combine the outcomes of the unicast requests a host command is sent as. Without
+   a free entry each request reports its own events. */
+static void request_fanout_start(uint32_t request_id, uint8_t count)
+{
+	uint8_t i;
+
+	if (request_id == REQUEST_ID_NONE)
+	{
+		return;
+	}
+
+	for (i = 0; i < REQUEST_FANOUTS_MAX; i++)
+	{
+		if (0 == m_scheduler.fanouts[i].pending)
+		{
+			m_scheduler.fanouts[i].request_id = request_id;
+			m_scheduler.fanouts[i].pending    = count;
+			m_scheduler.fanouts[i].event      = REQUEST_EVENT_SUPERSEDED;
+			m_scheduler.fanouts[i].result     = OT_ERROR_NONE;
+			m_scheduler.fanouts[i].rtt        = 0;
+			return;
+		}
+	}
+}
+
+
+/* Fold the event of a request into the outcome of its host command. Returns false
+   while the event is held back, true with the event to report. */
+static bool request_fanout_fold(uint32_t request_id, request_event_t * p_event, otError * p_result, uint32_t * p_rtt)
+{
+	request_fanout_t * p_fanout = NULL;
+	uint8_t            i;
+
+	for (i = 0; i < REQUEST_FANOUTS_MAX; i++)
+	{
+		if ((m_scheduler.fanouts[i].pending > 0) && (m_scheduler.fanouts[i].request_id == request_id))
+		{
+			p_fanout = &m_scheduler.fanouts[i];
+			break;
+		}
+	}
+
+	if ((p_fanout == NULL) || (*p_event == REQUEST_EVENT_PARSED))
+	{
+		return true;
+	}
+
+	/* a request sent ends with its ack */
+	if ((*p_event == REQUEST_EVENT_SENT) && (*p_result == OT_ERROR_NONE))
+	{
+		return false;
+	}
+
+	if (*p_event == REQUEST_EVENT_DROPPED)
+	{
+		p_fanout->event = REQUEST_EVENT_DROPPED;
+	}
+	else if ((*p_event != REQUEST_EVENT_SUPERSEDED) && (p_fanout->event == REQUEST_EVENT_SUPERSEDED))
+	{
+		p_fanout->event = REQUEST_EVENT_ACK;
+	}
+
+	if ((p_fanout->result == OT_ERROR_NONE) && (*p_result != OT_ERROR_NONE))
+	{
+		p_fanout->result = *p_result;
+	}
+
+	if (*p_rtt > p_fanout->rtt)
+	{
+		p_fanout->rtt = *p_rtt;
+	}
+
+	p_fanout->pending--;
+	if (p_fanout->pending > 0)
+	{
+		return false;
+	}
+
+	*p_event  = p_fanout->event;
+	*p_result = p_fanout->result;
+	*p_rtt    = p_fanout->rtt;
+
+	return true;
+}
+#endif
+
+
+/* Send a light command to the selected peer or to all the lights */
+static void command_send(request_resource_t resource, uint8_t value)
+{
+	light_set_t targets;
+	int16_t     index;
+
+	memset(&targets, 0, sizeof(targets));
+
+	/* if peer address is valid */
+	if (!otIp6IsAddressEqual(&m_app.peer_address, &m_unspecified_ipv6))
+	{
+		index = light_find(&m_app.peer_address);
+		if (index < 0)
+		{
+			index = light_add(&m_app.peer_address, LIGHT_RLOC16_INVALID);
+		}
+
+		if (index < 0)
+		{
+			/* no room in the lights table: unicast straight to the peer */
+			if (true == request_submit(resource, &m_app.peer_address, value, m_scheduler.request_id))
+			{
+				request_schedule();
+			}
+			return;
+		}
+
+		targets.mask[index / 32] |= (1UL << (index % 32));
+	}
+	else
+	{
+		targets.all = true;
+	}
+
+	dispatch_command(resource, value, &targets);
+}
+
+
+/* Send a light command to all the lights or to a group of lights */
+static void multicast_request_send(request_resource_t resource, uint8_t value, request_destination_id_t destination)
+{
+	otError error;
+	PERF_START(start);
+
+	assert(m_multicast_templates[resource] < REQUEST_TEMPLATES_NUM);
+
+	error = request_send(m_app.p_ot_instance,
+							 m_multicast_templates[resource],
+							 &m_request_destinations[destination],
+							 &value,
+							 sizeof(value),
+							 NULL,
+							 NULL,
+							 NULL);
+
+	/* multicast requests are not confirmable: no ACK will be reported */
+	request_report(m_scheduler.request_id, REQUEST_EVENT_SENT, error, 0);
+
+	if (REQUEST_RESOURCE_DIM == resource)
+	{
+		NRF_LOG_INFO("Sent dim value: %d\r\n", value);
+	}
+
+	PERF_STOP(m_perf_multicast, start);
+}
+
+
+#ifdef UART_CHANNEL_ENABLED
+/* Send dim levels to several lights in one multicast request: each light picks
+   the entry of its id. All the same levels are sent as a level and a bitmask of
+   the ids when that is shorter than the list of pairs. */
+static void batch_request_send(const uint8_t (*p_pairs)[2], uint8_t count, request_destination_id_t destination)
+{
+	uint8_t  payload[BATCH_PAYLOAD_MAX];
+	uint8_t  pairs[CMD_BATCH_MAX][2];
+	uint8_t  kept = 0;
+	uint16_t length;
+	uint8_t  max_id = 0;
+	bool     same_level = true;
+	otError  error;
+	uint8_t  i;
+	PERF_START(start);
+
+	if ((0 == count) || (count > CMD_BATCH_MAX))
+	{
+		return;
+	}
+
+	/* a known light is left out until it has acked its id: the light evicted
+	   before it from the same entry may still answer to the id */
+	for (i = 0; i < count; i++)
+	{
+		if ((p_pairs[i][0] < LIGHTS_MAX) &&
+			(true == m_lights[p_pairs[i][0]].in_use) &&
+			(false == m_lights[p_pairs[i][0]].id_assigned))
+		{
+			continue;
+		}
+		pairs[kept][0] = p_pairs[i][0];
+		pairs[kept][1] = p_pairs[i][1];
+		kept++;
+	}
+
+	if (0 == kept)
+	{
+		request_report(m_scheduler.request_id, REQUEST_EVENT_DROPPED, OT_ERROR_INVALID_STATE, 0);
+		PERF_STOP(m_perf_batch, start);
+		return;
+	}
+
+	for (i = 0; i < kept; i++)
+	{
+		if (pairs[i][0] > max_id)
+		{
+			max_id = pairs[i][0];
+		}
+		if (pairs[i][1] != pairs[0][1])
+		{
+			same_level = false;
+		}
+	}
+
+	if ((true == same_level) && ((2 + (max_id / 8) + 1) < (1 + (2 * kept))))
+	{
+		length = 2 + (max_id / 8) + 1;
+		memset(payload, 0, length);
+		payload[0] = BATCH_FORMAT_MASK;
+		payload[1] = pairs[0][1];
+		for (i = 0; i < kept; i++)
+		{
+			payload[2 + (pairs[i][0] / 8)] |= (1 << (pairs[i][0] % 8));
+		}
+	}
+	else
+	{
+		length = 1 + (2 * kept);
+		payload[0] = BATCH_FORMAT_LIST;
+		memcpy(&payload[1], pairs, 2 * kept);
+	}
+
+	error = request_send(m_app.p_ot_instance,
+								REQUEST_TEMPLATE_BATCH_MULTICAST,
+								&m_request_destinations[destination],
+								payload,
+								length,
+								NULL,
+								NULL,
+								NULL);
+
+	request_report(m_scheduler.request_id, REQUEST_EVENT_SENT, error, 0);
+
+	PERF_STOP(m_perf_batch, start);
+}
+#endif
+
+
+/* Find a known light by address */
+static int16_t light_find(const otIp6Address * p_address)
+{
+	uint8_t i;
+
+	for (i = 0; i < LIGHTS_MAX; i++)
+	{
+		if ((true == m_lights[i].in_use) && otIp6IsAddressEqual(&m_lights[i].address, p_address))
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+
+/* Add a light to the known ones or refresh its locator */
+static int16_t light_add(const otIp6Address * p_address, uint16_t rloc16)
+{
+	int16_t index = light_find(p_address);
+	uint8_t i;
+
+	if (index < 0)
+	{
+		for (i = 0; i < LIGHTS_MAX; i++)
+		{
+			if (false == m_lights[i].in_use)
+			{
+				m_lights[i].in_use = true;
+				m_lights[i].address = *p_address;
+				m_lights[i].delivery = LIGHT_DELIVERY_MAX;
+				m_lights[i].groups = 0;
+				m_lights[i].seen = otPlatAlarmGetNow();
+				m_lights[i].refresh_pending = false;
+				index = i;
+				bindings_changed();
+
+				/* the table index is the id of the light in batch requests */
+				m_lights[i].id_pending = true;
+				m_lights[i].id_assigned = false;
+				light_ids_assign();
+				break;
+			}
+		}
+	}
+
+	if (index >= 0)
+	{
+		m_lights[index].rloc16 = rloc16;
+	}
+
+	return index;
+}
+
+
+/* Update the recent delivery success ratio of a light */
+static void light_delivery_update(const otIp6Address * p_address, bool success)
+{
+	int16_t index = light_find(p_address);
+	int16_t delivery;
+
+	if (index >= 0)
+	{
+		/* exponential moving average with 1/4 weight to the last exchange */
+		delivery = m_lights[index].delivery;
+		delivery += ((success ? LIGHT_DELIVERY_MAX : 0) - delivery) / 4;
+		m_lights[index].delivery = (uint8_t)delivery;
+
+		if (true == success)
+		{
+			m_lights[index].seen = otPlatAlarmGetNow();
+		}
+	}
+}
+
+
+/* Queue the id requests of the new lights, as long as the queue has room */
+static void light_ids_assign(void)
+{
+	bool    submitted = false;
+	uint8_t i;
+
+	for (i = 0; (i < LIGHTS_MAX) && (m_scheduler.queue_count < LIGHT_ID_QUEUE_MAX); i++)
+	{
+		if ((true == m_lights[i].in_use) && (true == m_lights[i].id_pending) &&
+			 (true == request_submit(REQUEST_RESOURCE_ID, &m_lights[i].address, i, REQUEST_ID_NONE)))
+		{
+			m_lights[i].id_pending = false;
+			submitted = true;
+		}
+	}
+
+	if (true == submitted)
+	{
+		request_schedule();
+	}
+}
+
+
+/* Outcome of the id request of a light: the light is used in batch requests once
+   it has acked its id, a failed request is queued again */
+static void light_id_result(const request_t * p_request, otError result)
+{
+	int16_t index = light_find(&p_request->peer_address);
+
+	/* the request is for the id of the entry */
+	if ((index < 0) || (index != p_request->value))
+	{
+		return;
+	}
+
+	if (result == OT_ERROR_NONE)
+	{
+		m_lights[index].id_assigned = true;
+	}
+	else
+	{
+		m_lights[index].id_pending = true;
+	}
+}
+
+
+/* Outcome of a group request: the membership is recorded once the light has
+   acked it, so the dispatcher never counts on a group the light did not join */
+static void light_group_result(const request_t * p_request, otError result)
+{
+	int16_t index = light_find(&p_request->peer_address);
+	uint8_t group = p_request->value & ~LIGHT_GROUP_JOIN_FLAG;
+
+	if ((index < 0) || (result != OT_ERROR_NONE))
+	{
+		return;
+	}
+
+	if (0 != (p_request->value & LIGHT_GROUP_JOIN_FLAG))
+	{
+		m_lights[index].groups |= (1 << group);
+	}
+	else
+	{
+		m_lights[index].groups &= ~(1 << group);
+	}
+	bindings_changed();
+}
+
+
+#ifdef CLI_ENABLED
+/* Join or leave a light group. The request goes to the light through the scheduler,
+   the membership is recorded when the light acks it. */
+static void light_group_set(uint8_t index, uint8_t group, bool join)
+{
+	if ((index >= LIGHTS_MAX) || (false == m_lights[index].in_use) || (group >= LIGHT_GROUPS_NUM))
+	{
+		return;
+	}
+
+	if (true == request_submit(REQUEST_RESOURCE_GROUP,
+										&m_lights[index].address,
+										(join ? LIGHT_GROUP_JOIN_FLAG : 0) | group,
+										REQUEST_ID_NONE))
+	{
+		/* the membership is recorded on the ack */
+		request_schedule();
+	}
+}
+
+
+/* Parse a time of day as hh:mm or hh:mm:ss in s */
+static bool cli_time_parse(const char * p_text, uint32_t * p_seconds)
+{
+	char        * p_end;
+	unsigned long fields[3] = { 0, 0, 0 };
+	uint8_t       i;
+
+	for (i = 0; i < 3; i++)
+	{
+		fields[i] = strtoul(p_text, &p_end, 10);
+		if ((p_end == p_text) || ((*p_end != ':') && (*p_end != '\0')))
+		{
+			return false;
+		}
+		p_text = p_end + 1;
+		if (*p_end == '\0')
+		{
+			break;
+		}
+	}
+
+	if ((i == 0) || (i == 3) || (fields[0] > 23) || (fields[1] > 59) || (fields[2] > 59))
+	{
+		return false;
+	}
+
+	*p_seconds = (fields[0] * 3600) + (fields[1] * 60) + fields[2];
+	return true;
+}
+
+
+/* Send a schedule entry to the peer, or to all the lights without a peer.
+   The entry is 5 bytes: slot, minute of the day (little endian), level, transition in s. */
+static void schedule_entry_send(uint8_t slot, uint16_t minute, uint8_t level, uint8_t transition)
+{
+	uint8_t payload[5];
+
+	payload[0] = slot;
+	payload[1] = (uint8_t)minute;
+	payload[2] = (uint8_t)(minute >> 8);
+	payload[3] = level;
+	payload[4] = transition;
+
+	(void)request_send(m_app.p_ot_instance,
+							 REQUEST_TEMPLATE_SCHEDULE,
+							 otIp6IsAddressEqual(&m_app.peer_address, &m_unspecified_ipv6) ?
+							 &m_request_destinations[REQUEST_DESTINATION_ALL_LIGHTS] : &m_app.peer_address,
+							 payload,
+							 sizeof(payload),
+							 NULL,
+							 NULL,
+							 NULL);
+}
+#endif
+
+
+/* Function to get the current bindings and known lights as records */
+static void bindings_record_get(bindings_record_t * p_record, light_record_t * p_lights, uint8_t * p_lights_num)
+{
+	uint8_t i;
+
+	memset(p_record, 0, sizeof(bindings_record_t));
+	p_record->version = BINDINGS_RECORD_VERSION;
+	p_record->dim_value = m_app.multicast_dim_value;
+	p_record->peer_address = m_app.peer_address;
+
+	*p_lights_num = 0;
+	for (i = 0; i < LIGHTS_MAX; i++)
+	{
+		if (true == m_lights[i].in_use)
+		{
+			p_lights[*p_lights_num].index = i;
+			p_lights[*p_lights_num].groups = m_lights[i].groups;
+			memcpy(p_lights[*p_lights_num].iid, &m_lights[i].address.mFields.m8[8], sizeof(p_lights[0].iid));
+			(*p_lights_num)++;
+		}
+	}
+}
+
+
+/* Function to note a change of the bindings: the write is deferred until they
+   are stable for BINDINGS_SAVE_DELAY, so a series of presses costs one write */
+static void bindings_changed(void)
+{
+	m_bindings.pending = true;
+
+	app_timer_stop(m_bindings_timer);
+	app_timer_start(m_bindings_timer, APP_TIMER_TICKS(BINDINGS_SAVE_DELAY), NULL);
+}
+
+
+/* Function to write the records that differ from the ones in flash */
+static void bindings_save(void)
+{
+	/* too large for the stack */
+	static light_record_t lights[LIGHTS_MAX];
+	bindings_record_t record;
+	uint8_t           lights_num;
+	otError           error;
+
+	if (false == m_bindings.pending)
+	{
+		return;
+	}
+
+	m_bindings.pending = false;
+	app_timer_stop(m_bindings_timer);
+	bindings_record_get(&record, lights, &lights_num);
+
+	if (0 != memcmp(&record, &m_bindings.saved, sizeof(record)))
+	{
+		if (otPlatSettingsSet(m_app.p_ot_instance, BINDINGS_SETTINGS_KEY, (const uint8_t *)&record, sizeof(record)) == OT_ERROR_NONE)
+		{
+			m_bindings.saved = record;
+			m_bindings.writes++;
+		}
+	}
+
+	if ((lights_num != m_bindings.saved_lights_num) ||
+		 (0 != memcmp(lights, m_bindings.saved_lights, lights_num * sizeof(light_record_t))))
+	{
+		if (0 == lights_num)
+		{
+			error = otPlatSettingsDelete(m_app.p_ot_instance, LIGHTS_SETTINGS_KEY, -1);
+		}
+		else
+		{
+			error = otPlatSettingsSet(m_app.p_ot_instance, LIGHTS_SETTINGS_KEY, (const uint8_t *)lights, lights_num * sizeof(light_record_t));
+		}
+
+		if (error == OT_ERROR_NONE)
+		{
+			memcpy(m_bindings.saved_lights, lights, lights_num * sizeof(light_record_t));
+			m_bindings.saved_lights_num = lights_num;
+			m_bindings.writes++;
+		}
+	}
+}
+
+
+/* Function to restore the bindings and the known lights saved before the reset */
+static void bindings_restore(void)
+{
+	bindings_record_t record;
+	uint16_t          length;
+	uint8_t           i;
+	light_record_t  * p_light;
+
+	/* nothing saved: the records in flash are the empty ones */
+	bindings_record_get(&m_bindings.saved, m_bindings.saved_lights, &m_bindings.saved_lights_num);
+
+	length = sizeof(record);
+	if ((otPlatSettingsGet(m_app.p_ot_instance, BINDINGS_SETTINGS_KEY, 0, (uint8_t *)&record, &length) == OT_ERROR_NONE) &&
+		 (length == sizeof(record)) && (record.version == BINDINGS_RECORD_VERSION) && (record.dim_value <= 100))
+	{
+		m_app.peer_address = record.peer_address;
+		m_app.multicast_dim_value = record.dim_value;
+		m_bindings.saved = record;
+	}
+
+	length = sizeof(m_bindings.saved_lights);
+	if ((otPlatSettingsGet(m_app.p_ot_instance, LIGHTS_SETTINGS_KEY, 0, (uint8_t *)m_bindings.saved_lights, &length) == OT_ERROR_NONE) &&
+		 ((length % sizeof(light_record_t)) == 0))
+	{
+		m_bindings.saved_lights_num = (uint8_t)(length / sizeof(light_record_t));
+
+		for (i = 0; i < m_bindings.saved_lights_num; i++)
+		{
+			p_light = &m_bindings.saved_lights[i];
+			if (p_light->index >= LIGHTS_MAX)
+			{
+				continue;
+			}
+
+			/* the lights already have their id: no request, unlike light_add */
+			m_lights[p_light->index].in_use = true;
+			m_lights[p_light->index].address = *otThreadGetMeshLocalEid(m_app.p_ot_instance);
+			memcpy(&m_lights[p_light->index].address.mFields.m8[8], p_light->iid, sizeof(p_light->iid));
+			m_lights[p_light->index].rloc16 = LIGHT_RLOC16_INVALID;
+			m_lights[p_light->index].delivery = LIGHT_DELIVERY_MAX;
+			m_lights[p_light->index].groups = p_light->groups;
+			m_lights[p_light->index].id_pending = false;
+			m_lights[p_light->index].id_assigned = true;
+			m_lights[p_light->index].refresh_pending = false;
+			m_lights[p_light->index].seen = otPlatAlarmGetNow();
+		}
+	}
+
+	NRF_LOG_INFO("bindings restored: %d lights\r\n", m_bindings.saved_lights_num);
+}
+
+
+/* Bindings timer handler: the flash write runs in the main loop */
+static void bindings_timer_handler(void * p_context)
+{
+	(void)p_context;
+
+	(void)event_queue_post(&m_events, APP_EVENT_BINDINGS_SAVE, 0, 0);
+}
+
+
+#ifdef DISCOVERY_ENABLED
+/* Function to open the socket of the multicast discovery */
+static void discovery_init(void)
+{
+	otSockAddr sockaddr;
+
+	memset(&sockaddr, 0, sizeof(sockaddr));
+	sockaddr.mPort = DISCOVERY_PORT;
+
+	assert(otUdpOpen(m_app.p_ot_instance, &m_discovery.socket, discovery_answer_receive, NULL) == OT_ERROR_NONE);
+	assert(otUdpBind(&m_discovery.socket, &sockaddr) == OT_ERROR_NONE);
+}
+
+
+/* Function to query all the lights for their resources: each one answers after a
+   random delay, the new ones are added to the known lights. The query is sent from
+   the discovery socket and not through the CoAP layer, which ends a request on its
+   first response and drops the answers of the other lights. */
+static void discovery_start(void)
+{
+	otMessage   * p_message;
+	otMessageInfo messageInfo;
+	uint16_t      message_id;
+
+	if (true == m_discovery.active)
+	{
+		return;
+	}
+
+	p_message = request_message_new(m_app.p_ot_instance, REQUEST_TEMPLATE_DISCOVERY_MULTICAST, NULL, 0, m_discovery.token);
+	if (p_message == NULL)
+	{
+		return;
+	}
+
+	/* the CoAP layer does not number this message: give it a message id of its own */
+	message_id = (uint16_t)otPlatRandomGet();
+	(void)otMessageWrite(p_message, 2, &message_id, sizeof(message_id));
+
+	messageInfo = m_request_message_info;
+	messageInfo.mPeerAddr = m_request_destinations[REQUEST_DESTINATION_ALL_LIGHTS];
+
+	if (otUdpSend(&m_discovery.socket, p_message, &messageInfo) != OT_ERROR_NONE)
+	{
+		otMessageFree(p_message);
+		return;
+	}
+
+	m_discovery.active = true;
+	m_discovery.start = otPlatAlarmGetNow();
+	m_discovery.found = 0;
+}
+
+
+/* Function to process the links of a discovery answer: a light publishing the
+   on/off resource is added to the known lights, or marked as heard */
+static void discovery_links_process(otMessage * p_message, uint16_t offset, const otIp6Address * p_peer)
+{
+	char     payload[DISCOVERY_PAYLOAD_MAX];
+	uint16_t length;
+	int16_t  index;
+
+	length = otMessageRead(p_message, offset, payload, sizeof(payload) - 1);
+	payload[length] = '\0';
+	if (NULL == strstr(payload, DISCOVERY_RESOURCE_TYPE))
+	{
+		return;
+	}
+
+	/* the lights answer from their mesh-local EID */
+	index = light_find(p_peer);
+	if (index < 0)
+	{
+		index = light_add(p_peer, LIGHT_RLOC16_INVALID);
+		if (index >= 0)
+		{
+			m_discovery.found++;
+		}
+	}
+
+	if (index >= 0)
+	{
+		m_lights[index].seen = otPlatAlarmGetNow();
+	}
+}
+
+
+/* Discovery socket receive handler: each answer to the multicast discovery comes
+   here, with its CoAP header still in front of the links */
+static void discovery_answer_receive(void * p_context, otMessage * p_message, const otMessageInfo * p_message_info)
+{
+	uint8_t  header[4 + REQUEST_TOKEN_LENGTH];
+	uint8_t  extension[2];
+	uint8_t  byte;
+	uint16_t offset = otMessageGetOffset(p_message);
+	uint16_t end = otMessageGetLength(p_message);
+	uint16_t option_length;
+
+	(void)p_context;
+
+	/* version 1, a 2.05 Content with the token of the running discovery */
+	if ((false == m_discovery.active) ||
+		(otMessageRead(p_message, offset, header, sizeof(header)) != sizeof(header)) ||
+		((header[0] & 0xC0) != 0x40) || ((header[0] & 0x0F) != REQUEST_TOKEN_LENGTH) ||
+		(header[1] != OT_COAP_CODE_CONTENT) ||
+		(0 != memcmp(&header[4], m_discovery.token, REQUEST_TOKEN_LENGTH)))
+	{
+		return;
+	}
+
+	/* skip the options up to the payload marker */
+	offset += sizeof(header);
+	while (otMessageRead(p_message, offset++, &byte, 1) == 1)
+	{
+		if (byte == 0xFF)
+		{
+			discovery_links_process(p_message, offset, &p_message_info->mPeerAddr);
+			return;
+		}
+
+		if (((byte >> 4) == 15) || ((byte & 0x0F) == 15))
+		{
+			return;
+		}
+
+		/* option delta and length of 13 and 14 take one and two more bytes */
+		offset += ((byte >> 4) == 13) ? 1 : (((byte >> 4) == 14) ? 2 : 0);
+		option_length = byte & 0x0F;
+		if (option_length == 13)
+		{
+			(void)otMessageRead(p_message, offset++, &byte, 1);
+			option_length = 13 + byte;
+		}
+		else if (option_length == 14)
+		{
+			(void)otMessageRead(p_message, offset, extension, sizeof(extension));
+			offset += sizeof(extension);
+			option_length = 269 + ((extension[0] << 8) | extension[1]);
+		}
+
+		if (option_length >= (end - offset))
+		{
+			return;
+		}
+		offset += option_length;
+	}
+}
+
+
+/* Discovery response handler of the refresh query of a known light */
+static void discovery_response_handler(void                * p_context,
+                                       otCoapHeader        * p_header,
+                                       otMessage           * p_message,
+                                       const otMessageInfo * p_message_info,
+                                       otError               result)
+{
+	(void)p_header;
+
+	((light_t *)p_context)->refresh_pending = false;
+	if (m_discovery.refreshing > 0)
+	{
+		m_discovery.refreshing--;
+	}
+
+	if (result != OT_ERROR_NONE)
+	{
+		/* a light that does not answer is evicted once its TTL runs out */
+		return;
+	}
+
+	discovery_links_process(p_message, otMessageGetOffset(p_message), &p_message_info->mPeerAddr);
+}
+
+
+/* Function to refresh the cache of the known lights: the ones not heard for half
+   the TTL are queried again, a few at a time, and the ones not heard for the whole
+   TTL are removed */
+static void discovery_tick(void)
+{
+	uint32_t     now = otPlatAlarmGetNow();
+	otDeviceRole role = otThreadGetDeviceRole(m_app.p_ot_instance);
+	uint8_t      checked;
+	uint8_t      i;
+
+	if ((true == m_discovery.active) && ((now - m_discovery.start) >= DISCOVERY_ROUND_TIME))
+	{
+		m_discovery.active = false;
+		NRF_LOG_INFO("discovery: %d new lights\r\n", m_discovery.found);
+	}
+
+	/* the id requests of the lights found in a burst */
+	light_ids_assign();
+
+	/* detached: the lights are not heard because of this node */
+	if ((OT_DEVICE_ROLE_DISABLED == role) || (OT_DEVICE_ROLE_DETACHED == role))
+	{
+		return;
+	}
+
+	for (checked = 0; (checked < LIGHTS_MAX) && (m_discovery.refreshing < DISCOVERY_REFRESH_MAX); checked++)
+	{
+		i = m_discovery.next;
+		m_discovery.next = (m_discovery.next + 1) % LIGHTS_MAX;
+
+		/* an entry with a refresh in flight is kept: the answer comes back to it */
+		if ((false == m_lights[i].in_use) || (true == m_lights[i].refresh_pending) ||
+			((now - m_lights[i].seen) < (DISCOVERY_TTL / 2)))
+		{
+			continue;
+		}
+
+		if ((now - m_lights[i].seen) >= DISCOVERY_TTL)
+		{
+			m_lights[i].in_use = false;
+			m_discovery.evicted++;
+			bindings_changed();
+			continue;
+		}
+
+		if (request_send(m_app.p_ot_instance,
+							  REQUEST_TEMPLATE_DISCOVERY,
+							  &m_lights[i].address,
+							  NULL,
+							  0,
+							  discovery_response_handler,
+							  &m_lights[i],
+							  NULL) == OT_ERROR_NONE)
+		{
+			m_lights[i].refresh_pending = true;
+			m_discovery.refreshing++;
+			m_discovery.refreshed++;
+		}
+	}
+}
+
+
+/* Discovery timer handler: the refresh runs in the main loop */
+static void discovery_timer_handler(void * p_context)
+{
+	(void)p_context;
+
+	(void)event_queue_post(&m_events, APP_EVENT_DISCOVERY_TICK, 0, 0);
+}
+#endif
+
+
+#ifdef PREWARM_ENABLED
+/* Function to ping the next known light: an empty confirmable message is answered
+   with a reset, and on the way the address of the light is resolved and its route
+   set up, so the first press after a reboot is not delayed */
+static void prewarm_next(void)
+{
+	uint8_t i;
+
+	m_prewarm.active = false;
+
+	while (m_prewarm.next < LIGHTS_MAX)
+	{
+		i = m_prewarm.next++;
+
+		if ((true == m_lights[i].in_use) &&
+			 (request_send(m_app.p_ot_instance,
+								REQUEST_TEMPLATE_PING,
+								&m_lights[i].address,
+								NULL,
+								0,
+								prewarm_response_handler,
+								&m_lights[i],
+								NULL) == OT_ERROR_NONE))
+		{
+			m_prewarm.active = true;
+			m_prewarm.pings++;
+#ifdef LIGHT_CLIENT_SED
+			/* the reset comes back through the parent */
+			sed_fast_poll_start();
+#endif
+			return;
+		}
+	}
+
+	NRF_LOG_INFO("prewarm: %d of %d lights answered\r\n", m_prewarm.replies, m_prewarm.pings);
+}
+
+
+/* Ping response handler */
+static void prewarm_response_handler(void                * p_context,
+                                     otCoapHeader        * p_header,
+                                     otMessage           * p_message,
+                                     const otMessageInfo * p_message_info,
+                                     otError               result)
+{
+	(void)p_header;
+	(void)p_message;
+	(void)p_message_info;
+
+	/* the reset of the light ends the exchange with an abort */
+	if (result != OT_ERROR_RESPONSE_TIMEOUT)
+	{
+		m_prewarm.replies++;
+	}
+	light_delivery_update(&((light_t *)p_context)->address, (result != OT_ERROR_RESPONSE_TIMEOUT));
+
+	prewarm_next();
+}
+#endif
+
+
+/* Route cost from this node to a light. Unknown routes get a default cost. */
+static uint8_t dispatch_hops(const light_t * p_light)
+{
+#ifdef LIGHT_CLIENT_SED
+	/* a sleepy child has no router table */
+	(void)p_light;
+#else
+	otRouterInfo router_info;
+
+	if ((p_light->rloc16 != LIGHT_RLOC16_INVALID) &&
+		(otThreadGetRouterInfo(m_app.p_ot_instance, p_light->rloc16 >> 10, &router_info) == OT_ERROR_NONE) &&
+		(router_info.mPathCost > 0))
+	{
+		/* a light attached as a child is one more hop away from its parent router */
+		return router_info.mPathCost + (((p_light->rloc16 & 0x1FF) != 0) ? 1 : 0);
+	}
+#endif
+
+	return DISPATCH_DEFAULT_HOPS;
+}
+
+
+/* Cost of a realm-local multicast: every router floods it */
+static uint32_t dispatch_multicast_cost(void)
+{
+	uint32_t routers = 0;
+#ifndef LIGHT_CLIENT_SED
+	otRouterInfo router_info;
+	uint8_t id;
+
+	for (id = 0; id <= otThreadGetMaxRouterId(m_app.p_ot_instance); id++)
+	{
+		if ((otThreadGetRouterInfo(m_app.p_ot_instance, id, &router_info) == OT_ERROR_NONE) &&
+			(true == router_info.mAllocated))
+		{
+			routers++;
+		}
+	}
+#endif
+
+	if (routers == 0)
+	{
+		routers = DISPATCH_DEFAULT_ROUTERS;
+	}
+
+	return routers * DISPATCH_MPL_TRANSMISSIONS * DISPATCH_COST_UNIT;
+}
+
+
+/* Send a command to a set of lights choosing between one multicast to all the
+   lights, a group multicast or a unicast request to each light, whichever is
+   expected to cost less frames. Unicast costs grow with the route cost and with
+   the recent delivery failures of each light. */
+static void dispatch_command(request_resource_t resource, uint8_t value, const light_set_t * p_targets)
+{
+	uint32_t unicast_cost = 0;
+	uint32_t group_cost;
+	uint8_t  group_mask = (1 << LIGHT_GROUPS_NUM) - 1;
+	uint8_t  group = 0;
+	uint8_t  targets = 0;
+	uint8_t  i;
+
+	/* lights not known by the controller are reached by multicast only */
+	if (true == p_targets->all)
+	{
+		m_dispatcher.decisions[DISPATCH_MULTICAST]++;
+		multicast_request_send(resource, value, REQUEST_DESTINATION_ALL_LIGHTS);
+		return;
+	}
+
+	for (i = 0; i < LIGHTS_MAX; i++)
+	{
+		if ((true == m_lights[i].in_use) && LIGHT_SET_HAS(p_targets, i))
+		{
+			targets++;
+			/* request plus ACK, repeated as recent failures suggest */
+			unicast_cost += (2 * dispatch_hops(&m_lights[i]) * DISPATCH_COST_UNIT * (LIGHT_DELIVERY_MAX + 1)) /
+								 (m_lights[i].delivery + 1);
+			group_mask &= m_lights[i].groups;
+		}
+	}
+
+	if (targets == 0)
+	{
+		return;
+	}
+
+	/* a group can be used only if its members are exactly the targets */
+	for (i = 0; i < LIGHTS_MAX; i++)
+	{
+		if ((true == m_lights[i].in_use) && !LIGHT_SET_HAS(p_targets, i))
+		{
+			group_mask &= ~m_lights[i].groups;
+		}
+	}
+
+	if (group_mask != 0)
+	{
+		while (0 == (group_mask & (1 << group)))
+		{
+			group++;
+		}
+
+		group_cost = dispatch_multicast_cost();
+		if (group_cost < unicast_cost)
+		{
+			m_dispatcher.decisions[DISPATCH_GROUP]++;
+			multicast_request_send(resource, value, REQUEST_DESTINATION_GROUP_0 + group);
+			return;
+		}
+	}
+
+	m_dispatcher.decisions[DISPATCH_UNICAST]++;
+#ifdef UART_CHANNEL_ENABLED
+	request_fanout_start(m_scheduler.request_id, targets);
+#endif
+	for (i = 0; i < LIGHTS_MAX; i++)
+	{
+		if ((true == m_lights[i].in_use) && LIGHT_SET_HAS(p_targets, i))
+		{
+			if (true == request_submit(resource, &m_lights[i].address, value, m_scheduler.request_id))
+			{
+				m_dispatcher.unicasts++;
+			}
+		}
+	}
+	request_schedule();
+}
+
+
+#ifdef CLI_ENABLED
+/* CLI command to list the known lights, set their groups and show the dispatcher counters:
+   light list | light group <index> <group> <join|leave> | light dispatch.
+   It also sets the time of day and the schedules of the lights:
+   light time <hh:mm[:ss]> | light schedule <slot> <hh:mm|clear> [level [transition]] */
+static void cli_light_command(int argc, char * argv[])
+{
+	uint32_t seconds;
+	uint8_t  payload[4];
+	uint8_t  i;
+
+	if ((argc == 1) && (0 == strcmp(argv[0], "list")))
+	{
+		for (i = 0; i < LIGHTS_MAX; i++)
+		{
+			if (true == m_lights[i].in_use)
+			{
+				otCliUartOutputFormat("%d: rloc16 0x%04x delivery %d groups 0x%02x seen %lu s ago\r\n",
+											 i, m_lights[i].rloc16, m_lights[i].delivery, m_lights[i].groups,
+											 (otPlatAlarmGetNow() - m_lights[i].seen) / 1000);
+			}
+		}
+	}
+#ifdef DISCOVERY_ENABLED
+	else if ((argc == 1) && (0 == strcmp(argv[0], "discover")))
+	{
+		discovery_start();
+	}
+	else if ((argc == 1) && (0 == strcmp(argv[0], "cache")))
+	{
+		otCliUartOutputFormat("%s found %d refreshed %lu evicted %lu\r\n",
+									 m_discovery.active ? "discovering" : "idle",
+									 m_discovery.found, m_discovery.refreshed, m_discovery.evicted);
+	}
+#endif
+	else if ((argc == 4) && (0 == strcmp(argv[0], "group")))
+	{
+		light_group_set((uint8_t)strtoul(argv[1], NULL, 0),
+							 (uint8_t)strtoul(argv[2], NULL, 0),
+							 (0 == strcmp(argv[3], "join")));
+	}
+#ifdef CHANNEL_SCAN_ENABLED
+	else if ((argc == 1) && (0 == strcmp(argv[0], "channels")))
+	{
+		for (i = 0; (m_channel_scan.state == CHANNEL_SCAN_DONE) && (i < CHANNEL_SCAN_CHANNELS_NUM); i++)
+		{
+			if (m_channel_scan.max_rssi[i] != CHANNEL_SCAN_RSSI_NONE)
+			{
+				otCliUartOutputFormat("channel %d: max %d dBm\r\n", CHANNEL_SCAN_FIRST + i, m_channel_scan.max_rssi[i]);
+			}
+		}
+		otCliUartOutputFormat("channel %d%s\r\n", otLinkGetChannel(m_app.p_ot_instance),
+									 m_channel_scan.network_found ? " (network found)" : "");
+	}
+#endif
+	else if ((argc == 2) && (0 == strcmp(argv[0], "time")) && (true == cli_time_parse(argv[1], &seconds)))
+	{
+		/* all the lights share the time, 4 bytes little endian */
+		payload[0] = (uint8_t)seconds;
+		payload[1] = (uint8_t)(seconds >> 8);
+		payload[2] = (uint8_t)(seconds >> 16);
+		payload[3] = (uint8_t)(seconds >> 24);
+		(void)request_send(m_app.p_ot_instance,
+								 REQUEST_TEMPLATE_TIME,
+								 &m_request_destinations[REQUEST_DESTINATION_ALL_LIGHTS],
+								 payload,
+								 sizeof(payload),
+								 NULL,
+								 NULL,
+								 NULL);
+	}
+	else if ((argc == 3) && (0 == strcmp(argv[0], "schedule")) && (0 == strcmp(argv[2], "clear")))
+	{
+		schedule_entry_send((uint8_t)strtoul(argv[1], NULL, 0), 0xFFFF, 0, 0);
+	}
+	else if ((argc >= 4) && (argc <= 5) && (0 == strcmp(argv[0], "schedule")) &&
+				(true == cli_time_parse(argv[2], &seconds)))
+	{
+		schedule_entry_send((uint8_t)strtoul(argv[1], NULL, 0),
+								  (uint16_t)(seconds / 60),
+								  (0 == strcmp(argv[3], "off")) ? 0 : (uint8_t)strtoul(argv[3], NULL, 0),
+								  (argc == 5) ? (uint8_t)strtoul(argv[4], NULL, 0) : 0);
+	}
+	else if ((argc == 1) && (0 == strcmp(argv[0], "dispatch")))
+	{
+		otCliUartOutputFormat("multicast %lu group %lu unicast %lu requests %lu\r\n",
+									 m_dispatcher.decisions[DISPATCH_MULTICAST],
+									 m_dispatcher.decisions[DISPATCH_GROUP],
+									 m_dispatcher.decisions[DISPATCH_UNICAST],
+									 m_dispatcher.unicasts);
+	}
+	else
+	{
+		otCliUartAppendResult(OT_ERROR_INVALID_ARGS);
+		return;
+	}
+
+	otCliUartAppendResult(OT_ERROR_NONE);
 }
+#endif
 
 
 /* CoAP provisioning response handler */
@@ -403,7 +2598,8 @@ static void provisioning_response_handler(void                * p_context,
     (void)p_context;
     (void)p_header;
 
-    uint8_t peer_type;
+    uint8_t  peer_type;
+    uint16_t rloc16 = LIGHT_RLOC16_INVALID;
 
     if (result == OT_ERROR_NONE)
     {
@@ -414,6 +2610,15 @@ static void provisioning_response_handler(void                * p_context,
                           otMessageGetOffset(p_message) + 1,
                           &m_app.peer_address,
                           sizeof(m_app.peer_address));
+
+            /* the locator follows the address in newer lights */
+            otMessageRead(p_message,
+                          otMessageGetOffset(p_message) + 1 + sizeof(m_app.peer_address),
+                          &rloc16,
+                          sizeof(rloc16));
+
+            (void)light_add(&m_app.peer_address, rloc16);
+            bindings_changed();
         }
     }
     else
@@ -426,69 +2631,201 @@ static void provisioning_response_handler(void                * p_context,
 /* CoAP send provisioning request */
 static void provisioning_request_send(otInstance * p_instance)
 {
-    otError       error = OT_ERROR_NONE;
-    otCoapHeader  header;
-    otMessage   * p_request;
-    otMessageInfo aMessageInfo;
+	/* provisioning request is always multicast */
+	(void)request_send(p_instance,
+							 REQUEST_TEMPLATE_PROVISIONING,
+							 &m_request_destinations[REQUEST_DESTINATION_ALL_LIGHTS],
+							 NULL,
+							 0,
+							 provisioning_response_handler,
+							 p_instance,
+							 NULL);
+}
+
+
+/* Default CoAP Handler */
+static void coap_default_handler(void *p_context, otCoapHeader *p_header, otMessage *p_message,
+                                 const otMessageInfo *p_message_info)
+{
+	(void)p_context;
+	(void)p_header;
+	(void)p_message;
+	(void)p_message_info;
+
+	NRF_LOG_INFO("Received CoAP message that does not match any request or resource\r\n");
+}
+
+
+/* Counters resources request handling: GET reads the counters, DELETE clears
+   them. Multicast requests are ignored. */
+static void counters_request_handle(void                * p_context,
+                                    otCoapHeader        * p_header,
+                                    const otMessageInfo * p_message_info,
+                                    counters_read_t       read,
+                                    counters_reset_t      reset)
+{
+    otError      error = OT_ERROR_NO_BUFS;
+    otCoapHeader header;
+    otMessage  * p_response = NULL;
+    uint8_t      payload[STATS_REPORT_MAX];
+    uint16_t     length = 0;
+    otCoapCode   code;
+
+    if ((otCoapHeaderGetType(p_header) != OT_COAP_TYPE_CONFIRMABLE &&
+         otCoapHeaderGetType(p_header) != OT_COAP_TYPE_NON_CONFIRMABLE) ||
+        (0xFF == p_message_info->mSockAddr.mFields.m8[0]))
+    {
+        return;
+    }
+
+    if (otCoapHeaderGetCode(p_header) == OT_COAP_CODE_GET)
+    {
+        length = read(p_header, payload, sizeof(payload));
+        code = OT_COAP_CODE_CONTENT;
+    }
+    else if (otCoapHeaderGetCode(p_header) == OT_COAP_CODE_DELETE)
+    {
+        reset();
+        code = OT_COAP_CODE_DELETED;
+    }
+    else
+    {
+        return;
+    }
 
     do
     {
-        otCoapHeaderInit(&header, OT_COAP_TYPE_NON_CONFIRMABLE, OT_COAP_CODE_GET);
-        otCoapHeaderGenerateToken(&header, 2);
-        otCoapHeaderAppendUriPathOptions(&header, "provisioning");
+        otCoapHeaderInit(&header,
+                         (otCoapHeaderGetType(p_header) == OT_COAP_TYPE_CONFIRMABLE) ?
+                         OT_COAP_TYPE_ACKNOWLEDGMENT : OT_COAP_TYPE_NON_CONFIRMABLE,
+                         code);
+        otCoapHeaderSetMessageId(&header, otCoapHeaderGetMessageId(p_header));
+        otCoapHeaderSetToken(&header, otCoapHeaderGetToken(p_header), otCoapHeaderGetTokenLength(p_header));
+        if (length > 0)
+        {
+            otCoapHeaderSetPayloadMarker(&header);
+        }
+
+        p_response = otCoapNewMessage(p_context, &header);
+        if (p_response == NULL)
+        {
+            break;
+        }
 
-        p_request = otCoapNewMessage(p_instance, &header);
-        if (p_request == NULL)
+        error = otMessageAppend(p_response, payload, length);
+        if (error != OT_ERROR_NONE)
         {
             break;
         }
 
-        memset(&aMessageInfo, 0, sizeof(aMessageInfo));
-        aMessageInfo.mInterfaceId = OT_NETIF_INTERFACE_ID_THREAD;
-        aMessageInfo.mPeerPort = OT_DEFAULT_COAP_PORT;
-        otIp6AddressFromString("FF03::1", &aMessageInfo.mPeerAddr);
+        error = otCoapSendResponse(p_context, p_response, p_message_info);
 
-        error = otCoapSendRequest(p_instance,
-                                  p_request,
-                                  &aMessageInfo,
-                                  provisioning_response_handler,
-                                  p_instance);
     } while (false);
 
-    if (error != OT_ERROR_NONE && p_request != NULL)
+    if (error != OT_ERROR_NONE && p_response != NULL)
     {
-        otMessageFree(p_request);
+        otMessageFree(p_response);
     }
 }
 
 
-/* Default CoAP Handler */
-static void coap_default_handler(void *p_context, otCoapHeader *p_header, otMessage *p_message,
-                                 const otMessageInfo *p_message_info)
+/* Network diagnostics snapshot: "?delta" reads the changes since the previous delta read */
+static uint16_t diag_read(otCoapHeader * p_header, uint8_t * p_payload, uint16_t size)
+{
+	return net_diag_snapshot(&m_diag, net_diag_request_mode(p_header), p_payload, size);
+}
+
+
+/* Restart the counts of the network diagnostics */
+static void diag_reset(void)
+{
+	net_diag_reset(&m_diag);
+}
+
+
+/* Network diagnostics request handler */
+static void diag_request_handler(void                * p_context,
+                                 otCoapHeader        * p_header,
+                                 otMessage           * p_message,
+                                 const otMessageInfo * p_message_info)
+{
+    (void)p_message;
+
+    counters_request_handle(p_context, p_header, p_message_info, diag_read, diag_reset);
+}
+
+
+#if PERF_ENABLED
+/* Text report of the execution time counters */
+static uint16_t stats_read(otCoapHeader * p_header, uint8_t * p_payload, uint16_t size)
 {
-	(void)p_context;
 	(void)p_header;
-	(void)p_message;
-	(void)p_message_info;
 
-	NRF_LOG_INFO("Received CoAP message that does not match any request or resource\r\n");
+	return perf_report(m_perf_counters, sizeof(m_perf_counters) / sizeof(m_perf_counters[0]), (char *)p_payload, size);
+}
+
+
+/* Clear the execution time counters */
+static void stats_reset(void)
+{
+	uint8_t i;
+
+	for (i = 0; i < (sizeof(m_perf_counters) / sizeof(m_perf_counters[0])); i++)
+	{
+		perf_reset(m_perf_counters[i]);
+	}
 }
 
 
+/* Execution time counters request handler */
+static void stats_request_handler(void                * p_context,
+                                  otCoapHeader        * p_header,
+                                  otMessage           * p_message,
+                                  const otMessageInfo * p_message_info)
+{
+    (void)p_message;
+
+    counters_request_handle(p_context, p_header, p_message_info, stats_read, stats_reset);
+}
+#endif
+
+
 /* State change handling */
 static void role_change_handler(void * p_context, otDeviceRole role)
 {
     switch(role)
     {
         case OT_DEVICE_ROLE_CHILD:
+#ifdef LIGHT_CLIENT_SYSTEM_OFF
+            /* the child is back: send the press that woke the remote */
+            m_wake.attached = true;
+            system_off_wake_send();
+#endif
+            /* fall through */
         case OT_DEVICE_ROLE_ROUTER:
         case OT_DEVICE_ROLE_LEADER:
+#ifdef PREWARM_ENABLED
+            /* first attach since the boot: set up the routes to the restored lights */
+            if (false == m_prewarm.done)
+            {
+                m_prewarm.done = true;
+                prewarm_next();
+#ifdef DISCOVERY_ENABLED
+                /* nothing restored: look for the lights */
+                if (0 == m_bindings.saved_lights_num)
+                {
+                    discovery_start();
+                }
+#endif
+            }
+#endif
             break;
 
         case OT_DEVICE_ROLE_DISABLED:
         case OT_DEVICE_ROLE_DETACHED:
         default:
-            m_app.peer_address = m_unspecified_ipv6;
+            /* the binding is kept: the mesh-local EID of the peer does not change
+               across partitions and reboots */
             break;
     }
 }
@@ -502,18 +2839,53 @@ static void state_changed_callback(uint32_t flags, void * p_context)
         role_change_handler(p_context, otThreadGetDeviceRole(p_context));
     }
 
-    if (flags & OT_CHANGED_THREAD_PARTITION_ID)
-    {
-        m_app.peer_address = m_unspecified_ipv6;
-    }
-
     NRF_LOG_INFO("State changed! Flags: 0x%08x Current role: %d\r\n", flags, otThreadGetDeviceRole(p_context));
 }
 
 
-/* Buttons event handler */
-static void bsp_event_handler(bsp_event_t event)
+/* Start a light ramp on a long press */
+static void ramp_start(uint8_t direction)
+{
+	m_app.ramp_direction = direction;
+	m_app.ramp_start = otPlatAlarmGetNow();
+
+	command_send(REQUEST_RESOURCE_RAMP, direction);
+}
+
+
+/* Stop the light ramp when the button is released */
+static void ramp_stop(void)
+{
+	uint32_t delta;
+
+	command_send(REQUEST_RESOURCE_RAMP, RAMP_STOP);
+
+	/* follow the level reached by the lights, so the next steps start from there */
+	delta = ((otPlatAlarmGetNow() - m_app.ramp_start) * 100) / RAMP_FULL_SCALE_TIME;
+	if (RAMP_UP == m_app.ramp_direction)
+	{
+		m_app.multicast_dim_value = (delta < (uint32_t)(100 - m_app.multicast_dim_value)) ?
+											 (m_app.multicast_dim_value + delta) : 100;
+	}
+	else
+	{
+		m_app.multicast_dim_value = (delta < m_app.multicast_dim_value) ?
+											 (m_app.multicast_dim_value - delta) : 0;
+	}
+	bindings_changed();
+
+	m_app.ramp_direction = RAMP_STOP;
+}
+
+
+/* Buttons event processing, in the main loop */
+static void button_event_process(bsp_event_t event)
 {
+#ifdef LIGHT_CLIENT_SED
+    /* the press woke the remote: poll fast to get the responses */
+    sed_fast_poll_start();
+#endif
+
     switch (event)
     {
         case BSP_EVENT_KEY_0:
@@ -523,6 +2895,7 @@ static void bsp_event_handler(bsp_event_t event)
 					provisioning_enable_req = false;
 					/* remove peer address */
 					m_app.peer_address = m_unspecified_ipv6;
+					bindings_changed();
 				}
 				else
 				{
@@ -532,75 +2905,355 @@ static void bsp_event_handler(bsp_event_t event)
 				}
             break;
 
-        case BSP_EVENT_KEY_1:
-            /* if peer address is valid */
-            if (!otIp6IsAddressEqual(&m_app.peer_address, &m_unspecified_ipv6))
-            {
-					/* send unicast light toggle request */
-            	unicast_light_request_send(m_app.p_ot_instance, LIGHT_TOGGLE);
-            }
-				else
-				{
-					/* send multicast light toggle request */
-					multicast_light_request_send(m_app.p_ot_instance, LIGHT_TOGGLE);
-				}
-            break;
+        case BSP_EVENT_KEY_1:
+				/* send light toggle request */
+				command_send(REQUEST_RESOURCE_LIGHT, LIGHT_TOGGLE);
+            break;
+
+        case BSP_EVENT_KEY_2:
+            /* release after a long press: the ramp did the dimming */
+				if(RAMP_STOP != m_app.ramp_direction)
+				{
+					ramp_stop();
+				}
+            /* decrement dimming value: a ramp may have left it off the 10 steps */
+				else if(m_app.multicast_dim_value > 0)
+				{
+					m_app.multicast_dim_value = (m_app.multicast_dim_value > 10) ? (m_app.multicast_dim_value - 10) : 0;
+					bindings_changed();
+					/* send dimming value */
+					command_send(REQUEST_RESOURCE_DIM, m_app.multicast_dim_value);
+				}
+            break;
+
+        case BSP_EVENT_KEY_3:
+				if(RAMP_STOP != m_app.ramp_direction)
+				{
+					ramp_stop();
+				}
+            /* increment dimming value */
+				else if(m_app.multicast_dim_value < 100)
+				{
+					m_app.multicast_dim_value = (m_app.multicast_dim_value < 90) ? (m_app.multicast_dim_value + 10) : 100;
+					bindings_changed();
+					/* send dimming value */
+					command_send(REQUEST_RESOURCE_DIM, m_app.multicast_dim_value);
+				}
+            break;
+
+        case BSP_EVENT_RAMP_DOWN:
+				/* long press: dim down until release */
+				ramp_start(RAMP_DOWN);
+            break;
+
+        case BSP_EVENT_RAMP_UP:
+				/* long press: dim up until release */
+				ramp_start(RAMP_UP);
+            break;
+
+        default:
+            return; // no implementation needed
+    }
+}
+
+
+/* Buttons event handler: runs in interrupt context, so the event is only
+   posted to the main loop where the requests are sent */
+static void bsp_event_handler(bsp_event_t event)
+{
+	(void)event_queue_post(&m_events, APP_EVENT_BUTTON, (uint8_t)event, 0);
+}
+
+
+/* function to process the events posted by the interrupt handlers */
+static void events_process(void)
+{
+	static uint32_t overflows = 0;
+	event_t         event;
+
+	while (true == event_queue_get(&m_events, &event))
+	{
+		switch (event.type)
+		{
+			case APP_EVENT_BUTTON:
+				button_event_process((bsp_event_t)event.param);
+				break;
+
+#ifdef LIGHT_CLIENT_SED
+			case APP_EVENT_FAST_POLL_END:
+				/* keep polling fast while requests wait for their responses */
+				if ((m_scheduler.outstanding > 0) || (m_scheduler.queue_count > 0))
+				{
+					sed_fast_poll_start();
+				}
+#ifdef LIGHT_CLIENT_SYSTEM_OFF
+				/* give the attach some time, then power off anyway */
+				else if ((true == m_wake.pending) && (otPlatAlarmGetNow() < SYSTEM_OFF_ATTACH_TIMEOUT))
+				{
+					sed_fast_poll_start();
+				}
+				/* after a power on stay awake until the first attach: a remote powered
+				   off before it joins could only join while a button is held */
+				else if ((false == m_wake.from_off) && (false == m_wake.attached) &&
+						 (otPlatAlarmGetNow() < SYSTEM_OFF_FIRST_ATTACH_TIMEOUT))
+				{
+					sed_fast_poll_start();
+				}
+				else
+				{
+					system_off_enter();
+				}
+#else
+				else if (true == m_prewarm.active)
+				{
+					sed_fast_poll_start();
+				}
+				else
+				{
+					(void)otLinkSetPollPeriod(m_app.p_ot_instance, SED_POLL_PERIOD);
+					m_fast_poll = false;
+				}
+#endif
+				break;
+#endif
+
+			case APP_EVENT_BINDINGS_SAVE:
+				bindings_save();
+				break;
+
+#ifdef DISCOVERY_ENABLED
+			case APP_EVENT_DISCOVERY_TICK:
+				discovery_tick();
+				break;
+#endif
+
+			default:
+				break;
+		}
+	}
+
+	/* the counter belongs to the producer: only read it */
+	if (m_events.overflows != overflows)
+	{
+		overflows = m_events.overflows;
+		NRF_LOG_WARNING("events lost: %d\r\n", overflows);
+	}
+}
+
+
+#ifdef LIGHT_CLIENT_SED
+/* function to poll the parent fast for a while, so the responses waiting
+   there are received within SED_FAST_POLL_PERIOD */
+static void sed_fast_poll_start(void)
+{
+	if (false == m_fast_poll)
+	{
+		(void)otLinkSetPollPeriod(m_app.p_ot_instance, SED_FAST_POLL_PERIOD);
+		m_fast_poll = true;
+	}
+
+	app_timer_stop(m_poll_timer);
+	APP_ERROR_CHECK(app_timer_start(m_poll_timer, APP_TIMER_TICKS(SED_FAST_POLL_TIME), NULL));
+}
+
+
+/* Fast poll timer handler */
+static void sed_poll_timer_handler(void * p_context)
+{
+	(void)p_context;
+
+	(void)event_queue_post(&m_events, APP_EVENT_FAST_POLL_END, 0, 0);
+}
+#endif
+
+
+#ifdef LIGHT_CLIENT_SYSTEM_OFF
+/* function to power off until a button is pressed. RAM is lost: OpenThread
+   keeps the network and child data in its settings, so only the time since
+   the last activity matters here */
+static void system_off_enter(void)
+{
+	uint8_t i;
+
+	NRF_LOG_INFO("System OFF\r\n");
+	LEDS_OFF(LEDS_MASK);
+
+	/* RAM is lost: write the changes now */
+	bindings_save();
+
+	/* the pressed button is latched and wakes the chip with a reset */
+	for (i = 0; i < BUTTONS_NUMBER; i++)
+	{
+		nrf_gpio_cfg_sense_input(m_button_pins[i], BUTTON_PULL, NRF_GPIO_PIN_SENSE_LOW);
+	}
+	NRF_P0->LATCH = NRF_P0->LATCH;
+
+	NRF_POWER->SYSTEMOFF = 1;
+	/* with a debugger attached System OFF is emulated: wait here */
+	__DSB();
+	while (true)
+	{
+		__WFE();
+	}
+}
+
+
+/* function to find the button that woke the remote from System OFF. The press
+   is sent as soon as the child is restored. */
+static void system_off_wake(void)
+{
+	uint8_t i;
+
+	if (0 != (NRF_POWER->RESETREAS & POWER_RESETREAS_OFF_Msk))
+	{
+		NRF_POWER->RESETREAS = POWER_RESETREAS_OFF_Msk;
+		m_wake.from_off = true;
+
+		for (i = 0; i < BUTTONS_NUMBER; i++)
+		{
+			if ((0 != (NRF_P0->LATCH & (1UL << m_button_pins[i]))) || (0 == nrf_gpio_pin_read(m_button_pins[i])))
+			{
+				m_wake.pending = true;
+				m_wake.event = (bsp_event_t)(BSP_EVENT_KEY_0 + i);
+				break;
+			}
+		}
+		NRF_P0->LATCH = NRF_P0->LATCH;
+	}
+
+	/* stay awake for the attach, the press and the responses */
+	sed_fast_poll_start();
+
+	if (OT_DEVICE_ROLE_CHILD == otThreadGetDeviceRole(m_app.p_ot_instance))
+	{
+		m_wake.attached = true;
+		system_off_wake_send();
+	}
+}
+
+
+/* function to send the press that woke the remote. The RTC starts at the
+   reset, so the alarm time is the time since the wake. */
+static void system_off_wake_send(void)
+{
+	if (false == m_wake.pending)
+	{
+		return;
+	}
+	m_wake.pending = false;
+	m_wake.attach_time = otPlatAlarmGetNow();
+
+	button_event_process(m_wake.event);
+
+	m_wake.send_time = otPlatAlarmGetNow();
+	NRF_LOG_INFO("wake to attach %d ms, wake to send %d ms\r\n", m_wake.attach_time, m_wake.send_time);
+}
+#endif
+
+
+/* function to sleep until the next interrupt when no work is left. An interrupt
+   that comes after the check sets the event register, so the wait returns at
+   once and its work is done in the next loop: no wake-up is lost. */
+static void idle_sleep(void)
+{
+	uint32_t start;
+
+	if (true == otTaskletsArePending(m_app.p_ot_instance))
+	{
+		return;
+	}
+
+#if (__FPU_USED == 1)
+	__set_FPSCR(__get_FPSCR() & ~(FPU_EXCEPTION_MASK));
+	(void)__get_FPSCR();
+	NVIC_ClearPendingIRQ(FPU_IRQn);
+#endif
+
+	start = otPlatAlarmGetNow();
+	(void)sd_app_evt_wait();
+
+	/* ms differences add up to the sleep time on average, short sleeps included */
+	m_power.sleep_time += otPlatAlarmGetNow() - start;
+	m_power.sleeps++;
+}
+
+
+#ifdef CLI_ENABLED
+/* CLI command to show or reset the power counters */
+static void cli_power_command(int argc, char * argv[])
+{
+	uint32_t uptime = otPlatAlarmGetNow() - m_power.start;
+
+	if ((argc == 1) && (0 == strcmp(argv[0], "reset")))
+	{
+		memset(&m_power, 0, sizeof(m_power));
+		m_power.start = otPlatAlarmGetNow();
+	}
+	else if (argc == 0)
+	{
+		otCliUartOutputFormat("time %lu ms active %lu ms sleep %lu ms (%lu%%) sleeps %lu\r\n",
+									 uptime, uptime - m_power.sleep_time, m_power.sleep_time,
+									 (uptime > 0) ? (uint32_t)(((uint64_t)m_power.sleep_time * 100) / uptime) : 0,
+									 m_power.sleeps);
+#ifdef LIGHT_CLIENT_SYSTEM_OFF
+		otCliUartOutputFormat("wake to attach %lu ms wake to send %lu ms\r\n", m_wake.attach_time, m_wake.send_time);
+#endif
+	}
+	else
+	{
+		otCliUartAppendResult(OT_ERROR_INVALID_ARGS);
+		return;
+	}
+
+	otCliUartAppendResult(OT_ERROR_NONE);
+}
 
-        case BSP_EVENT_KEY_2:
-            /* decrement dimming value */
-				if(m_app.multicast_dim_value > 0)
-				{
-					m_app.multicast_dim_value -= 10;
-				}
-	         /* if peer address is valid */
-	         if (!otIp6IsAddressEqual(&m_app.peer_address, &m_unspecified_ipv6))
-	         {
-					/* send unicast dimming value */
-	        		unicast_dim_request_send(m_app.p_ot_instance, m_app.multicast_dim_value);
-	         }
-				else
-				{
-					/* send multicast dimming value */
-					multicast_dim_request_send(m_app.p_ot_instance, m_app.multicast_dim_value);
-				}
-            break;
 
-        case BSP_EVENT_KEY_3:
-            /* increment dimming value */
-				if(m_app.multicast_dim_value < 100)
-				{
-					m_app.multicast_dim_value += 10;
-				}
-				/* if peer address is valid */
-				if (!otIp6IsAddressEqual(&m_app.peer_address, &m_unspecified_ipv6))
-	         {
-					/* send unicast dimming value */
-	        		unicast_dim_request_send(m_app.p_ot_instance, m_app.multicast_dim_value);
-	         }
-				else
-				{
-					/* send multicast dimming value */
-					multicast_dim_request_send(m_app.p_ot_instance, m_app.multicast_dim_value);
-				}
-            break;
+#if PERF_ENABLED
+/* CLI command to show or clear the execution time counters: stats | stats reset */
+static void cli_stats_command(int argc, char * argv[])
+{
+	char report[STATS_REPORT_MAX];
 
-        default:
-            return; // no implementation needed
-    }
+	if (argc == 0)
+	{
+		(void)perf_report(m_perf_counters, sizeof(m_perf_counters) / sizeof(m_perf_counters[0]), report, sizeof(report));
+		otCliUartOutputFormat("%s", report);
+	}
+	else if ((argc == 1) && (0 == strcmp(argv[0], "reset")))
+	{
+		stats_reset();
+	}
+	else
+	{
+		otCliUartAppendResult(OT_ERROR_INVALID_ARGS);
+		return;
+	}
+
+	otCliUartAppendResult(OT_ERROR_NONE);
 }
+#endif
+#endif
 
 
 /* Thread Initialization */
 static void thread_init(void)
 {
     otInstance *p_instance;
+#ifdef LIGHT_CLIENT_SED
+    otLinkModeConfig mode = { .mRxOnWhenIdle = false, .mSecureDataRequests = true,
+                              .mDeviceType = false, .mNetworkData = false };
+#endif
 
     PlatformInit(0, NULL);
 
     p_instance = otInstanceInit();
     assert(p_instance);
 
+#ifdef CLI_ENABLED
     otCliUartInit(p_instance);
+    otCliUartSetUserCommands(m_cli_commands, sizeof(m_cli_commands) / sizeof(m_cli_commands[0]));
+#endif
 
     NRF_LOG_INFO("Thread version: %s\r\n", (uint32_t)otGetVersionString());
     NRF_LOG_INFO("Network name:   %s\r\n", (uint32_t)otThreadGetNetworkName(p_instance));
@@ -613,11 +3266,41 @@ static void thread_init(void)
         assert(otLinkSetPanId(p_instance, THREAD_PANID) == OT_ERROR_NONE);
     }
 
+#ifdef LIGHT_CLIENT_SED
+    /* minimal end device: receiver off when idle, data polls to the parent */
+    assert(otThreadSetLinkMode(p_instance, mode) == OT_ERROR_NONE);
+    (void)otLinkSetPollPeriod(p_instance, SED_POLL_PERIOD);
+#endif
+#ifdef LIGHT_CLIENT_SYSTEM_OFF
+    otThreadSetChildTimeout(p_instance, SYSTEM_OFF_CHILD_TIMEOUT);
+#endif
+
+    m_app.p_ot_instance = p_instance;
+
     assert(otIp6SetEnabled(p_instance, true) == OT_ERROR_NONE);
+#ifdef CHANNEL_SCAN_ENABLED
+    /* first start: Thread is started once the channel is chosen */
+    if ((!otDatasetIsCommissioned(p_instance)) &&
+        (channel_scan_start(&m_channel_scan, p_instance, THREAD_PANID, THREAD_CHANNEL, channel_scan_done) == OT_ERROR_NONE))
+    {
+        return;
+    }
+#endif
     assert(otThreadSetEnabled(p_instance, true) == OT_ERROR_NONE);
+}
 
-    m_app.p_ot_instance = p_instance;
+
+#ifdef CHANNEL_SCAN_ENABLED
+/* Channel selection end: start Thread on the chosen channel */
+static void channel_scan_done(channel_scan_t * p_scan)
+{
+    NRF_LOG_INFO("channel scan: %s channel %d after %d ms\r\n",
+                 p_scan->network_found ? "network found on" : "forming on", p_scan->channel, p_scan->duration);
+
+    (void)otLinkSetChannel(p_scan->p_instance, p_scan->channel);
+    (void)otThreadSetEnabled(p_scan->p_instance, true);
 }
+#endif
 
 
 /* CoAp init */
@@ -625,6 +3308,18 @@ static void coap_init(void)
 {
     assert(otCoapStart(m_app.p_ot_instance, OT_DEFAULT_COAP_PORT) == OT_ERROR_NONE);
     otCoapSetDefaultHandler(m_app.p_ot_instance, coap_default_handler, NULL);
+    m_diag_resource.mContext = m_app.p_ot_instance;
+    assert(otCoapAddResource(m_app.p_ot_instance, &m_diag_resource) == OT_ERROR_NONE);
+    net_diag_init(&m_diag, m_app.p_ot_instance, m_diag_counters, sizeof(m_diag_counters) / sizeof(m_diag_counters[0]));
+#if PERF_ENABLED
+    m_stats_resource.mContext = m_app.p_ot_instance;
+    assert(otCoapAddResource(m_app.p_ot_instance, &m_stats_resource) == OT_ERROR_NONE);
+#endif
+
+    request_templates_init();
+#ifdef DISCOVERY_ENABLED
+    discovery_init();
+#endif
 }
 
 
@@ -633,6 +3328,21 @@ static void timer_init(void)
 {
     uint32_t err_code = app_timer_init();
     APP_ERROR_CHECK(err_code);
+
+    err_code = app_timer_create(&m_bindings_timer, APP_TIMER_MODE_SINGLE_SHOT, bindings_timer_handler);
+    APP_ERROR_CHECK(err_code);
+
+#ifdef DISCOVERY_ENABLED
+    err_code = app_timer_create(&m_discovery_timer, APP_TIMER_MODE_REPEATED, discovery_timer_handler);
+    APP_ERROR_CHECK(err_code);
+    err_code = app_timer_start(m_discovery_timer, APP_TIMER_TICKS(DISCOVERY_TICK_INTERVAL), NULL);
+    APP_ERROR_CHECK(err_code);
+#endif
+
+#ifdef LIGHT_CLIENT_SED
+    err_code = app_timer_create(&m_poll_timer, APP_TIMER_MODE_SINGLE_SHOT, sed_poll_timer_handler);
+    APP_ERROR_CHECK(err_code);
+#endif
 }
 
 
@@ -650,80 +3360,507 @@ static void thread_bsp_init(void)
     uint32_t err_code = bsp_init(BSP_INIT_LED | BSP_INIT_BUTTONS, bsp_event_handler);
     APP_ERROR_CHECK(err_code);
 
+    /* hold-to-dim: a long press starts a ramp, the release stops it. The dimming
+       step of a short press is sent on the release, so a ramp starts without a jump */
+    err_code = bsp_event_to_button_action_assign(2, BSP_BUTTON_ACTION_PUSH, BSP_EVENT_NOTHING);
+    APP_ERROR_CHECK(err_code);
+    err_code = bsp_event_to_button_action_assign(3, BSP_BUTTON_ACTION_PUSH, BSP_EVENT_NOTHING);
+    APP_ERROR_CHECK(err_code);
+    err_code = bsp_event_to_button_action_assign(2, BSP_BUTTON_ACTION_LONG_PUSH, BSP_EVENT_RAMP_DOWN);
+    APP_ERROR_CHECK(err_code);
+    err_code = bsp_event_to_button_action_assign(3, BSP_BUTTON_ACTION_LONG_PUSH, BSP_EVENT_RAMP_UP);
+    APP_ERROR_CHECK(err_code);
+    err_code = bsp_event_to_button_action_assign(2, BSP_BUTTON_ACTION_RELEASE, BSP_EVENT_KEY_2);
+    APP_ERROR_CHECK(err_code);
+    err_code = bsp_event_to_button_action_assign(3, BSP_BUTTON_ACTION_RELEASE, BSP_EVENT_KEY_3);
+    APP_ERROR_CHECK(err_code);
+
     err_code = bsp_thread_init(m_app.p_ot_instance);
     APP_ERROR_CHECK(err_code);
 }
 
 #ifdef UART_CHANNEL_ENABLED
+/* function to arm the UART receiver with free chunks: one being filled and one
+   ready for the driver to switch to without losing bytes (double buffering).
+   Called from the UART interrupt or from the main loop with interrupts masked. */
+static void uart_rx_arm(void)
+{
+	uint8_t index;
+
+	while ((m_uart_rx.armed < UART_RX_ARMED_CHUNKS) &&
+			 ((uint8_t)(m_uart_rx.next_arm - m_uart_rx.consumed) < UART_RX_CHUNKS_NUM))
+	{
+		index = m_uart_rx.next_arm % UART_RX_CHUNKS_NUM;
+		if (nrf_drv_uart_rx(&m_uart, m_uart_rx.data[index], UART_RX_CHUNK_SIZE) != NRF_SUCCESS)
+		{
+			break;
+		}
+		m_uart_rx.next_arm++;
+		m_uart_rx.armed++;
+	}
+}
+
+
+/* function to get the commands the host can send: room in the request queue
+   and message buffers above the reserve of the in-flight requests */
+static uint16_t uart_flow_credit(void)
+{
+	otBufferInfo buffer_info;
+	uint16_t     queue_credit;
+	uint16_t     buffer_credit = 0;
+
+	otMessageGetBufferInfo(m_app.p_ot_instance, &buffer_info);
+
+	queue_credit = REQUEST_QUEUE_SIZE - m_scheduler.queue_count;
+	if (queue_credit > UART_FLOW_MIN_FREE_REQUESTS)
+	{
+		queue_credit -= UART_FLOW_MIN_FREE_REQUESTS;
+	}
+	else
+	{
+		queue_credit = 0;
+	}
+
+	if (buffer_info.mFreeBuffers > UART_FLOW_MIN_FREE_BUFFERS)
+	{
+		buffer_credit = buffer_info.mFreeBuffers - UART_FLOW_MIN_FREE_BUFFERS;
+	}
+
+	return (queue_credit < buffer_credit) ? queue_credit : buffer_credit;
+}
+
+
+/* function to pause or resume the parsing of the received commands and to report
+   the credit to the host when it changes or periodically */
+static void uart_flow_update(void)
+{
+	uint16_t credit = uart_flow_credit();
+	uint32_t now = otPlatAlarmGetNow();
+	uint16_t change;
+
+	if ((0 == credit) && (false == m_uart_flow.throttled))
+	{
+		m_uart_flow.pauses++;
+	}
+	m_uart_flow.throttled = (0 == credit);
+
+	change = (credit > m_uart_flow.credit) ? (credit - m_uart_flow.credit) : (m_uart_flow.credit - credit);
+
+	if ((change >= UART_CREDIT_HYSTERESIS) ||
+		 ((credit != m_uart_flow.credit) && ((0 == credit) || (0 == m_uart_flow.credit))) ||
+		 ((now - m_uart_flow.credit_time) >= UART_CREDIT_INTERVAL))
+	{
+		m_uart_flow.credit = credit;
+		m_uart_flow.credit_time = now;
+		uart_event_send(REQUEST_ID_NONE, REQUEST_EVENT_CREDIT, (otError)m_scheduler.outstanding, credit);
+	}
+}
+
+
 /* function to manage UART data */
 static void manageUART( void )
 {
-	/* if data are received */
-	if(true == data_received)
+	uart_flow_update();
+
+	/* parse the chunks completed by the receiver, in order */
+	while ((m_uart_rx.consumed != m_uart_rx.filled) && (false == m_uart_flow.throttled))
+	{
+		if (UART_MODE_BINARY == m_uart_mode)
+		{
+			cmd_frame_feed(&m_cmd_frame,
+								m_uart_rx.data[m_uart_rx.consumed % UART_RX_CHUNKS_NUM],
+								m_uart_rx.length[m_uart_rx.consumed % UART_RX_CHUNKS_NUM]);
+		}
+		else
+		{
+			cmd_parser_feed(&m_cmd_parser,
+								 m_uart_rx.data[m_uart_rx.consumed % UART_RX_CHUNKS_NUM],
+								 m_uart_rx.length[m_uart_rx.consumed % UART_RX_CHUNKS_NUM]);
+		}
+
+		m_uart_rx.consumed++;
+		uart_flow_update();
+	}
+
+	/* the receiver stops when all the chunks are waiting to be processed: the
+	   UARTE then deasserts RTS and the host holds the next bytes back */
+	if (m_uart_rx.armed < UART_RX_ARMED_CHUNKS)
 	{
-		/* clear data received flag */
-		data_received = false;
+		CRITICAL_REGION_ENTER();
+		uart_rx_arm();
+		CRITICAL_REGION_EXIT();
+	}
+}
 
-		/* ATTENTION: brutal compare of JSON string... temporary code... */
-		if(0 == memcmp(data_buffer, "{\"command\":[{\"light\":\"on\"}]}", buffer_depth))
+
+/* function to send a light command to the destination of a UART command:
+   the target light, a group of lights or all the lights */
+static void uart_command_send(const cmd_t * p_cmd, request_resource_t resource, uint8_t value)
+{
+	light_set_t  targets;
+	otIp6Address address;
+	int16_t      index;
+
+	memset(&targets, 0, sizeof(targets));
+
+	if (p_cmd->fields & (CMD_FIELD_TARGET | CMD_FIELD_ADDRESS))
+	{
+		if (p_cmd->fields & CMD_FIELD_ADDRESS)
 		{
-			/* send a multi light request to turn lights on */
-			multicast_light_request_send(m_app.p_ot_instance, LIGHT_ON);	
+			memcpy(address.mFields.m8, p_cmd->address, sizeof(address.mFields.m8));
 		}
-		else if(0 == memcmp(data_buffer, "{\"command\":[{\"light\":\"off\"}]}", buffer_depth))
+		else if (otIp6AddressFromString(p_cmd->target, &address) != OT_ERROR_NONE)
 		{
-			/* send a multi light request to turn lights off */
-			multicast_light_request_send(m_app.p_ot_instance, LIGHT_OFF);	
+			return;
 		}
-		else
+
+		index = light_find(&address);
+		if (index < 0)
+		{
+			index = light_add(&address, LIGHT_RLOC16_INVALID);
+		}
+
+		if (index < 0)
+		{
+			/* no room in the lights table: unicast straight to the light */
+			if (true == request_submit(resource, &address, value, m_scheduler.request_id))
+			{
+				request_schedule();
+			}
+			return;
+		}
+
+		targets.mask[index / 32] |= (1UL << (index % 32));
+	}
+	else if (p_cmd->fields & CMD_FIELD_GROUP)
+	{
+		if (p_cmd->group < LIGHT_GROUPS_NUM)
 		{
-			/* do nothing */
+			multicast_request_send(resource, value, REQUEST_DESTINATION_GROUP_0 + p_cmd->group);
 		}
+		return;
+	}
+	else
+	{
+		targets.all = true;
+	}
+
+	dispatch_command(resource, value, &targets);
+}
+
+
+/* function to execute a command parsed from the UART channel */
+static void uart_command_handler(const cmd_t * p_cmd, void * p_context)
+{
+	(void)p_context;
+
+	if (NULL == p_cmd)
+	{
+		uart_event_send(REQUEST_ID_NONE, REQUEST_EVENT_DISCARDED, OT_ERROR_PARSE, 0);
+		return;
+	}
+
+	/* the requests of the command carry its id */
+	m_scheduler.request_id = (p_cmd->fields & CMD_FIELD_ID) ? p_cmd->request_id : REQUEST_ID_NONE;
+	request_report(m_scheduler.request_id, REQUEST_EVENT_PARSED, OT_ERROR_NONE, 0);
+
+	if (p_cmd->fields & CMD_FIELD_LIGHT)
+	{
+		/* cmd_light_t values are in light_command_t order */
+		uart_command_send(p_cmd, REQUEST_RESOURCE_LIGHT, (uint8_t)p_cmd->light);
+	}
+
+	if (p_cmd->fields & CMD_FIELD_LEVEL)
+	{
+		uart_command_send(p_cmd, REQUEST_RESOURCE_DIM, p_cmd->level);
+	}
+
+	/* batch pairs are [light id, dim level], ids being the indexes in the lights table */
+	if (p_cmd->fields & CMD_FIELD_BATCH)
+	{
+		batch_request_send(p_cmd->batch,
+								 p_cmd->batch_count,
+								 ((p_cmd->fields & CMD_FIELD_GROUP) && (p_cmd->group < LIGHT_GROUPS_NUM)) ?
+								 (REQUEST_DESTINATION_GROUP_0 + p_cmd->group) : REQUEST_DESTINATION_ALL_LIGHTS);
+	}
+
+	m_scheduler.request_id = REQUEST_ID_NONE;
+
+	/* signal on the board that a message has been received and managed */
+	LEDS_INVERT(BSP_LED_1_MASK);
+}
 
-		/* signal on the board that a message has been received and managed */
-		LEDS_INVERT(BSP_LED_1_MASK);
 
-		/* clear buffer depth */
-		buffer_depth = 0;
+/* UART event handler function */
+static void uart_event_handler(nrf_drv_uart_event_t * p_event, void * p_context)
+{
+	(void)p_context;
+
+	switch (p_event->type)
+	{
+		case NRF_DRV_UART_EVT_RX_DONE:
+			/* hand the chunk to the main loop */
+			m_uart_rx.length[m_uart_rx.filled % UART_RX_CHUNKS_NUM] = p_event->data.rxtx.bytes;
+			/* the length must be in memory before the main loop sees the chunk */
+			__DMB();
+			m_uart_rx.filled++;
+			m_uart_rx.armed--;
+
+			/* a flush drops the secondary chunk: it is armed again as the next one */
+			if (true == m_uart_rx.flushing)
+			{
+				m_uart_rx.flushing = false;
+				m_uart_rx.next_arm = m_uart_rx.filled;
+				m_uart_rx.armed = 0;
+			}
+			uart_rx_arm();
+			break;
+
+		case NRF_DRV_UART_EVT_ERROR:
+			/* the reception stops on errors: keep the received bytes and restart */
+			m_uart_rx.errors++;
+			m_uart_rx.length[m_uart_rx.filled % UART_RX_CHUNKS_NUM] = p_event->data.error.rxtx.bytes;
+			__DMB();
+			m_uart_rx.filled++;
+			m_uart_rx.next_arm = m_uart_rx.filled;
+			m_uart_rx.armed = 0;
+			m_uart_rx.flushing = false;
+			uart_rx_arm();
+			break;
+
+		case NRF_DRV_UART_EVT_TX_DONE:
+			m_uart_tx.tail += m_uart_tx.sending;
+			m_uart_tx.sending = 0;
+			uart_tx_start();
+			break;
+
+		default:
+			break;
 	}
 }
 
 
-/* UART error handler function */
-static void uart_error_handle(app_uart_evt_t * p_event)
+/* UART idle timer handler: the DMA reports a chunk only when it is full, so a
+   line that stays idle for a whole interval after some bytes gets its partial
+   chunk flushed to the main loop */
+static void uart_idle_timer_handler(void * p_context)
 {
-	if(p_event->evt_type == APP_UART_COMMUNICATION_ERROR)
+	(void)p_context;
+
+	if (NRF_UARTE1->EVENTS_RXDRDY)
 	{
-		/* flush the FIFO buffers */
-		app_uart_flush();
-		APP_ERROR_HANDLER(p_event->data.error_communication);
+		NRF_UARTE1->EVENTS_RXDRDY = 0;
+		m_uart_rx.activity = true;
 	}
-	else if(p_event->evt_type == APP_UART_FIFO_ERROR)
+	else if ((true == m_uart_rx.activity) && (m_uart_rx.armed > 0))
 	{
-		/* flush the FIFO buffers */
-		app_uart_flush();
-		APP_ERROR_HANDLER(p_event->data.error_code);
+		m_uart_rx.activity = false;
+		m_uart_rx.flushing = true;
+		nrf_drv_uart_rx_abort(&m_uart);
 	}
-	else if(p_event->evt_type == APP_UART_DATA_READY)
+	else
 	{
-		/* store received byte in the buffer */
-		app_uart_get(&data_buffer[buf_idx]);
-		/* if termination character has been received */
-		if(data_buffer[buf_idx] == '.')
+		/* idle line, nothing left to flush: stop until the next start bit */
+		(void)app_timer_stop(m_uart_idle_timer);
+		nrf_drv_gpiote_in_event_enable(DATA_UART_RX_PIN_NUM, true);
+
+		/* a byte came in before the edge detection was back */
+		if (NRF_UARTE1->EVENTS_RXDRDY)
 		{
-			/* store buffer depth */
-			buffer_depth = buf_idx;
-			/* clear buffer index */
-			buf_idx = 0;
-			/* set flag */
-			data_received = true;
+			uart_rx_line_handler(DATA_UART_RX_PIN_NUM, NRF_GPIOTE_POLARITY_HITOLO);
 		}
-		else
+	}
+}
+
+
+/* UART RX line handler: the first start bit after an idle line starts the idle
+   checks, the edge detection stays off while they run */
+static void uart_rx_line_handler(nrf_drv_gpiote_pin_t pin, nrf_gpiote_polarity_t action)
+{
+	(void)pin;
+	(void)action;
+
+	nrf_drv_gpiote_in_event_disable(DATA_UART_RX_PIN_NUM);
+	(void)app_timer_start(m_uart_idle_timer, APP_TIMER_TICKS(UART_RX_IDLE_INTERVAL), NULL);
+}
+
+
+/* UART init */
+static void uart_init(void)
+{
+	uint32_t err_code;
+	nrf_drv_uart_config_t config = NRF_DRV_UART_DEFAULT_CONFIG;
+	nrf_drv_gpiote_in_config_t rx_line_config = GPIOTE_CONFIG_IN_SENSE_HITOLO(false);
+
+	config.pselrxd = DATA_UART_RX_PIN_NUM;
+	config.pseltxd = DATA_UART_TX_PIN_NUM;
+	config.pselrts = DATA_UART_RTS_PIN_NUM;
+	config.pselcts = DATA_UART_CTS_PIN_NUM;
+	config.hwfc = DATA_UART_HWFC;
+	config.baudrate = DATA_UART_BAUDRATE;
+	config.interrupt_priority = APP_IRQ_PRIORITY_LOWEST;
+	config.use_easy_dma = true;
+
+	/* init UART 1 module */
+	err_code = nrf_drv_uart_init(&m_uart, &config, uart_event_handler);
+	APP_ERROR_CHECK(err_code);
+
+	cmd_parser_init(&m_cmd_parser, uart_command_handler, NULL);
+	cmd_frame_init(&m_cmd_frame, uart_command_handler, NULL);
+
+	uart_rx_arm();
+
+	err_code = app_timer_create(&m_uart_idle_timer, APP_TIMER_MODE_REPEATED, uart_idle_timer_handler);
+	APP_ERROR_CHECK(err_code);
+
+	/* a low power sense of the RX pin, the idle timer runs only while bytes come in */
+	if (false == nrf_drv_gpiote_is_init())
+	{
+		err_code = nrf_drv_gpiote_init();
+		APP_ERROR_CHECK(err_code);
+	}
+	err_code = nrf_drv_gpiote_in_init(DATA_UART_RX_PIN_NUM, &rx_line_config, uart_rx_line_handler);
+	APP_ERROR_CHECK(err_code);
+	nrf_drv_gpiote_in_event_enable(DATA_UART_RX_PIN_NUM, true);
+}
+
+
+/* function to send the next contiguous bytes of the transmit buffer.
+   Called from the UART interrupt or from the main loop with interrupts masked. */
+static void uart_tx_start(void)
+{
+	uint16_t offset = m_uart_tx.tail % UART_TX_BUFFER_SIZE;
+	uint16_t length = (uint16_t)(m_uart_tx.head - m_uart_tx.tail);
+
+	if ((m_uart_tx.sending != 0) || (0 == length))
+	{
+		return;
+	}
+
+	/* the driver takes a linear buffer of up to 255 bytes */
+	if (length > (UART_TX_BUFFER_SIZE - offset))
+	{
+		length = UART_TX_BUFFER_SIZE - offset;
+	}
+	if (length > UINT8_MAX)
+	{
+		length = UINT8_MAX;
+	}
+
+	m_uart_tx.sending = length;
+	if (nrf_drv_uart_tx(&m_uart, &m_uart_tx.data[offset], length) != NRF_SUCCESS)
+	{
+		m_uart_tx.sending = 0;
+	}
+}
+
+
+/* function to queue bytes to send, all or none */
+static void uart_tx_write(const uint8_t * p_data, uint16_t length)
+{
+	uint16_t i;
+
+	if (length > (UART_TX_BUFFER_SIZE - (uint16_t)(m_uart_tx.head - m_uart_tx.tail)))
+	{
+		m_uart_tx.dropped++;
+		return;
+	}
+
+	for (i = 0; i < length; i++)
+	{
+		m_uart_tx.data[(uint16_t)(m_uart_tx.head + i) % UART_TX_BUFFER_SIZE] = p_data[i];
+	}
+	/* the bytes must be in memory before the TX interrupt sees them */
+	__DMB();
+	m_uart_tx.head += length;
+
+	CRITICAL_REGION_ENTER();
+	uart_tx_start();
+	CRITICAL_REGION_EXIT();
+}
+
+
+/* function to send an event to the host in the format of the channel. The
+   value is the RTT of an ack and the credit of a credit event, whose result is
+   the number of requests in flight. */
+static void uart_event_send(uint32_t request_id, request_event_t event, otError result, uint32_t value)
+{
+	uint8_t event_buffer[UART_EVENT_MAX_LENGTH];
+	uint8_t frame[CMD_FRAME_EVENT_LENGTH];
+	int     length;
+
+	if (value > UINT16_MAX)
+	{
+		value = UINT16_MAX;
+	}
+
+	if (UART_MODE_BINARY == m_uart_mode)
+	{
+		if (REQUEST_ID_NONE == request_id)
 		{
-			/* increment buffer index */
-			buf_idx++;
+			request_id = UINT16_MAX;
 		}
+		frame[0] = (uint8_t)request_id;
+		frame[1] = (uint8_t)(request_id >> 8);
+		frame[2] = (uint8_t)event;
+		frame[3] = (uint8_t)result;
+		frame[4] = (uint8_t)value;
+		frame[5] = (uint8_t)(value >> 8);
+		length = cmd_frame_encode(frame, sizeof(frame), event_buffer);
+	}
+	else if (REQUEST_EVENT_CREDIT == event)
+	{
+		length = snprintf((char *)event_buffer, sizeof(event_buffer), "{\"event\":\"%s\",\"credit\":%lu,\"outstanding\":%d}\r\n",
+								m_request_event_names[event], (unsigned long)value, result);
+	}
+	else if (REQUEST_ID_NONE == request_id)
+	{
+		length = snprintf((char *)event_buffer, sizeof(event_buffer), "{\"event\":\"%s\",\"result\":%d}\r\n",
+								m_request_event_names[event], result);
+	}
+	else
+	{
+		length = snprintf((char *)event_buffer, sizeof(event_buffer), "{\"id\":%lu,\"event\":\"%s\",\"result\":%d,\"rtt\":%lu}\r\n",
+								(unsigned long)request_id, m_request_event_names[event], result, (unsigned long)value);
+	}
+
+	if ((length > 0) && (length < (int)sizeof(event_buffer)))
+	{
+		uart_tx_write(event_buffer, (uint16_t)length);
+	}
+}
+
+
+/* CLI command to select the UART channel format and show its counters:
+   uart | uart json | uart binary */
+static void cli_uart_command(int argc, char * argv[])
+{
+	if ((argc == 1) && (0 == strcmp(argv[0], "json")))
+	{
+		m_uart_mode = UART_MODE_JSON;
+		cmd_parser_reset(&m_cmd_parser);
 	}
+	else if ((argc == 1) && (0 == strcmp(argv[0], "binary")))
+	{
+		m_uart_mode = UART_MODE_BINARY;
+		cmd_frame_reset(&m_cmd_frame);
+	}
+	else if (argc == 0)
+	{
+		otCliUartOutputFormat("%s json %lu/%lu binary %lu/%lu crc %lu line errors %lu events dropped %lu\r\n",
+									 (UART_MODE_BINARY == m_uart_mode) ? "binary" : "json",
+									 m_cmd_parser.commands, m_cmd_parser.errors,
+									 m_cmd_frame.commands, m_cmd_frame.errors, m_cmd_frame.crc_errors,
+									 m_uart_rx.errors, m_uart_tx.dropped);
+		otCliUartOutputFormat("credit %d paused %lu\r\n", m_uart_flow.credit, m_uart_flow.pauses);
+	}
+	else
+	{
+		otCliUartAppendResult(OT_ERROR_INVALID_ARGS);
+		return;
+	}
+
+	otCliUartAppendResult(OT_ERROR_NONE);
 }
 #endif
 
@@ -734,46 +3871,41 @@ static void uart_error_handle(app_uart_evt_t * p_event)
 int main(int argc, char *argv[])
 {
 	NRF_LOG_INIT(NULL);
-#ifdef UART_CHANNEL_ENABLED
-	uint32_t err_code;
-	
-	const app_uart_comm_params_t comm_params =
-   {
-       DATA_UART_RX_PIN_NUM, 
-       DATA_UART_TX_PIN_NUM, 
-       DATA_UART_RTS_PIN_NUM, 
-       DATA_UART_CTS_PIN_NUM,
-       APP_UART_FLOW_CONTROL_DISABLED,
-       false,
-       UART_BAUDRATE_BAUDRATE_Baud115200
-   };
-
-	/* init UART 1 module */
-	APP_UART_FIFO_INIT(&comm_params,
-		        			 UART_RX_BUF_SIZE,
-		                UART_TX_BUF_SIZE,
-		                uart_error_handle,
-		                APP_IRQ_PRIORITY_LOWEST,
-		                err_code);
-
-	APP_ERROR_CHECK(err_code);
+	/* the queue is ready before any interrupt source can post to it */
+	event_queue_init(&m_events);
+#if PERF_ENABLED
+	perf_init();
 #endif
 	thread_init();
 	coap_init();
 
 	timer_init();
+#ifdef UART_CHANNEL_ENABLED
+	uart_init();
+#endif
+	m_power.start = otPlatAlarmGetNow();
+	bindings_restore();
 	thread_bsp_init();
 	leds_init();
+#ifdef LIGHT_CLIENT_SYSTEM_OFF
+	system_off_wake();
+#endif
 
 	/* infinite loop */
 	while (true)
 	{
+		/* all the OpenThread calls run here: interrupts only post events */
+		events_process();
 		otTaskletsProcess(m_app.p_ot_instance);
 		PlatformProcessDrivers(m_app.p_ot_instance);
 #ifdef UART_CHANNEL_ENABLED
 		/* call function to manage UART data */
 		manageUART();
 #endif
+		/* send queued requests as the window and the message buffers allow */
+		request_schedule();
+		/* sleep until an interrupt if nothing is left to do */
+		idle_sleep();
 	}
 }
 
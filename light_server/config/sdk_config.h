@@ -898,6 +898,26 @@
 #define THREAD_CHANNEL 11
 #endif
 
+// <q> THREAD_CHANNEL_SCAN  - Channel selection at network formation
+ 
+
+// <i> On the first start, join a network of the PAN ID heard on any channel,
+// <i> or form one on the quietest channel found by an energy scan.
+
+#ifndef THREAD_CHANNEL_SCAN
+#define THREAD_CHANNEL_SCAN 0
+#endif
+
+// <q> PERF_ENABLED  - Execution time counters of the hot paths
+ 
+
+// <i> Count the CPU cycles of the request handlers and send functions with the
+// <i> DWT cycle counter, reported by the stats resource and CLI command.
+
+#ifndef PERF_ENABLED
+#define PERF_ENABLED 0
+#endif
+
 // </h> 
 //==========================================================
 
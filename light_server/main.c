@@ -29,12 +29,18 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include "bsp_thread.h"
 #include "app_timer.h"
 #include "nrf_log.h"
 #include "nrf_log_ctrl.h"
+#include "nrf_soc.h"
 #include "app_pwm.h"
+#include "event_queue.h"
+#include "channel_scan.h"
+#include "perf.h"
+#include "net_diag.h"
 
 #include <openthread/openthread.h>
 #include <openthread/diag.h>
@@ -43,6 +49,8 @@
 #include <openthread/thread_ftd.h>
 #include <openthread/platform/alarm.h>
 #include <openthread/platform/platform.h>
+#include <openthread/platform/random.h>
+#include <openthread/platform/settings.h>
 
 
 
@@ -61,6 +69,106 @@
 /* Provisioning expiry time in ms */
 #define PROVISIONING_EXPIRY_TIME 		5000
 
+/* Realm-local multicast address of the light groups: group id in the last byte */
+#define LIGHT_GROUP_MULTICAST_ADDRESS	"FF03::FC00:0"
+
+/* Number of light groups */
+#define LIGHT_GROUPS_NUM					8
+
+/* Join flag of a group request value, the group id is in the low bits */
+#define LIGHT_GROUP_JOIN_FLAG				0x80
+
+/* Light id not assigned by the controller yet */
+#define LIGHT_ID_NONE						0xFF
+
+/* Batch request formats: (light id, level) pairs, or a level and a bitmask of the light ids */
+#define BATCH_FORMAT_LIST					0
+#define BATCH_FORMAT_MASK					1
+
+/* Light outputs driven by this node, published with the resources */
+#define LIGHT_ENDPOINTS_NUM				1
+
+/* Content format of the discovery responses: application/link-format */
+#define DISCOVERY_CONTENT_FORMAT			40
+
+/* Max time in ms a response to a multicast discovery is delayed, so the answers of
+   many lights are spread instead of colliding */
+#define DISCOVERY_LEISURE					3000
+
+/* Max token length of a discovery request */
+#define DISCOVERY_TOKEN_MAX				8
+
+/* Max length of a discovery response payload */
+#define DISCOVERY_PAYLOAD_MAX				256
+
+/* Sources tracked by the rate limiter: the least recently heard one is replaced */
+#define RATE_SOURCES_NUM					8
+
+/* Commands a source can send in a burst */
+#define RATE_BURST							10
+
+/* Commands per second a source can send on the long run */
+#define RATE_PER_SECOND					20
+
+/* Window in ms after an applied command in which only the newest command is kept */
+#define COALESCE_WINDOW					20
+
+/* Scheduled changes kept by each light */
+#define SCHEDULE_ENTRIES_NUM				8
+
+/* Minute of a free schedule entry */
+#define SCHEDULE_MINUTE_NONE				0xFFFF
+
+/* Length of a schedule entry in the schedule requests */
+#define SCHEDULE_ENTRY_LENGTH				5
+
+/* Schedule table record key and layout version in the settings */
+#define SCHEDULE_SETTINGS_KEY				0x8002
+#define SCHEDULE_RECORD_VERSION			1
+
+/* Minutes and seconds in a day */
+#define MINUTES_PER_DAY						1440
+#define SECONDS_PER_DAY						86400
+
+/* Max delay in ms of the answer to a multicast time query */
+#define TIME_LEISURE							1000
+
+/* Destination and token length of the time query of a light without time */
+#define TIME_QUERY_ADDRESS					"FF03::1"
+#define TIME_QUERY_TOKEN_LENGTH			2
+
+/* Time in ms after the last set of the time when a light asks its neighbours for
+   it again, so the clocks of the lights do not drift apart */
+#define TIME_RESYNC_INTERVAL				86400000
+#define TIME_RESYNC_ADDRESS					"FF02::1"
+
+/* Ramp step interval in ms */
+#define RAMP_INTERVAL						20
+
+/* Ramp time across the whole dimming range in ms */
+#define RAMP_FULL_SCALE_TIME				4000
+
+/* Settings key of the light state record, in the range left to the application */
+#define STATE_SETTINGS_KEY					0x8001
+
+/* Light state record layout version */
+#define STATE_RECORD_VERSION				1
+
+/* Time in ms the light state must be stable before it is written to flash */
+#define STATE_SAVE_DELAY					5000
+
+/* Max time in ms a changed light state waits, so a long storm is saved anyway */
+#define STATE_SAVE_MAX_DELAY				60000
+
+/* Max length of a counters response: stats report or diag snapshot */
+#define STATS_REPORT_MAX					512
+
+/* Interval of the power counters log in ms */
+#define POWER_LOG_INTERVAL					60000
+
+/* FPSCR exception flags: a pending FPU interrupt would wake the CPU at once */
+#define FPU_EXCEPTION_MASK					0x0000009F
+
 
 
 
@@ -81,6 +189,156 @@ typedef enum
     LIGHT_TOGGLE
 } light_command_t;
 
+/* ramp commands */
+typedef enum
+{
+    RAMP_STOP = 0,
+    RAMP_UP,
+    RAMP_DOWN
+} ramp_command_t;
+
+/* events posted by the interrupt handlers to the main loop */
+typedef enum
+{
+	APP_EVENT_BUTTON = 0,				/**< Button event, param is the bsp_event_t. */
+	APP_EVENT_PROVISIONING_EXPIRED,	/**< Provisioning window ended. */
+	APP_EVENT_RAMP_STEP,					/**< Ramp step due. */
+	APP_EVENT_STATE_SAVE,				/**< Light state stable, to be saved. */
+	APP_EVENT_DISCOVERY,					/**< Delayed discovery response due. */
+	APP_EVENT_COALESCE,					/**< Coalescing window ended. */
+	APP_EVENT_SCHEDULE,					/**< Minute of the day ended. */
+	APP_EVENT_TIME_QUERY					/**< Delayed time query answer due. */
+} app_event_type_t;
+
+/* scheduled light change */
+typedef struct
+{
+	uint16_t         minute;                	/**< Minute of the day, SCHEDULE_MINUTE_NONE if free. */
+	uint8_t          level;                 	/**< Dimming level, 0 to turn the light off. */
+	uint8_t          transition;            	/**< Transition time in s, 0 to change at once. */
+} schedule_entry_t;
+
+/* schedule table record in the settings */
+typedef struct
+{
+	uint8_t          version;               	/**< Record layout version. */
+	schedule_entry_t entries[SCHEDULE_ENTRIES_NUM];	/**< Scheduled changes. */
+} schedule_record_t;
+
+/* time of day kept by the local clock */
+typedef struct
+{
+	bool             valid;                 	/**< Time set by the controller or by a peer light. */
+	uint32_t         seconds;               	/**< Time of day in s at the base time. */
+	uint32_t         base;                  	/**< Local time of the seconds in ms. */
+	uint16_t         last_minute;           	/**< Minute of the day of the last schedule check. */
+	uint32_t         synced;                	/**< Local time of the last set in ms. */
+	bool             resync;                	/**< Resync query sent, its first answer sets the time. */
+	uint32_t         sets;                  	/**< Times the time was set. */
+	uint32_t         runs;                  	/**< Schedule entries run. */
+} day_clock_t;
+
+/* answer to a multicast time query, sent after a random delay */
+typedef struct
+{
+	bool             pending;               	/**< Answer waiting for its delay. */
+	uint8_t          token[DISCOVERY_TOKEN_MAX];	/**< Token of the query. */
+	uint8_t          token_length;          	/**< Token length of the query. */
+	otMessageInfo    message_info;          	/**< Requester. */
+} time_query_t;
+
+/* token bucket of a command source */
+typedef struct
+{
+	bool             in_use;                	/**< Entry is tracking a source. */
+	otIp6Address     address;               	/**< Source address. */
+	uint32_t         tokens;                	/**< Commands allowed, in thousandths. */
+	uint32_t         time;                  	/**< Last command time in ms. */
+} rate_bucket_t;
+
+/* light wanted by the commands received in a coalescing window */
+typedef struct
+{
+	bool             window;                	/**< Window open: commands wait for its end. */
+	bool             pending;               	/**< Commands waiting. */
+	bool             state_set;             	/**< An on, off or toggle command was received. */
+	bool             state;                 	/**< Light state wanted. */
+	bool             level_set;             	/**< A dimming level was received. */
+	uint8_t          level;                 	/**< Dimming level wanted. */
+} coalesce_t;
+
+/* overload counters */
+typedef struct
+{
+	uint32_t         accepted;              	/**< Commands within the rate of their source. */
+	uint32_t         dropped;               	/**< Commands over the rate of their source. */
+	uint32_t         merged;                	/**< Commands replaced by a newer one in a window. */
+	uint32_t         evictions;             	/**< Sources replaced in the rate limiter. */
+} overload_stats_t;
+
+/* resource published by the discovery */
+typedef struct
+{
+	const char     * p_uri_path;            	/**< URI path of the resource. */
+	const char     * p_type;                	/**< Resource type (rt). */
+	uint8_t          endpoints;             	/**< Light outputs behind the resource (ep), 0 if none. */
+} discovery_link_t;
+
+/* response to a multicast discovery, sent after a random delay */
+typedef struct
+{
+	bool             pending;               	/**< Response waiting for its delay. */
+	uint8_t          token[DISCOVERY_TOKEN_MAX];	/**< Token of the request. */
+	uint8_t          token_length;          	/**< Token length of the request. */
+	uint8_t          links;                 	/**< Bitmask of the links matching the query. */
+	otMessageInfo    message_info;          	/**< Requester. */
+	uint32_t         queries;               	/**< Discovery requests received. */
+	uint32_t         suppressed;            	/**< Multicast requests matching no link, not answered. */
+} discovery_t;
+
+/* light state record in the settings */
+typedef struct
+{
+	uint8_t          version;               	/**< Record layout version. */
+	uint8_t          light_state;           	/**< Light on or off. */
+	uint8_t          dim_value;             	/**< Dimming level, kept while off. */
+	uint8_t          groups;                	/**< Bitmask of the joined light groups. */
+	uint8_t          light_id;              	/**< Id given by the controller. */
+} state_record_t;
+
+/* deferred writes of the light state */
+typedef struct
+{
+	state_record_t   saved;                 	/**< Record in flash. */
+	bool             pending;               	/**< Changes not written yet. */
+	uint32_t         pending_since;         	/**< Time of the first change not written in ms. */
+	uint32_t         writes;                	/**< Records written. */
+	uint32_t         unchanged;             	/**< Saves skipped as the state came back to the record. */
+} state_store_t;
+
+/* power counters */
+typedef struct
+{
+	uint32_t         start;                 	/**< Time the counters started in ms. */
+	uint32_t         sleep_time;            	/**< Time spent sleeping in ms. */
+	uint32_t         sleeps;                	/**< Sleeps, each one ended by an interrupt. */
+	uint32_t         log_time;              	/**< Time of the last log in ms. */
+} power_stats_t;
+
+/* boot stages times since the reset */
+typedef struct
+{
+	uint32_t         light;                 	/**< Light output restored in ms. */
+	uint32_t         network;               	/**< Thread stack and CoAP started in ms. */
+	uint32_t         attached;              	/**< First attach to a Thread network in ms, 0 if not yet. */
+} boot_stats_t;
+
+/* read of a counters resource into a payload, returns its length */
+typedef uint16_t (*counters_read_t)(otCoapHeader *, uint8_t *, uint16_t);
+
+/* reset of the counters of a counters resource */
+typedef void (*counters_reset_t)(void);
+
 /* application info structure */
 typedef struct
 {
@@ -90,6 +348,19 @@ typedef struct
 	otCoapResource   provisioning_resource;	/**< CoAP provisioning resource. */
 	otCoapResource   light_resource;        	/**< CoAP light resource. */
 	otCoapResource   dim_resource;        		/**< CoAP light dimming resource. */
+	otCoapResource   group_resource;        	/**< CoAP light group resource. */
+	otCoapResource   ramp_resource;        	/**< CoAP light ramp resource. */
+	otCoapResource   id_resource;          	/**< CoAP light id resource. */
+	otCoapResource   batch_resource;       	/**< CoAP light batch resource. */
+	otCoapResource   discovery_resource;   	/**< CoAP resource discovery (/.well-known/core). */
+	otCoapResource   time_resource;        	/**< CoAP time of day resource. */
+	otCoapResource   schedule_resource;    	/**< CoAP light schedule resource. */
+	otCoapResource   diag_resource;        	/**< CoAP network diagnostics resource. */
+#if PERF_ENABLED
+	otCoapResource   stats_resource;       	/**< CoAP execution time counters resource. */
+#endif
+	uint8_t          groups;                	/**< Bitmask of the joined light groups. */
+	uint8_t          light_id;              	/**< Id given by the controller for batch requests. */
 } application_t;
 
 
@@ -100,6 +371,12 @@ typedef struct
 /* timers */
 APP_TIMER_DEF(m_provisioning_timer);
 APP_TIMER_DEF(m_led_timer);
+APP_TIMER_DEF(m_ramp_timer);
+APP_TIMER_DEF(m_state_timer);
+APP_TIMER_DEF(m_discovery_timer);
+APP_TIMER_DEF(m_coalesce_timer);
+APP_TIMER_DEF(m_schedule_timer);
+APP_TIMER_DEF(m_time_timer);
 
 
 /* Create the instance "PWM1" using TIMER1. */
@@ -119,33 +396,197 @@ static uint8_t last_dim_value = 0;
 /* Store last received and applied light state */
 static uint8_t last_light_state = false; 
 
+/* Store last applied light level in PWM ticks */
+static uint16_t last_dim_ticks = 0;
+
+/* PWM ticks of a full cycle */
+static uint16_t pwm_cycle_ticks = 0;
+
+/* Running ramp direction */
+static uint8_t ramp_direction = RAMP_STOP;
+
+/* Running ramp level, end level and step, in 1/256 of PWM tick */
+static uint32_t ramp_position = 0;
+static uint32_t ramp_target = 0;
+static uint32_t ramp_step = 0;
+
+/* Running ramp is a fade out: the light is turned off at its end, back to the level before it */
+static bool ramp_fade_off = false;
+static uint8_t ramp_fade_level = 0;
+
+/* events of the timer and GPIOTE interrupts (same priority, one producer) */
+static event_queue_t m_events;
+
+/* power counters */
+static power_stats_t m_power;
+
+/* light state store */
+static state_store_t m_state;
+
+/* boot stages times */
+static boot_stats_t m_boot;
+
+#if THREAD_CHANNEL_SCAN
+/* channel selection at network formation */
+static channel_scan_t m_channel_scan;
+#endif
+
+/* execution times of the request handlers */
+PERF_COUNTER_DEF(m_perf_light, "light");
+PERF_COUNTER_DEF(m_perf_dim, "dim");
+PERF_COUNTER_DEF(m_perf_provisioning, "provisioning");
+PERF_COUNTER_DEF(m_perf_ramp, "ramp");
+PERF_COUNTER_DEF(m_perf_batch, "batch");
+PERF_COUNTER_DEF(m_perf_schedule, "schedule");
+#if PERF_ENABLED
+static perf_counter_t * const m_perf_counters[] =
+{
+	&m_perf_light,
+	&m_perf_dim,
+	&m_perf_provisioning,
+	&m_perf_ramp,
+	&m_perf_batch,
+	&m_perf_schedule,
+};
+#endif
+
+/* resources published by the discovery */
+static const discovery_link_t m_discovery_links[] =
+{
+	{ "light", "light.onoff", LIGHT_ENDPOINTS_NUM },
+	{ "dim",   "light.dim",   LIGHT_ENDPOINTS_NUM },
+	{ "ramp",  "light.ramp",  LIGHT_ENDPOINTS_NUM },
+	{ "batch", "light.batch", LIGHT_ENDPOINTS_NUM },
+	{ "group", "light.group", 0 },
+	{ "id",    "light.id",    0 },
+	{ "time",  "light.time",  0 },
+	{ "schedule", "light.schedule", 0 },
+};
+
+/* discovery state */
+static discovery_t m_discovery;
+
+/* schedule table */
+static schedule_record_t m_schedule;
+
+/* time of day */
+static day_clock_t m_clock;
+
+/* delayed answer to a multicast time query */
+static time_query_t m_time_query;
+
+/* rate limiter of the command sources */
+static rate_bucket_t m_rate_buckets[RATE_SOURCES_NUM];
+
+/* commands coalescing */
+static coalesce_t m_coalesce;
+
+/* overload counters */
+static overload_stats_t m_overload;
+
+/* network diagnostics */
+static net_diag_t m_diag;
+
+/* application counters of the diagnostics, in payload order */
+static const uint32_t * const m_diag_counters[] =
+{
+	&m_overload.accepted,
+	&m_overload.dropped,
+	&m_overload.merged,
+	&m_overload.evictions,
+	&m_discovery.queries,
+	&m_discovery.suppressed,
+	&m_state.writes,
+	&m_clock.sets,
+	&m_clock.runs,
+};
+
 
 
 
 /* ------------------- local functions prototypes --------------------- */
 
 static void 	pwm_ready_callback					(uint32_t);
+static void 	pwm_ticks_set							(uint16_t);
+static void 	ramp_stop								(void);
+static void 	ramp_process							(void);
+static void 	ramp_start								(uint8_t, uint16_t, uint32_t);
+static void 	ramp_fade								(uint8_t, uint8_t);
+static void 	events_process						(void);
+static void 	idle_sleep								(void);
+static void 	ramp_request_handler				(void *, otCoapHeader *, otMessage *, const otMessageInfo *);
+static void 	ramp_timer_handler					(void *);
 static void 	light_on									(void);
 static void 	light_off								(void);
-static void 	light_toggle							(void);
+static void 	light_dim_set							(uint8_t);
+static bool 	rate_limit_admit						(const otIp6Address *);
+static void 	busy_response_send					(void *, otCoapHeader *, const otMessageInfo *);
+static void 	coalesce_command						(bool, uint8_t);
+static void 	coalesce_apply							(void);
+static void 	coalesce_timer_handler				(void *);
+static uint32_t clock_seconds_get						(void);
+static void 	clock_set								(uint32_t);
+static void 	schedule_timer_start					(void);
+static void 	schedule_process						(void);
+static void 	schedule_run							(const schedule_entry_t *);
+static void 	schedule_save							(void);
+static void 	schedule_restore						(void);
+static otError	payload_response_send				(void *, otCoapType, otCoapCode, uint16_t, const uint8_t *, uint8_t, const void *, uint16_t, const otMessageInfo *);
+static void 	time_request_handler				(void *, otCoapHeader *, otMessage *, const otMessageInfo *);
+static otError	time_answer_send						(void *, otCoapType, uint16_t, const uint8_t *, uint8_t, const otMessageInfo *);
+static otError	time_query_send						(otInstance *, const char *);
+static void 	time_query_response_handler		(void *, otCoapHeader *, otMessage *, const otMessageInfo *, otError);
+static void 	time_timer_handler					(void *);
+static void 	schedule_request_handler			(void *, otCoapHeader *, otMessage *, const otMessageInfo *);
+static void 	schedule_timer_handler				(void *);
+static bool 	light_group_update					(otInstance *, uint8_t, bool);
+static void 	state_record_get						(state_record_t *);
+static void 	state_changed							(void);
+static void 	state_save								(void);
+static void 	state_restore							(void);
+static void 	state_groups_restore					(void);
+static void 	state_timer_handler					(void *);
 static void 	provisioning_disable					(otInstance *);
 static void 	provisioning_enable					(otInstance *);
 static void 	light_response_send					(void *, otCoapHeader *, const otMessageInfo *);
 static void 	dim_response_send						(void *, otCoapHeader *, const otMessageInfo *);
 static void 	light_request_handler				(void *, otCoapHeader *, otMessage *, const otMessageInfo *);
 static void 	dim_request_handler					(void *, otCoapHeader *, otMessage *, const otMessageInfo *);
+static void 	group_request_handler				(void *, otCoapHeader *, otMessage *, const otMessageInfo *);
+static void 	id_request_handler					(void *, otCoapHeader *, otMessage *, const otMessageInfo *);
+static void 	batch_request_handler				(void *, otCoapHeader *, otMessage *, const otMessageInfo *);
+static bool 	discovery_value_match				(const char *, const uint8_t *, uint16_t);
+static uint8_t	discovery_links_match				(otCoapHeader *);
+static otError	discovery_response_send			(void *, otCoapType, uint16_t, const uint8_t *, uint8_t, uint8_t, const otMessageInfo *);
+static void 	discovery_request_handler			(void *, otCoapHeader *, otMessage *, const otMessageInfo *);
+static void 	discovery_timer_handler			(void *);
 static otError	provisioning_response_send			(void *, otCoapHeader *, uint8_t, const otMessageInfo *);
 static void 	provisioning_request_handler		(void *, otCoapHeader *, otMessage *, const otMessageInfo *);
 static void 	role_change_handler					(void *, otDeviceRole);
 static void 	state_changed_callback				(uint32_t, void *);
+static void 	button_event_process					(bsp_event_t);
 static void 	bsp_event_handler						(bsp_event_t);
 static void 	provisioning_timer_handler			(void *);
 static void 	led_timer_handler						(void *);
+static void 	thread_instance_init					(void);
 static void 	thread_init								(void);
+#if THREAD_CHANNEL_SCAN
+static void 	channel_scan_done						(channel_scan_t *);
+#endif
 static void 	coap_init								(void);
 static void 	timer_init								(void);
 static void 	thread_bsp_init						(void);
 static void 	leds_init								(void);
+static void 	counters_request_handle				(void *, otCoapHeader *, const otMessageInfo *, counters_read_t, counters_reset_t);
+static uint16_t diag_read								(otCoapHeader *, uint8_t *, uint16_t);
+static void 	diag_reset								(void);
+static void 	diag_request_handler					(void *, otCoapHeader *, otMessage *, const otMessageInfo *);
+#if PERF_ENABLED
+static uint16_t stats_read								(otCoapHeader *, uint8_t *, uint16_t);
+static void 	stats_reset								(void);
+static void 	stats_request_handler				(void *, otCoapHeader *, otMessage *, const otMessageInfo *);
+static void 	cli_stats_command						(int, char **);
+#endif
 
 
 
@@ -161,7 +602,28 @@ static application_t m_app =
 	.provisioning_resource = {"provisioning", provisioning_request_handler, NULL, NULL},
 	.light_resource        = {"light", light_request_handler, NULL, NULL},
 	.dim_resource          = {"dim", dim_request_handler, NULL, NULL},
+	.group_resource        = {"group", group_request_handler, NULL, NULL},
+	.ramp_resource         = {"ramp", ramp_request_handler, NULL, NULL},
+	.id_resource           = {"id", id_request_handler, NULL, NULL},
+	.batch_resource        = {"batch", batch_request_handler, NULL, NULL},
+	.discovery_resource    = {".well-known/core", discovery_request_handler, NULL, NULL},
+	.time_resource         = {"time", time_request_handler, NULL, NULL},
+	.schedule_resource     = {"schedule", schedule_request_handler, NULL, NULL},
+	.diag_resource         = {"diag", diag_request_handler, NULL, NULL},
+#if PERF_ENABLED
+	.stats_resource        = {"stats", stats_request_handler, NULL, NULL},
+#endif
+	.groups                = 0,
+	.light_id              = LIGHT_ID_NONE,
+};
+
+#if PERF_ENABLED
+/* CLI commands of the application */
+static const otCliCommand m_cli_commands[] =
+{
+	{ "stats", cli_stats_command },
 };
+#endif
 
 
 
@@ -174,247 +636,1622 @@ void pwm_ready_callback(uint32_t pwm_id)
     ready_flag = true;
 }
 
-/* Function to turn lights on */
-static void light_on(void)
-{
-	last_light_state = true;
 
-	/* set PWM value to the last received one */
+/* Function to set the PWM duty in ticks */
+static void pwm_ticks_set(uint16_t ticks)
+{
 	while (false == ready_flag);
 	ready_flag = false;
-	APP_ERROR_CHECK(app_pwm_channel_duty_set(&PWM1, 0, last_dim_value));
+	APP_ERROR_CHECK(app_pwm_channel_duty_ticks_set(&PWM1, 0, ticks));
 }
 
 
-/* Function to turn lights off */
-static void light_off(void)
+/* Function to stop a running ramp keeping the reached level */
+static void ramp_stop(void)
 {
-	last_light_state = false;
-
-	/* set PWM value to 0 */
-	while (false == ready_flag);
-	ready_flag = false;
-	APP_ERROR_CHECK(app_pwm_channel_duty_set(&PWM1, 0, 0));
+	if (RAMP_STOP != ramp_direction)
+	{
+		ramp_direction = RAMP_STOP;
+		ramp_fade_off = false;
+		app_timer_stop(m_ramp_timer);
+
+		/* store the reached level, rounded so that a fade ends on its level */
+		last_dim_value = (uint8_t)((((uint32_t)last_dim_ticks * 100) + (pwm_cycle_ticks / 2)) / pwm_cycle_ticks);
+		state_changed();
+		NRF_LOG_INFO("ramp stopped at: %d\r\n", last_dim_value);
+	}
 }
 
 
-/* Function to toggle lights */
-static void light_toggle(void)
+/* Function to start or turn a ramp from the current output to a level in PWM ticks,
+   with a step in 1/256 of PWM tick */
+static void ramp_start(uint8_t direction, uint16_t target, uint32_t step)
 {
-	/* switch light state */
-	if(true == last_light_state)
-	{
-		light_off();	
-	}
-	else
+	if (RAMP_STOP == ramp_direction)
 	{
-		light_on();
+		ramp_position = (uint32_t)last_dim_ticks << 8;
+		app_timer_start(m_ramp_timer, APP_TIMER_TICKS(RAMP_INTERVAL), NULL);
 	}
 
-	NRF_LOG_INFO("light handler - command TOGGLE\r\n");
+	ramp_direction = direction;
+	ramp_target = (uint32_t)target << 8;
+	ramp_step = (step > 0) ? step : 1;
+	ramp_fade_off = false;
 }
 
 
-/* Function to disable provisioning */
-static void provisioning_disable(otInstance * p_instance)
+/* Function to run a ramp step. The ramp covers the PWM range one tick
+   resolution at a time, so no dimming steps are visible. */
+static void ramp_process(void)
 {
-	m_app.enable_provisioning = false;
-	m_app.provisioning_expiry = 0;
-
-	otCoapRemoveResource(p_instance, &m_app.provisioning_resource);
+	uint16_t ticks;
+	bool     fade_off;
 
-	app_timer_stop(m_provisioning_timer);
-}
+	/* steps posted before the stop */
+	if (RAMP_STOP == ramp_direction)
+	{
+		return;
+	}
 
+	if (RAMP_UP == ramp_direction)
+	{
+		ramp_position = ((ramp_target - ramp_position) > ramp_step) ? (ramp_position + ramp_step) : ramp_target;
+	}
+	else
+	{
+		ramp_position = ((ramp_position - ramp_target) > ramp_step) ? (ramp_position - ramp_step) : ramp_target;
+	}
 
-/* Function to enable provisioning */
-static void provisioning_enable(otInstance * p_instance)
-{
-	m_app.enable_provisioning = true;
-	m_app.provisioning_expiry = otPlatAlarmGetNow() + PROVISIONING_EXPIRY_TIME;
+	/* slow fades move less than a tick per step */
+	ticks = (uint16_t)(ramp_position >> 8);
+	if (ticks != last_dim_ticks)
+	{
+		last_dim_ticks = ticks;
+		pwm_ticks_set(last_dim_ticks);
+	}
 
-	assert(otCoapAddResource(m_app.p_ot_instance, &m_app.provisioning_resource) == OT_ERROR_NONE);
+	/* end of range */
+	if (ramp_target == ramp_position)
+	{
+		fade_off = ramp_fade_off;
+		ramp_stop();
 
-	app_timer_start(m_provisioning_timer,
-		         	APP_TIMER_TICKS(PROVISIONING_EXPIRY_TIME),
-		           	p_instance);
+		if (true == fade_off)
+		{
+			last_dim_value = ramp_fade_level;
+			last_dim_ticks = (uint16_t)(((uint32_t)pwm_cycle_ticks * ramp_fade_level) / 100);
+			light_off();
+		}
+	}
 }
 
 
-/* Send dimming response message */
-static void dim_response_send(void                * p_context,
-                              otCoapHeader        * p_request_header,
-                              const otMessageInfo * p_message_info)
+/* Function to fade the light to a level in a transition time in s. A fade to 0
+   turns the light off at its end, keeping the level before it for the next on. */
+static void ramp_fade(uint8_t level, uint8_t transition)
 {
-    otError      error = OT_ERROR_NONE;
-    otCoapHeader header;
-    otMessage  * p_response;
+	uint16_t target = (uint16_t)(((uint32_t)pwm_cycle_ticks * level) / 100);
+	uint16_t distance;
 
-    do
-    {
-        otCoapHeaderInit(&header, OT_COAP_TYPE_ACKNOWLEDGMENT, OT_COAP_CODE_CHANGED);
-        otCoapHeaderSetMessageId(&header, otCoapHeaderGetMessageId(p_request_header));
-        otCoapHeaderSetToken(&header,
-                             otCoapHeaderGetToken(p_request_header),
-                             otCoapHeaderGetTokenLength(p_request_header));
+	ramp_stop();
 
-        p_response = otCoapNewMessage(p_context, &header);
-        if (p_response == NULL)
-        {
-            break;
-        }
+	if (false == last_light_state)
+	{
+		if (0 == level)
+		{
+			return;
+		}
 
+		/* an off light fades in from dark */
+		last_dim_ticks = 0;
+		last_light_state = true;
+	}
 
-        error = otCoapSendResponse(p_context, p_response, p_message_info);
+	distance = (target > last_dim_ticks) ? (target - last_dim_ticks) : (last_dim_ticks - target);
+	if ((0 == distance) || (0 == transition))
+	{
+		if (0 == level)
+		{
+			light_off();
+		}
+		else
+		{
+			light_dim_set(level);
+		}
+		return;
+	}
 
-    } while (false);
+	ramp_fade_level = last_dim_value;
+	ramp_start((target > last_dim_ticks) ? RAMP_UP : RAMP_DOWN,
+				  target,
+				  ((uint32_t)distance * 256 * RAMP_INTERVAL) / ((uint32_t)transition * 1000));
+	ramp_fade_off = (0 == level);
+}
 
-    if (error != OT_ERROR_NONE && p_response != NULL)
-    {
-        otMessageFree(p_response);
-    }
+/* Function to turn lights on */
+static void light_on(void)
+{
+	ramp_stop();
+	last_light_state = true;
+	state_changed();
+
+	/* set PWM value to the last received one */
+	pwm_ticks_set(last_dim_ticks);
 }
 
 
-/* Function to send light response */
-static void light_response_send(void                * p_context,
-                                otCoapHeader        * p_request_header,
-                                const otMessageInfo * p_message_info)
+/* Function to turn lights off */
+static void light_off(void)
 {
-    otError      error = OT_ERROR_NONE;
-    otCoapHeader header;
-    otMessage  * p_response;
+	ramp_stop();
+	last_light_state = false;
+	state_changed();
 
-    do
-    {
-        otCoapHeaderInit(&header, OT_COAP_TYPE_ACKNOWLEDGMENT, OT_COAP_CODE_CHANGED);
-        otCoapHeaderSetMessageId(&header, otCoapHeaderGetMessageId(p_request_header));
-        otCoapHeaderSetToken(&header,
-                             otCoapHeaderGetToken(p_request_header),
-                             otCoapHeaderGetTokenLength(p_request_header));
+	/* set PWM value to 0 */
+	while (false == ready_flag);
+	ready_flag = false;
+	APP_ERROR_CHECK(app_pwm_channel_duty_set(&PWM1, 0, 0));
+}
 
-        p_response = otCoapNewMessage(p_context, &header);
-        if (p_response == NULL)
-        {
-            break;
-        }
 
-        error = otCoapSendResponse(p_context, p_response, p_message_info);
+/* Function to set a dimming value and turn the light on */
+static void light_dim_set(uint8_t dim_value)
+{
+	/* an absolute level ends any ramp */
+	ramp_stop();
 
-    } while (false);
+	if (dim_value <= 100)
+	{
+		NRF_LOG_INFO("dim value: %d\r\n", dim_value);
+	}
+	else
+	{
+		NRF_LOG_INFO("Invalid dim value\r\n");
+		dim_value = 100;
+	}
 
-    if (error != OT_ERROR_NONE && p_response != NULL)
-    {
-        otMessageFree(p_response);
-    }
+	/* store dimming value */
+	last_dim_value = dim_value;
+	last_dim_ticks = (uint16_t)(((uint32_t)pwm_cycle_ticks * dim_value) / 100);
+
+	/* set light state to true */
+	last_light_state = true;
+	state_changed();
+
+	/* set PWM value */
+	pwm_ticks_set(last_dim_ticks);
 }
 
 
-/* Dimming request handler function */
-static void dim_request_handler(void                * p_context,
-                                otCoapHeader        * p_header,
-                                otMessage           * p_message,
-                                const otMessageInfo * p_message_info)
+/* Function to check a command against the token bucket of its source */
+static bool rate_limit_admit(const otIp6Address * p_source)
 {
-    (void)p_message;
-    uint8_t dim_value;
+	uint32_t        now = otPlatAlarmGetNow();
+	rate_bucket_t * p_bucket = NULL;
+	uint32_t        elapsed;
+	uint8_t         i;
 
-	do
+	for (i = 0; i < RATE_SOURCES_NUM; i++)
 	{
-		if (otCoapHeaderGetType(p_header) != OT_COAP_TYPE_CONFIRMABLE &&
-			otCoapHeaderGetType(p_header) != OT_COAP_TYPE_NON_CONFIRMABLE)
+		if ((true == m_rate_buckets[i].in_use) && otIp6IsAddressEqual(&m_rate_buckets[i].address, p_source))
 		{
+			p_bucket = &m_rate_buckets[i];
 			break;
 		}
+	}
 
-		if (otCoapHeaderGetCode(p_header) != OT_COAP_CODE_PUT)
+	if (NULL == p_bucket)
+	{
+		/* a free entry, or the least recently heard source */
+		p_bucket = &m_rate_buckets[0];
+		for (i = 0; (i < RATE_SOURCES_NUM) && (true == p_bucket->in_use); i++)
 		{
-			break;
+			if ((false == m_rate_buckets[i].in_use) || ((now - m_rate_buckets[i].time) > (now - p_bucket->time)))
+			{
+				p_bucket = &m_rate_buckets[i];
+			}
 		}
-
-		if (otMessageRead(p_message, otMessageGetOffset(p_message), &dim_value, 1) != 1)
+		if (true == p_bucket->in_use)
 		{
-			NRF_LOG_INFO("dim handler - missing command\r\n");
+			m_overload.evictions++;
 		}
 
-		/* store dimming value */
-		last_dim_value = dim_value;
-
-		/* set light state to true */
-		last_light_state = true;
+		p_bucket->in_use = true;
+		p_bucket->address = *p_source;
+		p_bucket->tokens = RATE_BURST * 1000;
+	}
+	else
+	{
+		/* refill: RATE_PER_SECOND thousandths of a command each ms */
+		elapsed = now - p_bucket->time;
+		if (elapsed >= ((RATE_BURST * 1000) / RATE_PER_SECOND))
+		{
+			p_bucket->tokens = RATE_BURST * 1000;
+		}
+		else
+		{
+			p_bucket->tokens += elapsed * RATE_PER_SECOND;
+			if (p_bucket->tokens > (RATE_BURST * 1000))
+			{
+				p_bucket->tokens = RATE_BURST * 1000;
+			}
+		}
+	}
+	p_bucket->time = now;
+
+	if (p_bucket->tokens < 1000)
+	{
+		m_overload.dropped++;
+		return false;
+	}
+
+	p_bucket->tokens -= 1000;
+	m_overload.accepted++;
+	return true;
+}
+
+
+/* Function to note a light or dimming command: the first one is applied at once,
+   the next ones within COALESCE_WINDOW only set the light wanted at the end of it */
+static void coalesce_command(bool dim, uint8_t value)
+{
+	if (false == m_coalesce.pending)
+	{
+		m_coalesce.state = last_light_state;
+		m_coalesce.state_set = false;
+		m_coalesce.level_set = false;
+	}
+	else
+	{
+		m_overload.merged++;
+	}
+
+	if (true == dim)
+	{
+		m_coalesce.level = value;
+		m_coalesce.level_set = true;
+		m_coalesce.state = true;
+	}
+	else
+	{
+		switch (value)
+		{
+			case LIGHT_TOGGLE:
+				m_coalesce.state = !m_coalesce.state;
+				break;
+			case LIGHT_ON:
+				m_coalesce.state = true;
+				break;
+			case LIGHT_OFF:
+				m_coalesce.state = false;
+				break;
+			default:
+				/* not supported command: do nothing */
+				return;
+		}
+		m_coalesce.state_set = true;
+	}
+	m_coalesce.pending = true;
+
+	if (false == m_coalesce.window)
+	{
+		coalesce_apply();
+	}
+}
+
+
+/* Function to apply the light wanted by the commands waiting, and to open a new
+   window; with no command waiting the window is closed */
+static void coalesce_apply(void)
+{
+	if (false == m_coalesce.pending)
+	{
+		m_coalesce.window = false;
+		return;
+	}
+
+	m_coalesce.pending = false;
+
+	if (true == m_coalesce.level_set)
+	{
+		light_dim_set(m_coalesce.level);
+	}
+
+	if (true == m_coalesce.state_set)
+	{
+		if (false == m_coalesce.state)
+		{
+			light_off();
+		}
+		else if (false == m_coalesce.level_set)
+		{
+			light_on();
+		}
+	}
+
+	m_coalesce.window = true;
+	app_timer_start(m_coalesce_timer, APP_TIMER_TICKS(COALESCE_WINDOW), NULL);
+}
+
+
+/* Function to get the time of day in s. The base time follows the clock in whole
+   seconds, so the ms counter never wraps between two calls. */
+static uint32_t clock_seconds_get(void)
+{
+	uint32_t elapsed = (otPlatAlarmGetNow() - m_clock.base) / 1000;
+
+	m_clock.seconds = (m_clock.seconds + elapsed) % SECONDS_PER_DAY;
+	m_clock.base += elapsed * 1000;
+
+	return m_clock.seconds;
+}
+
+
+/* Function to set the time of day in s and to start the schedule checks */
+static void clock_set(uint32_t seconds)
+{
+	m_clock.seconds = seconds;
+	m_clock.base = otPlatAlarmGetNow();
+	m_clock.synced = m_clock.base;
+	m_clock.resync = false;
+	m_clock.sets++;
+
+	/* a new time does not run the entries of its minute again */
+	if (false == m_clock.valid)
+	{
+		m_clock.last_minute = seconds / 60;
+		m_clock.valid = true;
+	}
+
+	NRF_LOG_INFO("time of day: %02d:%02d:%02d\r\n", seconds / 3600, (seconds / 60) % 60, seconds % 60);
+
+	/* a correction forward over a minute boundary runs the entries of the new minute */
+	schedule_process();
+}
+
+
+/* Function to start the schedule timer up to the end of the current minute */
+static void schedule_timer_start(void)
+{
+	uint32_t elapsed;
+
+	/* the base time is moved first: ms left since the base are below 1000 */
+	elapsed = (clock_seconds_get() % 60) * 1000;
+	elapsed += otPlatAlarmGetNow() - m_clock.base;
+
+	app_timer_stop(m_schedule_timer);
+	app_timer_start(m_schedule_timer, APP_TIMER_TICKS(60000 - elapsed), NULL);
+}
+
+
+/* Function to run the schedule entries of a new minute of the day. A timer that
+   ends a bit early finds the same minute and is started again up to its end, and
+   a correction back into the previous minute does not run its entries again. */
+static void schedule_process(void)
+{
+	uint16_t minute;
+	uint8_t  i;
+
+	if (false == m_clock.valid)
+	{
+		return;
+	}
+
+	/* the daily resync with the neighbours, tried again a day later without answer */
+	if ((otPlatAlarmGetNow() - m_clock.synced) >= TIME_RESYNC_INTERVAL)
+	{
+		m_clock.synced = otPlatAlarmGetNow();
+		m_clock.resync = (time_query_send(m_app.p_ot_instance, TIME_RESYNC_ADDRESS) == OT_ERROR_NONE);
+	}
+
+	minute = (uint16_t)(clock_seconds_get() / 60);
+	if ((minute != m_clock.last_minute) &&
+		(minute != ((m_clock.last_minute + MINUTES_PER_DAY - 1) % MINUTES_PER_DAY)))
+	{
+		m_clock.last_minute = minute;
+
+		for (i = 0; i < SCHEDULE_ENTRIES_NUM; i++)
+		{
+			if (m_schedule.entries[i].minute == minute)
+			{
+				schedule_run(&m_schedule.entries[i]);
+			}
+		}
+	}
+
+	schedule_timer_start();
+}
+
+
+/* Function to run a schedule entry: a transition goes through the ramp */
+static void schedule_run(const schedule_entry_t * p_entry)
+{
+	m_clock.runs++;
+	NRF_LOG_INFO("schedule: level %d in %d s\r\n", p_entry->level, p_entry->transition);
+
+	/* the scheduled change replaces the commands waiting in the coalescing window */
+	m_coalesce.pending = false;
+
+	ramp_fade(p_entry->level, p_entry->transition);
+}
+
+
+/* Function to join or leave a light group multicast address */
+static bool light_group_update(otInstance * p_instance, uint8_t group, bool join)
+{
+	otIp6Address group_address;
+
+	/* group multicast address */
+	otIp6AddressFromString(LIGHT_GROUP_MULTICAST_ADDRESS, &group_address);
+	group_address.mFields.m8[15] = group;
+
+	if (true == join)
+	{
+		if (0 == (m_app.groups & (1 << group)))
+		{
+			if (otIp6SubscribeMulticastAddress(p_instance, &group_address) != OT_ERROR_NONE)
+			{
+				return false;
+			}
+			m_app.groups |= (1 << group);
+			state_changed();
+		}
+	}
+	else if (m_app.groups & (1 << group))
+	{
+		otIp6UnsubscribeMulticastAddress(p_instance, &group_address);
+		m_app.groups &= ~(1 << group);
+		state_changed();
+	}
+
+	return true;
+}
+
+
+/* Function to get the current light state as a record */
+static void state_record_get(state_record_t * p_record)
+{
+	memset(p_record, 0, sizeof(state_record_t));
+	p_record->version = STATE_RECORD_VERSION;
+	p_record->light_state = last_light_state;
+	p_record->dim_value = last_dim_value;
+	p_record->groups = m_app.groups;
+	p_record->light_id = m_app.light_id;
+}
+
+
+/* Function to note a change of the light state: the write is deferred until the
+   state is stable for STATE_SAVE_DELAY, so fades and dimming storms cost one write */
+static void state_changed(void)
+{
+	uint32_t now = otPlatAlarmGetNow();
+
+	if (false == m_state.pending)
+	{
+		m_state.pending = true;
+		m_state.pending_since = now;
+	}
+
+	/* a change restarts the delay, up to the max delay from the first change */
+	if ((now - m_state.pending_since) < (STATE_SAVE_MAX_DELAY - STATE_SAVE_DELAY))
+	{
+		app_timer_stop(m_state_timer);
+		app_timer_start(m_state_timer, APP_TIMER_TICKS(STATE_SAVE_DELAY), NULL);
+	}
+}
+
+
+/* Function to write the light state if it differs from the record in flash */
+static void state_save(void)
+{
+	state_record_t record;
+
+	m_state.pending = false;
+	state_record_get(&record);
+
+	if (0 == memcmp(&record, &m_state.saved, sizeof(record)))
+	{
+		m_state.unchanged++;
+		return;
+	}
+
+	if (otPlatSettingsSet(m_app.p_ot_instance, STATE_SETTINGS_KEY, (const uint8_t *)&record, sizeof(record)) == OT_ERROR_NONE)
+	{
+		m_state.saved = record;
+		m_state.writes++;
+		NRF_LOG_INFO("light state saved (%d writes)\r\n", m_state.writes);
+	}
+}
+
+
+/* Function to restore the light state saved before the last power off */
+static void state_restore(void)
+{
+	state_record_t record;
+	uint16_t       length = sizeof(record);
+
+	if ((otPlatSettingsGet(m_app.p_ot_instance, STATE_SETTINGS_KEY, 0, (uint8_t *)&record, &length) != OT_ERROR_NONE) ||
+		 (length != sizeof(record)) || (record.version != STATE_RECORD_VERSION) || (record.dim_value > 100))
+	{
+		/* first boot: start dark, nothing to restore */
+		state_record_get(&m_state.saved);
+		return;
+	}
+
+	last_dim_value = record.dim_value;
+	last_dim_ticks = (uint16_t)(((uint32_t)pwm_cycle_ticks * record.dim_value) / 100);
+	last_light_state = record.light_state;
+	m_app.light_id = record.light_id;
+
+	/* the groups are joined back once the stack is started */
+	m_state.saved = record;
+
+	NRF_LOG_INFO("light state restored: %s level %d\r\n", last_light_state ? "on" : "off", last_dim_value);
+}
+
+
+/* Function to write the schedule table, changed by the controller only */
+static void schedule_save(void)
+{
+	m_schedule.version = SCHEDULE_RECORD_VERSION;
+
+	if (otPlatSettingsSet(m_app.p_ot_instance, SCHEDULE_SETTINGS_KEY, (const uint8_t *)&m_schedule, sizeof(m_schedule)) == OT_ERROR_NONE)
+	{
+		NRF_LOG_INFO("schedule saved\r\n");
+	}
+}
+
+
+/* Function to restore the schedule table: the entries run once the time is known */
+static void schedule_restore(void)
+{
+	uint16_t length = sizeof(m_schedule);
+	uint8_t  i;
+
+	if ((otPlatSettingsGet(m_app.p_ot_instance, SCHEDULE_SETTINGS_KEY, 0, (uint8_t *)&m_schedule, &length) != OT_ERROR_NONE) ||
+		 (length != sizeof(m_schedule)) || (m_schedule.version != SCHEDULE_RECORD_VERSION))
+	{
+		memset(&m_schedule, 0, sizeof(m_schedule));
+		m_schedule.version = SCHEDULE_RECORD_VERSION;
+		for (i = 0; i < SCHEDULE_ENTRIES_NUM; i++)
+		{
+			m_schedule.entries[i].minute = SCHEDULE_MINUTE_NONE;
+		}
+	}
+}
+
+
+/* Function to join back the light groups of the restored record */
+static void state_groups_restore(void)
+{
+	uint8_t group;
+
+	for (group = 0; group < LIGHT_GROUPS_NUM; group++)
+	{
+		if (m_state.saved.groups & (1 << group))
+		{
+			(void)light_group_update(m_app.p_ot_instance, group, true);
+		}
+	}
+
+	/* the restored state is the record: nothing to write */
+	m_state.pending = false;
+	app_timer_stop(m_state_timer);
+}
+
+
+/* Function to disable provisioning */
+static void provisioning_disable(otInstance * p_instance)
+{
+	m_app.enable_provisioning = false;
+	m_app.provisioning_expiry = 0;
+
+	otCoapRemoveResource(p_instance, &m_app.provisioning_resource);
+
+	app_timer_stop(m_provisioning_timer);
+}
+
+
+/* Function to enable provisioning */
+static void provisioning_enable(otInstance * p_instance)
+{
+	m_app.enable_provisioning = true;
+	m_app.provisioning_expiry = otPlatAlarmGetNow() + PROVISIONING_EXPIRY_TIME;
+
+	assert(otCoapAddResource(m_app.p_ot_instance, &m_app.provisioning_resource) == OT_ERROR_NONE);
+
+	app_timer_start(m_provisioning_timer,
+		         	APP_TIMER_TICKS(PROVISIONING_EXPIRY_TIME),
+		           	p_instance);
+}
+
+
+/* Send dimming response message */
+static void dim_response_send(void                * p_context,
+                              otCoapHeader        * p_request_header,
+                              const otMessageInfo * p_message_info)
+{
+    otError      error = OT_ERROR_NONE;
+    otCoapHeader header;
+    otMessage  * p_response;
+
+    do
+    {
+        otCoapHeaderInit(&header, OT_COAP_TYPE_ACKNOWLEDGMENT, OT_COAP_CODE_CHANGED);
+        otCoapHeaderSetMessageId(&header, otCoapHeaderGetMessageId(p_request_header));
+        otCoapHeaderSetToken(&header,
+                             otCoapHeaderGetToken(p_request_header),
+                             otCoapHeaderGetTokenLength(p_request_header));
+
+        p_response = otCoapNewMessage(p_context, &header);
+        if (p_response == NULL)
+        {
+            break;
+        }
+
+
+        error = otCoapSendResponse(p_context, p_response, p_message_info);
+
+    } while (false);
+
+    if (error != OT_ERROR_NONE && p_response != NULL)
+    {
+        otMessageFree(p_response);
+    }
+}
+
+
+/* Send a service unavailable response to a command over the rate of its source:
+   the acknowledgment stops the retransmissions */
+static void busy_response_send(void                * p_context,
+                               otCoapHeader        * p_request_header,
+                               const otMessageInfo * p_message_info)
+{
+    otError      error = OT_ERROR_NONE;
+    otCoapHeader header;
+    otMessage  * p_response;
+
+    if (otCoapHeaderGetType(p_request_header) != OT_COAP_TYPE_CONFIRMABLE)
+    {
+        return;
+    }
+
+    do
+    {
+        otCoapHeaderInit(&header, OT_COAP_TYPE_ACKNOWLEDGMENT, OT_COAP_CODE_SERVICE_UNAVAILABLE);
+        otCoapHeaderSetMessageId(&header, otCoapHeaderGetMessageId(p_request_header));
+        otCoapHeaderSetToken(&header,
+                             otCoapHeaderGetToken(p_request_header),
+                             otCoapHeaderGetTokenLength(p_request_header));
+
+        p_response = otCoapNewMessage(p_context, &header);
+        if (p_response == NULL)
+        {
+            break;
+        }
+
+        error = otCoapSendResponse(p_context, p_response, p_message_info);
+
+    } while (false);
+
+    if (error != OT_ERROR_NONE && p_response != NULL)
+    {
+        otMessageFree(p_response);
+    }
+}
+
+
+/* Function to send light response */
+static void light_response_send(void                * p_context,
+                                otCoapHeader        * p_request_header,
+                                const otMessageInfo * p_message_info)
+{
+    otError      error = OT_ERROR_NONE;
+    otCoapHeader header;
+    otMessage  * p_response;
+
+    do
+    {
+        otCoapHeaderInit(&header, OT_COAP_TYPE_ACKNOWLEDGMENT, OT_COAP_CODE_CHANGED);
+        otCoapHeaderSetMessageId(&header, otCoapHeaderGetMessageId(p_request_header));
+        otCoapHeaderSetToken(&header,
+                             otCoapHeaderGetToken(p_request_header),
+                             otCoapHeaderGetTokenLength(p_request_header));
+
+        p_response = otCoapNewMessage(p_context, &header);
+        if (p_response == NULL)
+        {
+            break;
+        }
+
+        error = otCoapSendResponse(p_context, p_response, p_message_info);
+
+    } while (false);
+
+    if (error != OT_ERROR_NONE && p_response != NULL)
+    {
+        otMessageFree(p_response);
+    }
+}
+
+
+/* Dimming request handler function */
+static void dim_request_handler(void                * p_context,
+                                otCoapHeader        * p_header,
+                                otMessage           * p_message,
+                                const otMessageInfo * p_message_info)
+{
+    (void)p_message;
+    uint8_t dim_value;
+    PERF_START(start);
+
+	do
+	{
+		if (otCoapHeaderGetType(p_header) != OT_COAP_TYPE_CONFIRMABLE &&
+			otCoapHeaderGetType(p_header) != OT_COAP_TYPE_NON_CONFIRMABLE)
+		{
+			break;
+		}
+
+		if (otCoapHeaderGetCode(p_header) != OT_COAP_CODE_PUT)
+		{
+			break;
+		}
+
+		if (false == rate_limit_admit(&p_message_info->mPeerAddr))
+		{
+			busy_response_send(p_context, p_header, p_message_info);
+			break;
+		}
+
+		if (otMessageRead(p_message, otMessageGetOffset(p_message), &dim_value, 1) != 1)
+		{
+			NRF_LOG_INFO("dim handler - missing command\r\n");
+		}
+
+		coalesce_command(true, dim_value);
+
+		if (otCoapHeaderGetType(p_header) == OT_COAP_TYPE_CONFIRMABLE)
+		{
+			dim_response_send(p_context, p_header, p_message_info);
+		}
+
+	} while (false);
+
+	PERF_STOP(m_perf_dim, start);
+}
+
+
+/* Function to handle light request */
+static void light_request_handler(void                * p_context,
+                                  otCoapHeader        * p_header,
+                                  otMessage           * p_message,
+                                  const otMessageInfo * p_message_info)
+{
+	(void)p_message;
+	uint8_t command;
+	PERF_START(start);
+
+	do
+	{
+		if (otCoapHeaderGetType(p_header) != OT_COAP_TYPE_CONFIRMABLE &&
+			otCoapHeaderGetType(p_header) != OT_COAP_TYPE_NON_CONFIRMABLE)
+		{
+			break;
+		}
+
+		if (otCoapHeaderGetCode(p_header) != OT_COAP_CODE_PUT)
+		{
+			break;
+		}
+
+		if (false == rate_limit_admit(&p_message_info->mPeerAddr))
+		{
+			busy_response_send(p_context, p_header, p_message_info);
+			break;
+		}
+
+		if (otMessageRead(p_message, otMessageGetOffset(p_message), &command, 1) != 1)
+		{
+			NRF_LOG_INFO("light handler - missing command\r\n");
+		}
+
+		coalesce_command(false, command);
+
+		if (otCoapHeaderGetType(p_header) == OT_COAP_TYPE_CONFIRMABLE)
+		{
+			light_response_send(p_context, p_header, p_message_info);
+		}
+
+	} while (false);
+
+	PERF_STOP(m_perf_light, start);
+}
+
+
+/* Function to handle light ramp request */
+static void ramp_request_handler(void                * p_context,
+                                 otCoapHeader        * p_header,
+                                 otMessage           * p_message,
+                                 const otMessageInfo * p_message_info)
+{
+	uint8_t command;
+	PERF_START(start);
+
+	do
+	{
+		if (otCoapHeaderGetType(p_header) != OT_COAP_TYPE_CONFIRMABLE &&
+			otCoapHeaderGetType(p_header) != OT_COAP_TYPE_NON_CONFIRMABLE)
+		{
+			break;
+		}
+
+		if (otCoapHeaderGetCode(p_header) != OT_COAP_CODE_PUT)
+		{
+			break;
+		}
+
+		if (false == rate_limit_admit(&p_message_info->mPeerAddr))
+		{
+			busy_response_send(p_context, p_header, p_message_info);
+			break;
+		}
+
+		if (otMessageRead(p_message, otMessageGetOffset(p_message), &command, 1) != 1)
+		{
+			NRF_LOG_INFO("ramp handler - missing command\r\n");
+			break;
+		}
+
+		/* the ramp starts from the light wanted by the commands before it */
+		if (true == m_coalesce.pending)
+		{
+			app_timer_stop(m_coalesce_timer);
+			coalesce_apply();
+		}
+
+		switch (command)
+		{
+			case RAMP_UP:
+			case RAMP_DOWN:
+				/* a ramp starts from the current output: an off light starts from dark */
+				if (false == last_light_state)
+				{
+					last_dim_ticks = 0;
+					last_light_state = true;
+				}
+				ramp_start(command,
+							  (RAMP_UP == command) ? pwm_cycle_ticks : 0,
+							  ((uint32_t)pwm_cycle_ticks * 256 * RAMP_INTERVAL) / RAMP_FULL_SCALE_TIME);
+				NRF_LOG_INFO("ramp started: %d\r\n", command);
+				break;
+			case RAMP_STOP:
+				ramp_stop();
+				break;
+			default:
+				/* not supported command: do nothing */
+				break;
+		}
+
+		/* an empty changed response acknowledges the request as for the light resource */
+		if (otCoapHeaderGetType(p_header) == OT_COAP_TYPE_CONFIRMABLE)
+		{
+			light_response_send(p_context, p_header, p_message_info);
+		}
+
+	} while (false);
+
+	PERF_STOP(m_perf_ramp, start);
+}
+
+
+/* Function to handle light group request */
+static void group_request_handler(void                * p_context,
+                                  otCoapHeader        * p_header,
+                                  otMessage           * p_message,
+                                  const otMessageInfo * p_message_info)
+{
+	uint8_t value;
+	uint8_t group;
+
+	do
+	{
+		if (otCoapHeaderGetType(p_header) != OT_COAP_TYPE_CONFIRMABLE &&
+			otCoapHeaderGetType(p_header) != OT_COAP_TYPE_NON_CONFIRMABLE)
+		{
+			break;
+		}
+
+		if (otCoapHeaderGetCode(p_header) != OT_COAP_CODE_PUT)
+		{
+			break;
+		}
+
+		if (otMessageRead(p_message, otMessageGetOffset(p_message), &value, 1) != 1)
+		{
+			NRF_LOG_INFO("group handler - missing command\r\n");
+			break;
+		}
+
+		group = value & ~LIGHT_GROUP_JOIN_FLAG;
+		if (group >= LIGHT_GROUPS_NUM)
+		{
+			NRF_LOG_INFO("Invalid group\r\n");
+			break;
+		}
+
+		if (false == light_group_update(p_context, group, (0 != (value & LIGHT_GROUP_JOIN_FLAG))))
+		{
+			NRF_LOG_INFO("Failed to join group\r\n");
+			break;
+		}
+
+		NRF_LOG_INFO("groups: 0x%02x\r\n", m_app.groups);
+
+		/* an empty changed response acknowledges the request as for the light resource */
+		if (otCoapHeaderGetType(p_header) == OT_COAP_TYPE_CONFIRMABLE)
+		{
+			light_response_send(p_context, p_header, p_message_info);
+		}
+
+	} while (false);
+}
+
+
+/* Function to handle light id request: the controller gives the id of this light in batch requests */
+static void id_request_handler(void                * p_context,
+                               otCoapHeader        * p_header,
+                               otMessage           * p_message,
+                               const otMessageInfo * p_message_info)
+{
+	uint8_t light_id;
+
+	do
+	{
+		if (otCoapHeaderGetType(p_header) != OT_COAP_TYPE_CONFIRMABLE &&
+			otCoapHeaderGetType(p_header) != OT_COAP_TYPE_NON_CONFIRMABLE)
+		{
+			break;
+		}
+
+		if (otCoapHeaderGetCode(p_header) != OT_COAP_CODE_PUT)
+		{
+			break;
+		}
+
+		if (otMessageRead(p_message, otMessageGetOffset(p_message), &light_id, 1) != 1)
+		{
+			NRF_LOG_INFO("id handler - missing id\r\n");
+			break;
+		}
+
+		if (m_app.light_id != light_id)
+		{
+			m_app.light_id = light_id;
+			state_changed();
+		}
+		NRF_LOG_INFO("light id: %d\r\n", light_id);
+
+		/* an empty changed response acknowledges the request as for the light resource */
+		if (otCoapHeaderGetType(p_header) == OT_COAP_TYPE_CONFIRMABLE)
+		{
+			light_response_send(p_context, p_header, p_message_info);
+		}
+
+	} while (false);
+}
+
+
+/* Function to handle light batch request: dim levels of several lights in one
+   request, where this light picks the entry of its id if any */
+static void batch_request_handler(void                * p_context,
+                                  otCoapHeader        * p_header,
+                                  otMessage           * p_message,
+                                  const otMessageInfo * p_message_info)
+{
+	uint16_t offset = otMessageGetOffset(p_message);
+	uint16_t length = otMessageGetLength(p_message);
+	uint8_t  format;
+	uint8_t  entry[2];
+	uint8_t  mask;
+	PERF_START(start);
+
+	do
+	{
+		if (otCoapHeaderGetType(p_header) != OT_COAP_TYPE_CONFIRMABLE &&
+			otCoapHeaderGetType(p_header) != OT_COAP_TYPE_NON_CONFIRMABLE)
+		{
+			break;
+		}
+
+		if (otCoapHeaderGetCode(p_header) != OT_COAP_CODE_PUT)
+		{
+			break;
+		}
+
+		if (false == rate_limit_admit(&p_message_info->mPeerAddr))
+		{
+			busy_response_send(p_context, p_header, p_message_info);
+			break;
+		}
 
-		/* set PWM value */
-		while (false == ready_flag);
-		ready_flag = false;
-		APP_ERROR_CHECK(app_pwm_channel_duty_set(&PWM1, 0, last_dim_value));
+		if (otMessageRead(p_message, offset, &format, 1) != 1)
+		{
+			NRF_LOG_INFO("batch handler - missing format\r\n");
+			break;
+		}
+		offset++;
+
+		if (LIGHT_ID_NONE == m_app.light_id)
+		{
+			break;
+		}
 
-		if (last_dim_value <= 100)
+		if (BATCH_FORMAT_LIST == format)
+		{
+			/* entries are read in place, no copy of the list */
+			while ((offset + sizeof(entry)) <= length)
+			{
+				otMessageRead(p_message, offset, entry, sizeof(entry));
+				if (entry[0] == m_app.light_id)
+				{
+					coalesce_command(true, entry[1]);
+					break;
+				}
+				offset += sizeof(entry);
+			}
+		}
+		else if (BATCH_FORMAT_MASK == format)
 		{
-			NRF_LOG_INFO("dim value: %d\r\n", last_dim_value);
+			/* level, then the byte of the bitmask holding the bit of this light */
+			if ((otMessageRead(p_message, offset, &entry[1], 1) == 1) &&
+				 (otMessageRead(p_message, offset + 1 + (m_app.light_id / 8), &mask, 1) == 1) &&
+				 (mask & (1 << (m_app.light_id % 8))))
+			{
+				coalesce_command(true, entry[1]);
+			}
 		}
 		else
 		{
-			NRF_LOG_INFO("Invalid dim value\r\n");
+			NRF_LOG_INFO("batch handler - unknown format\r\n");
+			break;
 		}
 
 		if (otCoapHeaderGetType(p_header) == OT_COAP_TYPE_CONFIRMABLE)
 		{
-			dim_response_send(p_context, p_header, p_message_info);
+			light_response_send(p_context, p_header, p_message_info);
+		}
+
+	} while (false);
+
+	PERF_STOP(m_perf_batch, start);
+}
+
+
+/* Function to send a response with a payload */
+static otError payload_response_send(void                * p_context,
+                                     otCoapType            type,
+                                     otCoapCode            code,
+                                     uint16_t              message_id,
+                                     const uint8_t       * p_token,
+                                     uint8_t               token_length,
+                                     const void          * p_payload,
+                                     uint16_t              length,
+                                     const otMessageInfo * p_message_info)
+{
+    otError       error = OT_ERROR_NO_BUFS;
+    otCoapHeader  header;
+    otMessage   * p_response = NULL;
+
+    do
+    {
+        otCoapHeaderInit(&header, type, code);
+        otCoapHeaderSetMessageId(&header, message_id);
+        otCoapHeaderSetToken(&header, p_token, token_length);
+
+        if (length > 0)
+        {
+            otCoapHeaderSetPayloadMarker(&header);
+        }
+
+        p_response = otCoapNewMessage(p_context, &header);
+        if (p_response == NULL)
+        {
+            break;
+        }
+
+        error = otMessageAppend(p_response, p_payload, length);
+        if (error != OT_ERROR_NONE)
+        {
+            break;
+        }
+
+        error = otCoapSendResponse(p_context, p_response, p_message_info);
+
+    } while (false);
+
+    if (error != OT_ERROR_NONE && p_response != NULL)
+    {
+        otMessageFree(p_response);
+    }
+
+    return error;
+}
+
+
+/* Function to answer a time query with the time of day in s, 4 bytes little endian */
+static otError time_answer_send(void                * p_context,
+                                otCoapType            type,
+                                uint16_t              message_id,
+                                const uint8_t       * p_token,
+                                uint8_t               token_length,
+                                const otMessageInfo * p_message_info)
+{
+    uint32_t seconds;
+    uint8_t  payload[4];
+
+    if (false == m_clock.valid)
+    {
+        return payload_response_send(p_context, type, OT_COAP_CODE_NOT_FOUND, message_id,
+                                     p_token, token_length, NULL, 0, p_message_info);
+    }
+
+    seconds = clock_seconds_get();
+    payload[0] = (uint8_t)seconds;
+    payload[1] = (uint8_t)(seconds >> 8);
+    payload[2] = (uint8_t)(seconds >> 16);
+    payload[3] = (uint8_t)(seconds >> 24);
+
+    return payload_response_send(p_context, type, OT_COAP_CODE_CONTENT, message_id,
+                                 p_token, token_length, payload, sizeof(payload), p_message_info);
+}
+
+
+/* Time of day request handler: PUT sets the time, GET reads it. A multicast query,
+   sent by a light without time, is answered after a random delay up to TIME_LEISURE
+   and only by the lights that know the time. */
+static void time_request_handler(void                * p_context,
+                                 otCoapHeader        * p_header,
+                                 otMessage           * p_message,
+                                 const otMessageInfo * p_message_info)
+{
+	uint8_t  payload[4];
+	uint32_t seconds;
+
+	do
+	{
+		if (otCoapHeaderGetType(p_header) != OT_COAP_TYPE_CONFIRMABLE &&
+			otCoapHeaderGetType(p_header) != OT_COAP_TYPE_NON_CONFIRMABLE)
+		{
+			break;
+		}
+
+		if (otCoapHeaderGetCode(p_header) == OT_COAP_CODE_GET)
+		{
+			if (0xFF != p_message_info->mSockAddr.mFields.m8[0])
+			{
+				(void)time_answer_send(p_context,
+											  (otCoapHeaderGetType(p_header) == OT_COAP_TYPE_CONFIRMABLE) ?
+											  OT_COAP_TYPE_ACKNOWLEDGMENT : OT_COAP_TYPE_NON_CONFIRMABLE,
+											  otCoapHeaderGetMessageId(p_header),
+											  otCoapHeaderGetToken(p_header),
+											  otCoapHeaderGetTokenLength(p_header),
+											  p_message_info);
+			}
+			else if ((true == m_clock.valid) && (otCoapHeaderGetTokenLength(p_header) <= DISCOVERY_TOKEN_MAX))
+			{
+				m_time_query.pending = true;
+				m_time_query.token_length = otCoapHeaderGetTokenLength(p_header);
+				memcpy(m_time_query.token, otCoapHeaderGetToken(p_header), m_time_query.token_length);
+				m_time_query.message_info = *p_message_info;
+				m_time_query.message_info.mSockAddr = *otThreadGetMeshLocalEid(p_context);
+
+				app_timer_stop(m_time_timer);
+				app_timer_start(m_time_timer, APP_TIMER_TICKS(1 + (otPlatRandomGet() % TIME_LEISURE)), NULL);
+			}
+			break;
+		}
+
+		if (otCoapHeaderGetCode(p_header) != OT_COAP_CODE_PUT)
+		{
+			break;
+		}
+
+		if (otMessageRead(p_message, otMessageGetOffset(p_message), payload, sizeof(payload)) != sizeof(payload))
+		{
+			NRF_LOG_INFO("time handler - missing time\r\n");
+			break;
+		}
+
+		seconds = payload[0] | ((uint32_t)payload[1] << 8) | ((uint32_t)payload[2] << 16) | ((uint32_t)payload[3] << 24);
+		if (seconds >= SECONDS_PER_DAY)
+		{
+			NRF_LOG_INFO("Invalid time\r\n");
+			break;
+		}
+
+		clock_set(seconds);
+
+		if (otCoapHeaderGetType(p_header) == OT_COAP_TYPE_CONFIRMABLE)
+		{
+			light_response_send(p_context, p_header, p_message_info);
+		}
+
+	} while (false);
+}
+
+
+/* Function to ask the lights around for the time of day, after a reset, or the
+   neighbours once a day */
+static otError time_query_send(otInstance * p_instance, const char * p_address)
+{
+    otError       error = OT_ERROR_NO_BUFS;
+    otCoapHeader  header;
+    otMessage   * p_request = NULL;
+    otMessageInfo message_info;
+
+    do
+    {
+        otCoapHeaderInit(&header, OT_COAP_TYPE_NON_CONFIRMABLE, OT_COAP_CODE_GET);
+        otCoapHeaderGenerateToken(&header, TIME_QUERY_TOKEN_LENGTH);
+
+        error = otCoapHeaderAppendUriPathOptions(&header, "time");
+        if (error != OT_ERROR_NONE)
+        {
+            break;
+        }
+
+        error = OT_ERROR_NO_BUFS;
+        p_request = otCoapNewMessage(p_instance, &header);
+        if (p_request == NULL)
+        {
+            break;
+        }
+
+        memset(&message_info, 0, sizeof(message_info));
+        message_info.mInterfaceId = OT_NETIF_INTERFACE_ID_THREAD;
+        message_info.mPeerPort = OT_DEFAULT_COAP_PORT;
+        (void)otIp6AddressFromString(p_address, &message_info.mPeerAddr);
+
+        error = otCoapSendRequest(p_instance, p_request, &message_info, time_query_response_handler, p_instance);
+
+    } while (false);
+
+    if (error != OT_ERROR_NONE && p_request != NULL)
+    {
+        otMessageFree(p_request);
+    }
+
+    return error;
+}
+
+
+/* Time query response handler: the first answer sets the time */
+static void time_query_response_handler(void                * p_context,
+                                        otCoapHeader        * p_header,
+                                        otMessage           * p_message,
+                                        const otMessageInfo * p_message_info,
+                                        otError               result)
+{
+    (void)p_context;
+    (void)p_message_info;
+
+    uint8_t  payload[4];
+    uint32_t seconds;
+
+    /* no answer to a resync: the local clock goes on until the next one */
+    if (result != OT_ERROR_NONE)
+    {
+        m_clock.resync = false;
+    }
+
+    if ((result != OT_ERROR_NONE) || ((true == m_clock.valid) && (false == m_clock.resync)) ||
+        (otCoapHeaderGetCode(p_header) != OT_COAP_CODE_CONTENT) ||
+        (otMessageRead(p_message, otMessageGetOffset(p_message), payload, sizeof(payload)) != sizeof(payload)))
+    {
+        return;
+    }
+
+    seconds = payload[0] | ((uint32_t)payload[1] << 8) | ((uint32_t)payload[2] << 16) | ((uint32_t)payload[3] << 24);
+    if (seconds < SECONDS_PER_DAY)
+    {
+        NRF_LOG_INFO("time given by a peer light\r\n");
+        clock_set(seconds);
+    }
+}
+
+
+/* Light schedule request handler. Each entry is 5 bytes: slot, minute of the day
+   (2 bytes little endian, 0xFFFF to free the slot), level (0 to turn off) and
+   transition in s. PUT writes the entries of the payload, GET reads the used ones. */
+static void schedule_request_handler(void                * p_context,
+                                     otCoapHeader        * p_header,
+                                     otMessage           * p_message,
+                                     const otMessageInfo * p_message_info)
+{
+	uint16_t         offset = otMessageGetOffset(p_message);
+	uint16_t         length = otMessageGetLength(p_message);
+	uint8_t          payload[SCHEDULE_ENTRIES_NUM * SCHEDULE_ENTRY_LENGTH];
+	schedule_entry_t entry;
+	bool             changed = false;
+	uint8_t          i;
+	PERF_START(start);
+
+	do
+	{
+		if (otCoapHeaderGetType(p_header) != OT_COAP_TYPE_CONFIRMABLE &&
+			otCoapHeaderGetType(p_header) != OT_COAP_TYPE_NON_CONFIRMABLE)
+		{
+			break;
+		}
+
+		if (otCoapHeaderGetCode(p_header) == OT_COAP_CODE_GET)
+		{
+			/* the table is read by unicast only */
+			if (0xFF == p_message_info->mSockAddr.mFields.m8[0])
+			{
+				break;
+			}
+
+			length = 0;
+			for (i = 0; i < SCHEDULE_ENTRIES_NUM; i++)
+			{
+				if (m_schedule.entries[i].minute != SCHEDULE_MINUTE_NONE)
+				{
+					payload[length++] = i;
+					payload[length++] = (uint8_t)m_schedule.entries[i].minute;
+					payload[length++] = (uint8_t)(m_schedule.entries[i].minute >> 8);
+					payload[length++] = m_schedule.entries[i].level;
+					payload[length++] = m_schedule.entries[i].transition;
+				}
+			}
+
+			(void)payload_response_send(p_context,
+												 (otCoapHeaderGetType(p_header) == OT_COAP_TYPE_CONFIRMABLE) ?
+												 OT_COAP_TYPE_ACKNOWLEDGMENT : OT_COAP_TYPE_NON_CONFIRMABLE,
+												 OT_COAP_CODE_CONTENT,
+												 otCoapHeaderGetMessageId(p_header),
+												 otCoapHeaderGetToken(p_header),
+												 otCoapHeaderGetTokenLength(p_header),
+												 payload,
+												 length,
+												 p_message_info);
+			break;
+		}
+
+		if (otCoapHeaderGetCode(p_header) != OT_COAP_CODE_PUT)
+		{
+			break;
+		}
+
+		/* entries are read in place, up to the first invalid one */
+		while ((offset + SCHEDULE_ENTRY_LENGTH) <= length)
+		{
+			otMessageRead(p_message, offset, payload, SCHEDULE_ENTRY_LENGTH);
+			offset += SCHEDULE_ENTRY_LENGTH;
+
+			entry.minute = payload[1] | (payload[2] << 8);
+			entry.level = payload[3];
+			entry.transition = payload[4];
+
+			if ((payload[0] >= SCHEDULE_ENTRIES_NUM) || (entry.level > 100) ||
+				 ((entry.minute >= MINUTES_PER_DAY) && (entry.minute != SCHEDULE_MINUTE_NONE)))
+			{
+				NRF_LOG_INFO("Invalid schedule entry\r\n");
+				break;
+			}
+
+			if (0 != memcmp(&m_schedule.entries[payload[0]], &entry, sizeof(entry)))
+			{
+				m_schedule.entries[payload[0]] = entry;
+				changed = true;
+			}
+		}
+
+		if (true == changed)
+		{
+			schedule_save();
 		}
 
-	} while (false);
+		if (otCoapHeaderGetType(p_header) == OT_COAP_TYPE_CONFIRMABLE)
+		{
+			light_response_send(p_context, p_header, p_message_info);
+		}
+
+	} while (false);
+
+	PERF_STOP(m_perf_schedule, start);
+}
+
+
+/* Function to match an attribute value against a query value: a trailing '*'
+   matches any suffix */
+static bool discovery_value_match(const char * p_value, const uint8_t * p_query, uint16_t length)
+{
+	if ((length > 0) && ('*' == p_query[length - 1]))
+	{
+		return (0 == strncmp(p_value, (const char *)p_query, length - 1));
+	}
+
+	return ((strlen(p_value) == length) && (0 == strncmp(p_value, (const char *)p_query, length)));
+}
+
+
+/* Function to get the links matching the query of a discovery request (rt and href filters) */
+static uint8_t discovery_links_match(otCoapHeader * p_header)
+{
+	const otCoapOption * p_option;
+	uint8_t              links = (1 << (sizeof(m_discovery_links) / sizeof(m_discovery_links[0]))) - 1;
+	uint8_t              matching;
+	uint8_t              i;
+
+	for (p_option = otCoapHeaderGetFirstOption(p_header); p_option != NULL; p_option = otCoapHeaderGetNextOption(p_header))
+	{
+		if (p_option->mNumber != OT_COAP_OPTION_URI_QUERY)
+		{
+			continue;
+		}
+
+		matching = 0;
+		for (i = 0; i < (sizeof(m_discovery_links) / sizeof(m_discovery_links[0])); i++)
+		{
+			if ((p_option->mLength > 3) && (0 == memcmp(p_option->mValue, "rt=", 3)))
+			{
+				if (discovery_value_match(m_discovery_links[i].p_type, p_option->mValue + 3, p_option->mLength - 3))
+				{
+					matching |= (1 << i);
+				}
+			}
+			else if ((p_option->mLength > 6) && (0 == memcmp(p_option->mValue, "href=/", 6)))
+			{
+				if (discovery_value_match(m_discovery_links[i].p_uri_path, p_option->mValue + 6, p_option->mLength - 6))
+				{
+					matching |= (1 << i);
+				}
+			}
+		}
+
+		/* the filters add up, an unknown attribute matches no link */
+		links &= matching;
+	}
+
+	return links;
+}
+
+
+/* Function to send the links of a discovery response in link format */
+static otError discovery_response_send(void                * p_context,
+                                       otCoapType            type,
+                                       uint16_t              message_id,
+                                       const uint8_t       * p_token,
+                                       uint8_t               token_length,
+                                       uint8_t               links,
+                                       const otMessageInfo * p_message_info)
+{
+    otError       error = OT_ERROR_NO_BUFS;
+    otCoapHeader  header;
+    otCoapOption  option;
+    otMessage   * p_response = NULL;
+    uint8_t       format = DISCOVERY_CONTENT_FORMAT;
+    char          payload[DISCOVERY_PAYLOAD_MAX];
+    int           length = 0;
+    uint8_t       i;
+
+    for (i = 0; i < (sizeof(m_discovery_links) / sizeof(m_discovery_links[0])); i++)
+    {
+        if ((links & (1 << i)) && (length < (int)sizeof(payload)))
+        {
+            length += snprintf(&payload[length], sizeof(payload) - length, "%s</%s>;rt=\"%s\"",
+                               (length > 0) ? "," : "", m_discovery_links[i].p_uri_path, m_discovery_links[i].p_type);
+            if ((m_discovery_links[i].endpoints > 0) && (length < (int)sizeof(payload)))
+            {
+                length += snprintf(&payload[length], sizeof(payload) - length, ";ep=%d", m_discovery_links[i].endpoints);
+            }
+        }
+    }
+
+    if (length >= (int)sizeof(payload))
+    {
+        return OT_ERROR_NO_BUFS;
+    }
+
+    do
+    {
+        otCoapHeaderInit(&header, type, OT_COAP_CODE_CONTENT);
+        otCoapHeaderSetMessageId(&header, message_id);
+        otCoapHeaderSetToken(&header, p_token, token_length);
+
+        option.mNumber = OT_COAP_OPTION_CONTENT_FORMAT;
+        option.mLength = sizeof(format);
+        option.mValue = &format;
+        error = otCoapHeaderAppendOption(&header, &option);
+        if (error != OT_ERROR_NONE)
+        {
+            break;
+        }
+
+        if (length > 0)
+        {
+            otCoapHeaderSetPayloadMarker(&header);
+        }
+
+        error = OT_ERROR_NO_BUFS;
+        p_response = otCoapNewMessage(p_context, &header);
+        if (p_response == NULL)
+        {
+            break;
+        }
+
+        error = otMessageAppend(p_response, payload, (uint16_t)length);
+        if (error != OT_ERROR_NONE)
+        {
+            break;
+        }
+
+        error = otCoapSendResponse(p_context, p_response, p_message_info);
+
+    } while (false);
+
+    if (error != OT_ERROR_NONE && p_response != NULL)
+    {
+        otMessageFree(p_response);
+    }
+
+    return error;
 }
 
 
-/* Function to handle light request */
-static void light_request_handler(void                * p_context,
-                                  otCoapHeader        * p_header,
-                                  otMessage           * p_message,
-                                  const otMessageInfo * p_message_info)
+/* Resource discovery request handler. A multicast query is answered after a random
+   delay up to DISCOVERY_LEISURE, and not at all when no link matches its filter */
+static void discovery_request_handler(void                * p_context,
+                                      otCoapHeader        * p_header,
+                                      otMessage           * p_message,
+                                      const otMessageInfo * p_message_info)
 {
-	(void)p_message;
-	uint8_t command;
+    (void)p_message;
+    otMessageInfo message_info;
+    uint8_t       links;
 
-	do
-	{
-		if (otCoapHeaderGetType(p_header) != OT_COAP_TYPE_CONFIRMABLE &&
-			otCoapHeaderGetType(p_header) != OT_COAP_TYPE_NON_CONFIRMABLE)
-		{
-			break;
-		}
+    if (otCoapHeaderGetCode(p_header) != OT_COAP_CODE_GET)
+    {
+        return;
+    }
 
-		if (otCoapHeaderGetCode(p_header) != OT_COAP_CODE_PUT)
-		{
-			break;
-		}
+    m_discovery.queries++;
+    links = discovery_links_match(p_header);
 
-		if (otMessageRead(p_message, otMessageGetOffset(p_message), &command, 1) != 1)
-		{
-			NRF_LOG_INFO("light handler - missing command\r\n");
-		}
+    /* answer from the mesh-local EID: the requester caches a stable address */
+    message_info = *p_message_info;
+    message_info.mSockAddr = *otThreadGetMeshLocalEid(p_context);
 
-		switch (command)
-		{
-			case LIGHT_TOGGLE:
-				light_toggle();
-         	break;
-			case LIGHT_ON:
-				light_on();
-				break;
-			case LIGHT_OFF:
-				light_off(); 
-				break;
-         default:
-				/* not supported command: do nothing */
-         	break;
-		}
+    if (0xFF != p_message_info->mSockAddr.mFields.m8[0])
+    {
+        (void)discovery_response_send(p_context,
+                                      (otCoapHeaderGetType(p_header) == OT_COAP_TYPE_CONFIRMABLE) ?
+                                      OT_COAP_TYPE_ACKNOWLEDGMENT : OT_COAP_TYPE_NON_CONFIRMABLE,
+                                      otCoapHeaderGetMessageId(p_header),
+                                      otCoapHeaderGetToken(p_header),
+                                      otCoapHeaderGetTokenLength(p_header),
+                                      links,
+                                      &message_info);
+        return;
+    }
 
-		if (otCoapHeaderGetType(p_header) == OT_COAP_TYPE_CONFIRMABLE)
-		{
-			light_response_send(p_context, p_header, p_message_info);
-		}
+    if ((0 == links) || (otCoapHeaderGetTokenLength(p_header) > DISCOVERY_TOKEN_MAX))
+    {
+        m_discovery.suppressed++;
+        return;
+    }
 
-	} while (false);
+    /* a newer query replaces the pending one */
+    m_discovery.pending = true;
+    m_discovery.links = links;
+    m_discovery.token_length = otCoapHeaderGetTokenLength(p_header);
+    memcpy(m_discovery.token, otCoapHeaderGetToken(p_header), m_discovery.token_length);
+    m_discovery.message_info = message_info;
+
+    app_timer_stop(m_discovery_timer);
+    app_timer_start(m_discovery_timer, APP_TIMER_TICKS(1 + (otPlatRandomGet() % DISCOVERY_LEISURE)), NULL);
 }
 
 
@@ -427,6 +2264,7 @@ static otError provisioning_response_send(void                * p_context,
     otError      error = OT_ERROR_NO_BUFS;
     otCoapHeader header;
     otMessage  * p_response;
+    uint16_t     rloc16;
 
     do
     {
@@ -454,6 +2292,14 @@ static otError provisioning_response_send(void                * p_context,
             break;
         }
 
+        /* locator, so the controller can estimate the route cost to this light */
+        rloc16 = otThreadGetRloc16(p_context);
+        error = otMessageAppend(p_response, &rloc16, sizeof(rloc16));
+        if (error != OT_ERROR_NONE)
+        {
+            break;
+        }
+
         error = otCoapSendResponse(p_context, p_response, p_message_info);
 
     } while (false);
@@ -475,13 +2321,10 @@ static void provisioning_request_handler(void                * p_context,
 {
     (void)p_message;
     otMessageInfo message_info;
+    PERF_START(start);
 
-    if (!m_app.enable_provisioning)
-    {
-        return;
-    }
-
-    if (otCoapHeaderGetType(p_header) == OT_COAP_TYPE_NON_CONFIRMABLE &&
+    if (m_app.enable_provisioning &&
+        otCoapHeaderGetType(p_header) == OT_COAP_TYPE_NON_CONFIRMABLE &&
         otCoapHeaderGetCode(p_header) == OT_COAP_CODE_GET)
     {
         message_info = *p_message_info;
@@ -492,7 +2335,141 @@ static void provisioning_request_handler(void                * p_context,
             provisioning_disable(p_context);
         }
     }
+
+    PERF_STOP(m_perf_provisioning, start);
+}
+
+
+/* Counters resources request handling: GET reads the counters, DELETE clears
+   them. Multicast requests are ignored. */
+static void counters_request_handle(void                * p_context,
+                                    otCoapHeader        * p_header,
+                                    const otMessageInfo * p_message_info,
+                                    counters_read_t       read,
+                                    counters_reset_t      reset)
+{
+    uint8_t    payload[STATS_REPORT_MAX];
+    uint16_t   length = 0;
+    otCoapCode code;
+
+    if ((otCoapHeaderGetType(p_header) != OT_COAP_TYPE_CONFIRMABLE &&
+         otCoapHeaderGetType(p_header) != OT_COAP_TYPE_NON_CONFIRMABLE) ||
+        (0xFF == p_message_info->mSockAddr.mFields.m8[0]))
+    {
+        return;
+    }
+
+    if (otCoapHeaderGetCode(p_header) == OT_COAP_CODE_GET)
+    {
+        length = read(p_header, payload, sizeof(payload));
+        code = OT_COAP_CODE_CONTENT;
+    }
+    else if (otCoapHeaderGetCode(p_header) == OT_COAP_CODE_DELETE)
+    {
+        reset();
+        code = OT_COAP_CODE_DELETED;
+    }
+    else
+    {
+        return;
+    }
+
+    (void)payload_response_send(p_context,
+                                (otCoapHeaderGetType(p_header) == OT_COAP_TYPE_CONFIRMABLE) ?
+                                OT_COAP_TYPE_ACKNOWLEDGMENT : OT_COAP_TYPE_NON_CONFIRMABLE,
+                                code,
+                                otCoapHeaderGetMessageId(p_header),
+                                otCoapHeaderGetToken(p_header),
+                                otCoapHeaderGetTokenLength(p_header),
+                                payload,
+                                length,
+                                p_message_info);
+}
+
+
+/* Network diagnostics snapshot: "?delta" reads the changes since the previous delta read */
+static uint16_t diag_read(otCoapHeader * p_header, uint8_t * p_payload, uint16_t size)
+{
+	return net_diag_snapshot(&m_diag, net_diag_request_mode(p_header), p_payload, size);
+}
+
+
+/* Restart the counts of the network diagnostics */
+static void diag_reset(void)
+{
+	net_diag_reset(&m_diag);
+}
+
+
+/* Network diagnostics request handler */
+static void diag_request_handler(void                * p_context,
+                                 otCoapHeader        * p_header,
+                                 otMessage           * p_message,
+                                 const otMessageInfo * p_message_info)
+{
+    (void)p_message;
+
+    counters_request_handle(p_context, p_header, p_message_info, diag_read, diag_reset);
+}
+
+
+#if PERF_ENABLED
+/* Text report of the execution time counters */
+static uint16_t stats_read(otCoapHeader * p_header, uint8_t * p_payload, uint16_t size)
+{
+	(void)p_header;
+
+	return perf_report(m_perf_counters, sizeof(m_perf_counters) / sizeof(m_perf_counters[0]), (char *)p_payload, size);
+}
+
+
+/* Clear the execution time counters */
+static void stats_reset(void)
+{
+	uint8_t i;
+
+	for (i = 0; i < (sizeof(m_perf_counters) / sizeof(m_perf_counters[0])); i++)
+	{
+		perf_reset(m_perf_counters[i]);
+	}
+}
+
+
+/* Execution time counters request handler */
+static void stats_request_handler(void                * p_context,
+                                  otCoapHeader        * p_header,
+                                  otMessage           * p_message,
+                                  const otMessageInfo * p_message_info)
+{
+    (void)p_message;
+
+    counters_request_handle(p_context, p_header, p_message_info, stats_read, stats_reset);
+}
+
+
+/* CLI command to show or clear the execution time counters: stats | stats reset */
+static void cli_stats_command(int argc, char * argv[])
+{
+	char report[STATS_REPORT_MAX];
+
+	if (argc == 0)
+	{
+		(void)perf_report(m_perf_counters, sizeof(m_perf_counters) / sizeof(m_perf_counters[0]), report, sizeof(report));
+		otCliUartOutputFormat("%s", report);
+	}
+	else if ((argc == 1) && (0 == strcmp(argv[0], "reset")))
+	{
+		stats_reset();
+	}
+	else
+	{
+		otCliUartAppendResult(OT_ERROR_INVALID_ARGS);
+		return;
+	}
+
+	otCliUartAppendResult(OT_ERROR_NONE);
 }
+#endif
 
 
 /* State change handler */
@@ -503,6 +2480,18 @@ static void role_change_handler(void * p_context, otDeviceRole role)
         case OT_DEVICE_ROLE_CHILD:
         case OT_DEVICE_ROLE_ROUTER:
         case OT_DEVICE_ROLE_LEADER:
+            if (0 == m_boot.attached)
+            {
+                m_boot.attached = otPlatAlarmGetNow();
+                NRF_LOG_INFO("boot: light %d ms, network %d ms, attached %d ms\r\n",
+                             m_boot.light, m_boot.network, m_boot.attached);
+            }
+
+            /* the schedule needs the time of day, lost at the reset */
+            if (false == m_clock.valid)
+            {
+                (void)time_query_send(p_context, TIME_QUERY_ADDRESS);
+            }
             break;
 
         case OT_DEVICE_ROLE_DISABLED:
@@ -526,8 +2515,8 @@ static void state_changed_callback(uint32_t flags, void * p_context)
 }
 
 
-/* Buttons events handler */
-static void bsp_event_handler(bsp_event_t event)
+/* Buttons events processing, in the main loop */
+static void button_event_process(bsp_event_t event)
 {
     switch (event)
     {
@@ -550,10 +2539,185 @@ static void bsp_event_handler(bsp_event_t event)
 }
 
 
+/* Buttons events handler: runs in interrupt context, so the event is only
+   posted to the main loop where the OpenThread calls are made */
+static void bsp_event_handler(bsp_event_t event)
+{
+	(void)event_queue_post(&m_events, APP_EVENT_BUTTON, (uint8_t)event, 0);
+}
+
+
+/* Function to process the events posted by the interrupt handlers */
+static void events_process(void)
+{
+	static uint32_t overflows = 0;
+	event_t         event;
+
+	while (true == event_queue_get(&m_events, &event))
+	{
+		switch (event.type)
+		{
+			case APP_EVENT_BUTTON:
+				button_event_process((bsp_event_t)event.param);
+				break;
+
+			case APP_EVENT_PROVISIONING_EXPIRED:
+				provisioning_disable(m_app.p_ot_instance);
+				break;
+
+			case APP_EVENT_RAMP_STEP:
+				/* a late loop runs the missed steps, so the ramp keeps its speed */
+				ramp_process();
+				break;
+
+			case APP_EVENT_STATE_SAVE:
+				state_save();
+				break;
+
+			case APP_EVENT_COALESCE:
+				coalesce_apply();
+				break;
+
+			case APP_EVENT_SCHEDULE:
+				schedule_process();
+				break;
+
+			case APP_EVENT_TIME_QUERY:
+				if (true == m_time_query.pending)
+				{
+					m_time_query.pending = false;
+					(void)time_answer_send(m_app.p_ot_instance,
+												  OT_COAP_TYPE_NON_CONFIRMABLE,
+												  (uint16_t)otPlatRandomGet(),
+												  m_time_query.token,
+												  m_time_query.token_length,
+												  &m_time_query.message_info);
+				}
+				break;
+
+			case APP_EVENT_DISCOVERY:
+				if (true == m_discovery.pending)
+				{
+					m_discovery.pending = false;
+					(void)discovery_response_send(m_app.p_ot_instance,
+															OT_COAP_TYPE_NON_CONFIRMABLE,
+															(uint16_t)otPlatRandomGet(),
+															m_discovery.token,
+															m_discovery.token_length,
+															m_discovery.links,
+															&m_discovery.message_info);
+				}
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	/* the counter belongs to the producer: only read it */
+	if (m_events.overflows != overflows)
+	{
+		overflows = m_events.overflows;
+		NRF_LOG_WARNING("events lost: %d\r\n", overflows);
+	}
+}
+
+
+/* Function to sleep until the next interrupt when no work is left. An interrupt
+   that comes after the check sets the event register, so the wait returns at
+   once and its work is done in the next loop: no wake-up is lost. */
+static void idle_sleep(void)
+{
+	uint32_t now = otPlatAlarmGetNow();
+
+	if ((now - m_power.log_time) >= POWER_LOG_INTERVAL)
+	{
+		m_power.log_time = now;
+		NRF_LOG_INFO("active %d ms sleep %d ms sleeps %d\r\n",
+						 now - m_power.start - m_power.sleep_time, m_power.sleep_time, m_power.sleeps);
+		NRF_LOG_INFO("commands %d dropped %d merged %d sources replaced %d\r\n",
+						 m_overload.accepted, m_overload.dropped, m_overload.merged, m_overload.evictions);
+	}
+
+	if (true == otTaskletsArePending(m_app.p_ot_instance))
+	{
+		return;
+	}
+
+#if (__FPU_USED == 1)
+	__set_FPSCR(__get_FPSCR() & ~(FPU_EXCEPTION_MASK));
+	(void)__get_FPSCR();
+	NVIC_ClearPendingIRQ(FPU_IRQn);
+#endif
+
+	(void)sd_app_evt_wait();
+
+	/* ms differences add up to the sleep time on average, short sleeps included */
+	m_power.sleep_time += otPlatAlarmGetNow() - now;
+	m_power.sleeps++;
+}
+
+
 /* Provisioning timer handler */
 static void provisioning_timer_handler(void * p_context)
 {
-    provisioning_disable(p_context);
+    (void)p_context;
+
+    (void)event_queue_post(&m_events, APP_EVENT_PROVISIONING_EXPIRED, 0, 0);
+}
+
+
+/* Light state timer handler: the flash write runs in the main loop */
+static void state_timer_handler(void * p_context)
+{
+    (void)p_context;
+
+    (void)event_queue_post(&m_events, APP_EVENT_STATE_SAVE, 0, 0);
+}
+
+
+/* Coalescing timer handler: the waiting commands are applied in the main loop */
+static void coalesce_timer_handler(void * p_context)
+{
+    (void)p_context;
+
+    (void)event_queue_post(&m_events, APP_EVENT_COALESCE, 0, 0);
+}
+
+
+/* Schedule timer handler: the entries run in the main loop */
+static void schedule_timer_handler(void * p_context)
+{
+    (void)p_context;
+
+    (void)event_queue_post(&m_events, APP_EVENT_SCHEDULE, 0, 0);
+}
+
+
+/* Time timer handler: the answer to the time query is sent from the main loop */
+static void time_timer_handler(void * p_context)
+{
+    (void)p_context;
+
+    (void)event_queue_post(&m_events, APP_EVENT_TIME_QUERY, 0, 0);
+}
+
+
+/* Discovery timer handler: the response is sent from the main loop */
+static void discovery_timer_handler(void * p_context)
+{
+    (void)p_context;
+
+    (void)event_queue_post(&m_events, APP_EVENT_DISCOVERY, 0, 0);
+}
+
+
+/* Ramp timer handler: the step runs in the main loop, where PWM updates can wait */
+static void ramp_timer_handler(void * p_context)
+{
+    (void)p_context;
+
+    (void)event_queue_post(&m_events, APP_EVENT_RAMP_STEP, 0, 0);
 }
 
 
@@ -574,16 +2738,25 @@ static void led_timer_handler(void * p_context)
 
 
 /* Thread Initialization */
-static void thread_init(void)
+static void thread_instance_init(void)
 {
-    otInstance * p_instance;
-
     PlatformInit(0, NULL);
 
-    p_instance = otInstanceInit();
-    assert(p_instance);
+    /* restores the network data from the settings, no radio activity yet */
+    m_app.p_ot_instance = otInstanceInit();
+    assert(m_app.p_ot_instance);
+}
+
+
+/* Function to start the Thread stack: the attach goes on in the background */
+static void thread_init(void)
+{
+    otInstance * p_instance = m_app.p_ot_instance;
 
     otCliUartInit(p_instance);
+#if PERF_ENABLED
+    otCliUartSetUserCommands(m_cli_commands, sizeof(m_cli_commands) / sizeof(m_cli_commands[0]));
+#endif
 
     NRF_LOG_INFO("Thread version: %s\r\n", (uint32_t)otGetVersionString());
     NRF_LOG_INFO("Network name:   %s\r\n", (uint32_t)otThreadGetNetworkName(p_instance));
@@ -594,13 +2767,44 @@ static void thread_init(void)
     {
         assert(otLinkSetChannel(p_instance, THREAD_CHANNEL) == OT_ERROR_NONE);
         assert(otLinkSetPanId(p_instance, THREAD_PANID) == OT_ERROR_NONE);
+#if THREAD_CHANNEL_SCAN
+        /* first start: Thread is started once the channel is chosen */
+        assert(otIp6SetEnabled(p_instance, true) == OT_ERROR_NONE);
+        if (channel_scan_start(&m_channel_scan, p_instance, THREAD_PANID, THREAD_CHANNEL, channel_scan_done) == OT_ERROR_NONE)
+        {
+            return;
+        }
+#endif
     }
 
     assert(otIp6SetEnabled(p_instance, true) == OT_ERROR_NONE);
     assert(otThreadSetEnabled(p_instance, true) == OT_ERROR_NONE);
+}
+
+
+#if THREAD_CHANNEL_SCAN
+/* Channel selection end: log the scan and start Thread on the chosen channel */
+static void channel_scan_done(channel_scan_t * p_scan)
+{
+    uint8_t i;
+
+    if (true == p_scan->network_found)
+    {
+        NRF_LOG_INFO("channel scan: network found on channel %d\r\n", p_scan->channel);
+    }
+    else
+    {
+        for (i = 0; i < CHANNEL_SCAN_CHANNELS_NUM; i++)
+        {
+            NRF_LOG_INFO("channel %d: max %d dBm\r\n", CHANNEL_SCAN_FIRST + i, p_scan->max_rssi[i]);
+        }
+        NRF_LOG_INFO("channel scan: forming on channel %d after %d ms\r\n", p_scan->channel, p_scan->duration);
+    }
 
-    m_app.p_ot_instance = p_instance;
+    (void)otLinkSetChannel(p_scan->p_instance, p_scan->channel);
+    (void)otThreadSetEnabled(p_scan->p_instance, true);
 }
+#endif
 
 
 /* Init CoAp */
@@ -609,10 +2813,34 @@ static void coap_init()
 	m_app.light_resource.mContext = m_app.p_ot_instance;
 	m_app.dim_resource.mContext = m_app.p_ot_instance;
 	m_app.provisioning_resource.mContext = m_app.p_ot_instance;
+	m_app.group_resource.mContext = m_app.p_ot_instance;
+	m_app.ramp_resource.mContext = m_app.p_ot_instance;
+	m_app.id_resource.mContext = m_app.p_ot_instance;
+	m_app.batch_resource.mContext = m_app.p_ot_instance;
+	m_app.discovery_resource.mContext = m_app.p_ot_instance;
+	m_app.time_resource.mContext = m_app.p_ot_instance;
+	m_app.schedule_resource.mContext = m_app.p_ot_instance;
+	m_app.diag_resource.mContext = m_app.p_ot_instance;
+#if PERF_ENABLED
+	m_app.stats_resource.mContext = m_app.p_ot_instance;
+#endif
 
 	assert(otCoapStart(m_app.p_ot_instance, OT_DEFAULT_COAP_PORT) == OT_ERROR_NONE);
 	assert(otCoapAddResource(m_app.p_ot_instance, &m_app.light_resource) == OT_ERROR_NONE);
 	assert(otCoapAddResource(m_app.p_ot_instance, &m_app.dim_resource) == OT_ERROR_NONE);
+	assert(otCoapAddResource(m_app.p_ot_instance, &m_app.group_resource) == OT_ERROR_NONE);
+	assert(otCoapAddResource(m_app.p_ot_instance, &m_app.ramp_resource) == OT_ERROR_NONE);
+	assert(otCoapAddResource(m_app.p_ot_instance, &m_app.id_resource) == OT_ERROR_NONE);
+	assert(otCoapAddResource(m_app.p_ot_instance, &m_app.batch_resource) == OT_ERROR_NONE);
+	assert(otCoapAddResource(m_app.p_ot_instance, &m_app.discovery_resource) == OT_ERROR_NONE);
+	assert(otCoapAddResource(m_app.p_ot_instance, &m_app.time_resource) == OT_ERROR_NONE);
+	assert(otCoapAddResource(m_app.p_ot_instance, &m_app.schedule_resource) == OT_ERROR_NONE);
+	assert(otCoapAddResource(m_app.p_ot_instance, &m_app.diag_resource) == OT_ERROR_NONE);
+#if PERF_ENABLED
+	assert(otCoapAddResource(m_app.p_ot_instance, &m_app.stats_resource) == OT_ERROR_NONE);
+#endif
+
+	net_diag_init(&m_diag, m_app.p_ot_instance, m_diag_counters, sizeof(m_diag_counters) / sizeof(m_diag_counters[0]));
 }
 
 
@@ -624,6 +2852,12 @@ static void timer_init(void)
 
     app_timer_create(&m_provisioning_timer, APP_TIMER_MODE_SINGLE_SHOT, provisioning_timer_handler);
     app_timer_create(&m_led_timer, APP_TIMER_MODE_REPEATED, led_timer_handler);
+    app_timer_create(&m_ramp_timer, APP_TIMER_MODE_REPEATED, ramp_timer_handler);
+    app_timer_create(&m_state_timer, APP_TIMER_MODE_SINGLE_SHOT, state_timer_handler);
+    app_timer_create(&m_discovery_timer, APP_TIMER_MODE_SINGLE_SHOT, discovery_timer_handler);
+    app_timer_create(&m_coalesce_timer, APP_TIMER_MODE_SINGLE_SHOT, coalesce_timer_handler);
+    app_timer_create(&m_schedule_timer, APP_TIMER_MODE_SINGLE_SHOT, schedule_timer_handler);
+    app_timer_create(&m_time_timer, APP_TIMER_MODE_SINGLE_SHOT, time_timer_handler);
 }
 
 
@@ -656,13 +2890,13 @@ int main(int argc, char *argv[])
 	ret_code_t err_code;
 
 	NRF_LOG_INIT(NULL);
+	/* the queue is ready before any interrupt source can post to it */
+	event_queue_init(&m_events);
 
-	thread_init();
-	coap_init();
-
-	timer_init();
-	thread_bsp_init();
-	leds_init();
+	/* stage 1: the light output, restored from the settings, comes first.
+	   The OpenThread instance is needed for the settings and the alarm clock,
+	   but the stack is not started yet */
+	thread_instance_init();
 
 	/* 1-channel PWM, 2000Hz, output on DK LED pins. */
 	app_pwm_config_t pwm1_cfg = APP_PWM_DEFAULT_CONFIG_1CH(500L, PWM_CH_PIN_NUM);
@@ -674,19 +2908,42 @@ int main(int argc, char *argv[])
 	err_code = app_pwm_init(&PWM1,&pwm1_cfg, pwm_ready_callback);
 	APP_ERROR_CHECK(err_code);
 	app_pwm_enable(&PWM1);
+	pwm_cycle_ticks = app_pwm_cycle_ticks_get(&PWM1);
 
-	/* set initial light state */
+	/* set initial light state: the one before the power off, dark on the first boot */
 	last_light_state = false; 
+	state_restore();
+	schedule_restore();
 	/* set initial PWM value */     
-	while (false == ready_flag);
-	ready_flag = false;
-	APP_ERROR_CHECK(app_pwm_channel_duty_set(&PWM1, 0, 0));
+	pwm_ticks_set((true == last_light_state) ? last_dim_ticks : 0);
+	m_boot.light = otPlatAlarmGetNow();
+
+	/* stage 2: the local services */
+#if PERF_ENABLED
+	perf_init();
+#endif
+	timer_init();
+	m_power.start = otPlatAlarmGetNow();
+	m_power.log_time = m_power.start;
+	thread_bsp_init();
+	leds_init();
+
+	/* stage 3: the Thread stack and CoAP, the attach completes in the main loop */
+	thread_init();
+	coap_init();
+	state_groups_restore();
+	m_boot.network = otPlatAlarmGetNow();
+	NRF_LOG_INFO("boot: light %d ms, network %d ms\r\n", m_boot.light, m_boot.network);
 
 	/* infinite loop */
 	while (true)
 	{
+		/* all the OpenThread calls run here: interrupts only post events */
+		events_process();
 		otTaskletsProcess(m_app.p_ot_instance);
 		PlatformProcessDrivers(m_app.p_ot_instance);
+		/* sleep until an interrupt if nothing is left to do */
+		idle_sleep();
 	}
 }
 